@@ -0,0 +1,229 @@
+/*
+ * Microbenchmarks of the ramdisk fs core
+ *
+ * Built in userspace with `make bench` (see ramdisk_shim.h), so it can run
+ * under perf or sanitizers without loading the module.
+ *
+ * Usage: ramdisk_bench [-t <MS PER CASE>]
+ *
+ * Every case runs for at least the given time (200 ms by default) and
+ * prints one CSV line to stdout:
+ *
+ *	benchmark,param,value,iterations,ns_per_op
+ *
+ * e.g. "allocate_block,fill_pct,90,2100000,95.3". Blocks, inodes and creates are
+ * measured at several fill levels of the ramdisk, lookups and dentry
+ * insertion at several directory sizes, reads and writes at several sizes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ramdisk_fs.h"
+
+static int case_ms = 200;
+static char msg[RD_MSG_SIZE];
+static rd_ctx *rd;
+
+static void run(const char *name, const char *param, int value, void (*op)(void *arg), void *arg) {
+	u64 start, elapsed;
+	long iters;
+	int i;
+
+	op(arg);
+	iters = 0;
+	start = ktime_get_ns();
+	do {
+		for (i = 0; i < 100; ++i)
+			op(arg);
+		iters += 100;
+		elapsed = ktime_get_ns() - start;
+	} while (elapsed < (u64)case_ms * 1000000);
+	printf("%s,%s,%d,%ld,%.1f\n", name, param, value, iters, (double)elapsed / iters);
+	fflush(stdout);
+}
+
+/*
+ * Start over from an empty ramdisk
+ */
+static void reset(void) {
+	ramfs_exit(rd);
+	rd = ramfs_init(0, "ramdisk");
+	if (rd == NULL) {
+		fprintf(stderr, "Error: Cannot init the ramdisk.\n");
+		exit(1);
+	}
+}
+
+/*
+ * Make a dir /d holding n files /d/f0 ... /d/f<n-1> and return its inode
+ */
+static rd_inode* make_dir(int n) {
+	rd_inode *parent;
+	rd_inode *dir;
+	char path[RD_MAX_PATH_LEN];
+	char filename[RD_MAX_FILENAME];
+	int i;
+
+	msg[0] = 0;
+	ramfs_mkdir(rd, "/d", msg);
+	for (i = 0; i < n; ++i) {
+		sprintf(path, "/d/f%d", i);
+		msg[0] = 0;
+		if (ramfs_create(rd, path, msg) == -1) {
+			fprintf(stderr, "%s", msg);
+			exit(1);
+		}
+	}
+	parse_path(rd, "/d", RD_DIRECTORY, &parent, &dir, filename);
+	return dir;
+}
+
+static void op_allocate_block(void *arg) {
+	free_block(rd, allocate_block(rd));
+}
+
+static void op_allocate_inode(void *arg) {
+	free_inode(rd, allocate_inode(rd, RD_FILE));
+}
+
+static void op_parse_path(void *arg) {
+	rd_inode *parent;
+	rd_inode *file;
+	char filename[RD_MAX_FILENAME];
+
+	parse_path(rd, (const char*)arg, RD_FILE, &parent, &file, filename);
+}
+
+/* add a dentry and free it again, so the dir keeps its size */
+static void op_add_dentry(void *arg) {
+	rd_inode *dir = (rd_inode*)arg;
+	int inode_num;
+
+	add_dentry(rd, dir, dir->inode_num, "bench");
+	free_dentry(rd, find_dentry(rd, dir, "bench", &inode_num));
+}
+
+/* create a file and delete it again, its inode is the first free one past the filled ones */
+static void op_create(void *arg) {
+	msg[0] = 0;
+	ramfs_create(rd, "/c", msg);
+	ramfs_delete(rd, "/c", msg);
+}
+
+struct io_arg {
+	rd_fdt *fdt;
+	int fd;
+	int size;
+	char *buf;
+};
+
+static void op_read(void *arg) {
+	struct io_arg *io = (struct io_arg*)arg;
+
+	msg[0] = 0;
+	ramfs_lseek(io->fdt, io->fd, 0, msg);
+	ramfs_read(io->fdt, io->fd, io->buf, io->size, msg);
+}
+
+static void op_write(void *arg) {
+	struct io_arg *io = (struct io_arg*)arg;
+
+	msg[0] = 0;
+	ramfs_lseek(io->fdt, io->fd, 0, msg);
+	ramfs_write(io->fdt, io->fd, io->buf, io->size, msg);
+}
+
+static void bench_allocators(void) {
+	static const int fills[] = { 0, 50, 90 };
+	int i, j, n;
+
+	for (i = 0; i < (int)(sizeof(fills) / sizeof(fills[0])); ++i) {
+		reset();
+		n = RD_BLOCK_NUM * fills[i] / 100;
+		for (j = 0; j < n; ++j)
+			allocate_block(rd);
+		run("allocate_block", "fill_pct", fills[i], op_allocate_block, NULL);
+	}
+	for (i = 0; i < (int)(sizeof(fills) / sizeof(fills[0])); ++i) {
+		reset();
+		n = RD_INODE_NUM * fills[i] / 100;
+		for (j = 0; j < n; ++j)
+			allocate_inode(rd, RD_FILE);
+		run("allocate_inode", "fill_pct", fills[i], op_allocate_inode, NULL);
+	}
+	for (i = 0; i < (int)(sizeof(fills) / sizeof(fills[0])); ++i) {
+		reset();
+		n = RD_INODE_NUM * fills[i] / 100;
+		for (j = 0; j < n; ++j)
+			allocate_inode(rd, RD_FILE);
+		run("ramfs_create", "fill_pct", fills[i], op_create, NULL);
+	}
+}
+
+static void bench_dirs(void) {
+	/* a dir holds at most RD_MAX_FILE_SIZE / sizeof(rd_dentry) entries, . and .. included */
+	static const int sizes[] = { 8, 32, 64 };
+	char path[RD_MAX_PATH_LEN];
+	rd_inode *dir;
+	int i;
+
+	for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); ++i) {
+		reset();
+		make_dir(sizes[i]);
+		/* the last entry is the worst case of the linear dir scan */
+		sprintf(path, "/d/f%d", sizes[i] - 1);
+		run("parse_path", "dir_entries", sizes[i], op_parse_path, path);
+	}
+	for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); ++i) {
+		reset();
+		dir = make_dir(sizes[i]);
+		run("add_dentry", "dir_entries", sizes[i], op_add_dentry, dir);
+	}
+}
+
+static void bench_io(void) {
+	static const int sizes[] = { 64, 512, 4096, RD_MAX_FILE_SIZE };
+	struct io_arg io;
+	int i;
+
+	io.buf = (char*)malloc(RD_MAX_FILE_SIZE);
+	memset(io.buf, 'x', RD_MAX_FILE_SIZE);
+	for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); ++i) {
+		reset();
+		msg[0] = 0;
+		ramfs_create(rd, "/f", msg);
+		io.fdt = allocate_fdt(rd);
+		io.fd = ramfs_open(io.fdt, "/f", RD_RDWR, msg);
+		io.size = sizes[i];
+		op_write(&io);
+		run("ramfs_write", "bytes", sizes[i], op_write, &io);
+		run("ramfs_read", "bytes", sizes[i], op_read, &io);
+		free_fdt(io.fdt);
+	}
+	free(io.buf);
+}
+
+int main(int argc, char **argv) {
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:")) != -1) {
+		if (opt == 't' && atoi(optarg) > 0) {
+			case_ms = atoi(optarg);
+		} else {
+			fprintf(stderr, "Usage: %s [-t <MS PER CASE>]\n", argv[0]);
+			return 1;
+		}
+	}
+	rd = ramfs_init(0, "ramdisk");
+	if (rd == NULL) {
+		fprintf(stderr, "Error: Cannot init the ramdisk.\n");
+		return 1;
+	}
+	printf("benchmark,param,value,iterations,ns_per_op\n");
+	bench_allocators();
+	bench_dirs();
+	bench_io();
+	ramfs_exit(rd);
+	return 0;
+}
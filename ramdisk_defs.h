@@ -6,8 +6,9 @@
 #define RD_SUPERBLOCK_SIZE  RD_BLOCK_SIZE           /* The size of superblock, default 1 block */
 #define RD_INODES_SIZE      (128 * RD_BLOCK_SIZE)   /* The size of inodes, default 128 block */
 #define RD_BLOCKBITMAP_SIZE (2 * RD_BLOCK_SIZE)     /* The size of blockbitmap, default 2 block */
-#define RD_DATA_BLOCKS_SIZE (RD_DISK_SIZE - RD_SUPERBLOCK_SIZE - RD_INODES_SIZE - RD_BLOCKBITMAP_SIZE)
-#define RD_INODE_NUM        (RD_INODES_SIZE / (sizeof(rd_inode)))
+#define RD_BLOCKREFS_SIZE   (16 * RD_BLOCK_SIZE)    /* The size of block refcounts, one short per data block, default 16 block */
+#define RD_DATA_BLOCKS_SIZE (RD_DISK_SIZE - RD_SUPERBLOCK_SIZE - RD_INODES_SIZE - RD_BLOCKBITMAP_SIZE - RD_BLOCKREFS_SIZE)
+#define RD_INODE_NUM        (RD_INODES_SIZE / (sizeof(rd_inode) + sizeof(rd_block_map)))
 #define RD_BLOCK_NUM        (RD_DATA_BLOCKS_SIZE / RD_BLOCK_SIZE)
 
 /* File Type Definition */
@@ -15,10 +16,13 @@
 #define RD_DIRECTORY        0xbeef                  
 #define RD_AVAILABLE        0xabcd
 #define RD_FILEORDIR        0xdcba
+#define RD_RECLAIMING       0xfeed                  /* freed, reusable after an RCU grace period */
 
 /* Block Status Definition */
 #define RD_FREE             0
 #define RD_ALLOCATED        1
+#define RD_NO_BLOCK         0xffffffff              /* unused entry of an inode's block map */
+#define RD_COMPRESSED_BLOCK 0x80000000              /* block map entry is the slot of a compressed block */
 
 /* ioctl commands */
 #define RD_CREATE           0xf1 
@@ -34,6 +38,22 @@
 #define RD_SHOWINODES       0xfb
 #define RD_SHOWFDT          0xfc
 #define RD_HELP             0xfd
+#define RD_FALLOCATE        0xd0
+#define RD_TRUNCATE         0xd1
+#define RD_SNAPSHOT         0xd2
+#define RD_REFLINK          0xd3
+#define RD_COMPRESS         0xd4
+#define RD_DEDUP            0xd5
+#define RD_SAVE             0xd6
+#define RD_RESTORE          0xd7
+#define RD_SYNC             0xd8
+#define RD_RMDIR            0xd9
+#define RD_RMTREE           0xda
+#define RD_RENAME           0xdb
+#define RD_STAT             0xdc
+#define RD_SUBMIT           0xdd
+#define RD_REAP             0xde
+#define RD_EVENTFD          0xdf
 #define RD_EXIT             0xff
 
 /* File Definitions */
@@ -44,6 +64,15 @@
 #define RD_RDONLY           0xe1
 #define RD_WRONLY           0xe2
 #define RD_RDWR             0xe3
+#define RD_APPEND           0x100                   /* OR-ed with RD_WRONLY/RD_RDWR: every write goes to EOF */
+#define RD_ACCMODE          0xff                    /* mask for the access mode part of a mode */
+
+/* Message Definitions */
+#define RD_MSG_SIZE         4096                    /* The size of the message buffer returned by each ioctl */
+
+/* Image Definitions */
+#define RD_IMAGE_MAGIC      "RDIMAGE"
+#define RD_IMAGE_VERSION    4
 
 /* Path Definitions */
 #define RD_MAX_PATH_LEN     128
\ No newline at end of file
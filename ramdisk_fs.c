@@ -1,152 +1,865 @@
 #include "ramdisk_fs.h"
 #include "ramdisk_defs.h"
+#include "ramdisk_param.h"
+#define CREATE_TRACE_POINTS
+#include "ramdisk_trace.h"
 
-static rd_superblock *superblock;
-static rd_inode *inode_list;
-static char *first_block;			/* first block addr of the whole ramdisk */
-static char *first_inodes_block;	/* first block addr of inodes region */
-static char *first_bitmap_block;	/* first block addr of bitmap region */
-static char *first_data_block;		/* first block addr of data region */
+#define RD_INIT_CHUNK		64		/* data blocks initialized at a time past block_hwm */
+#define RD_DISK_UNITS		(RD_DISK_SIZE / RD_BLOCK_SIZE)	/* write-back granularity */
+#define RD_EXTENT_BUCKETS	12		/* ilog2(RD_BLOCK_NUM) + 1, free extents by length */
+#define RD_REGIONS		6		/* memory regions in the placement report */
+#define RD_REGION_LINE		160		/* room for one region's placement */
 
-static rd_file **fd_list;
+/*
+ * Locking
+ *
+ * sb_lock protects the superblock counters, the block bitmap and the
+ * RD_AVAILABLE state of every inode, i.e. everything the allocators touch.
+ * Each fd table has its own lock, fdt_tables_lock only protects the list
+ * of tables. Each inode has its own rw_semaphore: for a
+ * directory it serializes namespace ops (create/mkdir/delete take it for
+ * write, lookups for read), for a regular file it serializes data I/O.
+ *
+ * sb_lock also protects the block refcounts. A block with a refcount of 1
+ * belongs to exactly one inode and is written in place under that inode's
+ * lock; a shared block is never written, ramfs_write copies it first.
+ *
+ * freeze_sem is taken for read by every op that looks at the tree or file
+ * data and for write by the ops that need all of it to hold still: a
+ * snapshot, a dedup pass, saving or restoring an image, removing a tree or
+ * moving a dir. Lock order:
+ * freeze_sem -> parent dir -> file inode -> fdt_tables_lock -> fdt->lock / sb_lock.
+ * A rename locks both parent dirs, the one with the lower inode number first.
+ *
+ * Path lookups take no locks at all, they walk the directories under
+ * rcu_read_lock. add_dentry publishes a dentry's name before its inode_num
+ * and a dir's file_size last, and a freed dentry or inode is only recycled
+ * after a grace period (see free_dentry/free_inode), so a lockless reader
+ * never sees a half-written or reused entry.
+ */
+
+/* In-memory state of an inode, kept outside the ramdisk memory */
+typedef struct {
+	struct rw_semaphore rwsem;
+	struct rcu_work reclaim_work;	/* makes the inode available after a grace period */
+	rd_ctx *rd;
+} rd_inode_info;
+
+/* A freed dentry waiting for a grace period before its slot is reused */
+typedef struct {
+	struct rcu_work reclaim_work;
+	rd_dentry *dentry;
+	rd_ctx *rd;
+} rd_dentry_reclaim;
+
+#define RD_DENTRY_FREE		-1		/* slot can be reused by add_dentry */
+#define RD_DENTRY_DEAD		-2		/* freed, lockless readers may still see it */
+
+/* A compressed block in the pool, see "Compressed blocks" below */
+typedef struct {
+	unsigned short len;		/* compressed length of data */
+	unsigned short refs;	/* number of block maps pointing at this entry */
+	char data[];
+} rd_centry;
+
+#define RD_COMPRESSED		1UL		/* low bit of a block map entry */
+#define RD_POOL_SLOT_SIZE	64
+#define RD_POOL_SLOTS		(RD_BLOCK_SIZE / RD_POOL_SLOT_SIZE)
+/* an entry is only worth storing if it saves at least one slot */
+#define RD_CENTRY_MAX		(RD_BLOCK_SIZE - RD_POOL_SLOT_SIZE - (int)sizeof(rd_centry))
+
+/* Compression counters */
+typedef struct {
+	int entries;				/* compressed blocks in the pool */
+	int bytes;					/* their total compressed length */
+	int pool_blocks;			/* blocks holding them */
+	atomic_t reads;				/* reads served by decompressing */
+	atomic_t inflates;			/* entries inflated back by a write */
+} rd_compress_stats;
+
+/* Dedup counters, see "Deduplication" below */
+typedef struct {
+	int scanned;				/* blocks hashed by all passes */
+	int hits;					/* blocks merged into an identical one */
+} rd_dedup_stats;
+
+/* Write-back counters, see "Write-back" below */
+typedef struct {
+	int passes;
+	int units;
+	int errors;
+	u64 bytes;
+	u64 write_ns;			/* time spent writing and syncing the file */
+	u64 freeze_ns;			/* time the ramdisk was frozen for flushes */
+	u64 max_freeze_ns;
+	unsigned long last_lag;		/* age of the oldest change a flush wrote, jiffies */
+	unsigned long max_lag;
+} rd_flush_stats;
+
+/*
+ * Statistics, read through /proc/ramdisk_stats
+ *
+ * Every CPU counts into its own copy with this_cpu ops, so the hot paths
+ * never share a cache line; show_stats adds the copies up. Counters are
+ * approximate while ops run, and reset_stats may lose updates that race it.
+ */
+typedef struct {
+	u64 ops;
+	u64 bytes;					/* moved by read/write */
+	u64 errors;					/* ops that returned -1 */
+	u64 ns;						/* total latency */
+	u64 hist[RD_STAT_BUCKETS];	/* ops with ilog2(latency in ns) == i, the last bucket takes the rest */
+} rd_op_stats;
+
+typedef struct {
+	rd_op_stats ops[RD_STAT_CMDS];
+	u64 block_allocs;			/* allocate_block calls that got a block */
+	u64 block_scanned;			/* bitmap bits they looked at */
+	u64 block_fails;
+	u64 run_allocs;				/* contiguous runs handed out by allocate_blocks */
+	u64 run_scanned;
+	u64 run_misses;				/* no run long enough, fell back to single blocks */
+	u64 inode_allocs;
+	u64 inode_scanned;			/* inodes looked at by allocate_inode */
+	u64 inode_fails;
+} rd_cpu_stats;
+
+/*
+ * A ramdisk instance. Each has its own memory, locks, fd tables, background
+ * works and counters; instances share nothing but the module params, so
+ * workloads sharded over them never contend with each other.
+ */
+struct rd_ctx {
+	int id;
+	char name[RD_NAME_LEN];		/* of its /proc entries */
+	int node;					/* NUMA node it is pinned to, or NUMA_NO_NODE */
+
+	rd_superblock *superblock;
+	rd_inode *inode_list;
+	rd_block_map *block_maps;	/* block map n belongs to inode n */
+	char *first_block;			/* first block addr of the whole ramdisk */
+	char *first_inodes_block;	/* first block addr of inodes region */
+	char *first_bitmap_block;	/* first block addr of bitmap region */
+	unsigned short *block_refs;	/* first block addr of refcounts region */
+	char *first_data_block;		/* first block addr of data region */
+	struct page **disk_pages;	/* the pages of the disk, NULL if it was vmalloc'd */
+	int disk_nr_pages;
+	unsigned int disk_order;	/* of each of them */
+
+	spinlock_t sb_lock;
+	spinlock_t fdt_tables_lock;
+	struct percpu_rw_semaphore freeze_sem;
+	struct list_head fdt_tables;	/* every open of the device has its own fd table, delete scans all of them */
+	rd_inode_info *inode_infos;
+	struct workqueue_struct *reclaim_wq;
+
+	unsigned char *pool_map;	/* used slots of every pool block, 0 for other blocks */
+	unsigned long *block_atime;	/* jiffies of the last access to every block */
+	struct delayed_work compress_work;
+	struct mutex compress_mutex;	/* one compression pass at a time */
+	void *compress_wrkmem;		/* LZ4 state, allocated by the first pass */
+	rd_compress_stats compress_stats;
+	struct delayed_work dedup_work;
+	rd_dedup_stats dedup_stats;
+
+	const char *backing;		/* write-back file, NULL if none */
+	struct file *backing_filp;
+	unsigned long *dirty_map;	/* one bit per RD_BLOCK_SIZE of the disk, NULL without a backing file */
+	unsigned long dirty_since;	/* jiffies of the oldest change not flushed yet, 0 if none */
+	char *flush_buf;			/* copy of the dirty units taken by a flush */
+	unsigned long *flush_map;		/* and which units it holds */
+	struct delayed_work flush_work;
+	struct mutex flush_mutex;	/* one flush at a time */
+	rd_flush_stats flush_stats;
+
+	rd_cpu_stats __percpu *cpu_stats;
+};
+
+static inline unsigned int* inode_map(rd_ctx *rd, rd_inode *inode) {
+	return rd->block_maps[inode->inode_num].blocks;
+}
+
+static inline struct rw_semaphore* inode_sem(rd_ctx *rd, rd_inode *inode) {
+	return &rd->inode_infos[inode->inode_num].rwsem;
+}
+
+static inline bool block_compressed(char *block) {
+	return (unsigned long)block & RD_COMPRESSED;
+}
+
+static inline rd_centry* block_centry(char *block) {
+	return (rd_centry*)(block - RD_COMPRESSED);
+}
+
+static inline int centry_slots(int len) {
+	return (sizeof(rd_centry) + len + RD_POOL_SLOT_SIZE - 1) / RD_POOL_SLOT_SIZE;
+}
+
+static inline void touch_block(rd_ctx *rd, char *block) {
+	WRITE_ONCE(rd->block_atime[(block - rd->first_data_block) / RD_BLOCK_SIZE], jiffies);
+}
+
+/*
+ * Record that [addr, addr + len) of the ramdisk changed and has to reach
+ * the backing file. Call it after the change: a flush that copies the unit
+ * before the change and clears its bit must see the bit set again. A
+ * barrier and a few bit operations on the write path, nothing without a
+ * backing file.
+ */
+static inline void mark_dirty(rd_ctx *rd, const void *addr, int len) {
+	int i, last;
+
+	if (rd->dirty_map == NULL || len <= 0)
+		return;
+	/* order the change before the test, pairs with test_and_clear_bit() in flush_dirty() */
+	smp_mb();
+	last = ((const char*)addr + len - 1 - rd->first_block) / RD_BLOCK_SIZE;
+	for (i = ((const char*)addr - rd->first_block) / RD_BLOCK_SIZE; i <= last; ++i) {
+		if (!test_bit(i, rd->dirty_map))
+			set_bit(i, rd->dirty_map);
+	}
+	if (READ_ONCE(rd->dirty_since) == 0)
+		cmpxchg(&rd->dirty_since, 0, jiffies | 1);
+}
+
+/* The superblock counters, the bitmap bit and the refcount of a block changed */
+static inline void mark_block_dirty(rd_ctx *rd, int block_num) {
+	mark_dirty(rd, rd->superblock, sizeof(rd_superblock));
+	mark_dirty(rd, rd->first_bitmap_block + block_num / 8, 1);
+	mark_dirty(rd, rd->block_refs + block_num, sizeof(unsigned short));
+}
+
+
+/* the ioctl commands with stats, in the order they are shown */
+static const struct {
+	unsigned int cmd;
+	const char *name;
+} stat_cmds[RD_STAT_CMDS] = {
+	{ RD_CREATE, "create" }, { RD_MKDIR, "mkdir" }, { RD_OPEN, "open" },
+	{ RD_CLOSE, "close" }, { RD_READ, "read" }, { RD_WRITE, "write" },
+	{ RD_LSEEK, "lseek" }, { RD_DELETE, "delete" }, { RD_FALLOCATE, "fallocate" },
+	{ RD_TRUNCATE, "truncate" }, { RD_SNAPSHOT, "snapshot" }, { RD_REFLINK, "reflink" },
+	{ RD_COMPRESS, "compress" }, { RD_DEDUP, "dedup" }, { RD_SAVE, "save" },
+	{ RD_RESTORE, "restore" }, { RD_SYNC, "sync" }, { RD_SHOWDIR, "showdir" },
+	{ RD_SHOWBLOCKS, "showblocks" }, { RD_SHOWINODES, "showinodes" }, { RD_SHOWFDT, "showfdt" },
+	{ RD_RMDIR, "rmdir" }, { RD_RMTREE, "rmtree" }, { RD_RENAME, "rename" },
+	{ RD_STAT, "stat" }, { RD_SUBMIT, "submit" }, { RD_REAP, "reap" }, { RD_EVENTFD, "eventfd" },
+};
+
+/*
+ * The block map holds block numbers relative to first_data_block, so the
+ * on-memory format has no pointers. A compressed block is stored as the
+ * slot number of its pool entry with RD_COMPRESSED_BLOCK set. These two
+ * translate to and from the char* (tagged if compressed) the code works with.
+ */
+static inline char* inode_block(rd_ctx *rd, rd_inode *inode, int i) {
+	unsigned int n = READ_ONCE(inode_map(rd, inode)[i]);
+
+	if (n & RD_COMPRESSED_BLOCK)
+		return rd->first_data_block + (n & ~RD_COMPRESSED_BLOCK) * RD_POOL_SLOT_SIZE + RD_COMPRESSED;
+	return rd->first_data_block + n * RD_BLOCK_SIZE;
+}
+
+static inline void set_inode_block(rd_ctx *rd, rd_inode *inode, int i, char *block) {
+	unsigned int *map = inode_map(rd, inode);
+
+	if (block_compressed(block))
+		map[i] = RD_COMPRESSED_BLOCK | ((char*)block_centry(block) - rd->first_data_block) / RD_POOL_SLOT_SIZE;
+	else
+		map[i] = (block - rd->first_data_block) / RD_BLOCK_SIZE;
+	mark_dirty(rd, &map[i], sizeof(map[i]));
+}
+
+static void free_centry(rd_ctx *rd, rd_centry *entry);
+
+static int compress_interval = 0;
+module_param(compress_interval, int, 0444);
+MODULE_PARM_DESC(compress_interval, "Compress file blocks not accessed for this many seconds (0 = never)");
+
+static int dedup_interval = 0;
+module_param(dedup_interval, int, 0444);
+MODULE_PARM_DESC(dedup_interval, "Merge identical file blocks every this many seconds (0 = never)");
+
+static char *image[RD_MAX_INSTANCES];
+static int nr_image;
+module_param_array(image, charp, &nr_image, 0444);
+MODULE_PARM_DESC(image, "Restore the ramdisks from these image files at load time, one per instance");
+
+static int image_load_path(rd_ctx *rd, const char *path);
+static bool backing_matches(rd_ctx *rd, rd_superblock *sb);
+
+static char *backing[RD_MAX_INSTANCES];
+static int nr_backing;
+module_param_array(backing, charp, &nr_backing, 0444);
+MODULE_PARM_DESC(backing, "Write the ramdisks back to these files, and load them from there at load time, one per instance");
+
+static int flush_interval = 5;
+module_param(flush_interval, int, 0444);
+MODULE_PARM_DESC(flush_interval, "Write dirty blocks back every this many seconds (0 = only on sync and unload)");
+
+static int backing_init(rd_ctx *rd, bool restored);
+static int flush_dirty(rd_ctx *rd);
+
+static void compress_work_fn(struct work_struct *work);
+static void dedup_work_fn(struct work_struct *work);
+static void flush_work_fn(struct work_struct *work);
+
+/*
+ * Placement of the ramdisk memory
+ *
+ * By default the disk is vmalloc'd wherever the loading CPU is, in 4 KB
+ * pages. hugepages takes it in one physically contiguous piece of at least
+ * huge page order instead, used through the kernel's linear map, which maps
+ * it with 2 MB entries: the whole disk then costs a single TLB entry. It
+ * needs a free huge page, otherwise the disk falls back to 4 KB pages.
+ * numa_node pins the disk and the per-inode and per-block tables to a node,
+ * numa_interleave spreads the 4 KB pages of the disk over all memory nodes
+ * round-robin. hugepages wins over numa_interleave, a huge page sits on a
+ * single node.
+ */
+static int hugepages = 0;
+module_param(hugepages, int, 0444);
+MODULE_PARM_DESC(hugepages, "Back the disk with huge pages (falls back to 4 KB pages if none is free)");
+
+static int numa_node[RD_MAX_INSTANCES];
+static int nr_numa_node;
+module_param_array(numa_node, int, &nr_numa_node, 0444);
+MODULE_PARM_DESC(numa_node, "Allocate the ramdisks on these NUMA nodes, one per instance (-1 = the node of the loading CPU)");
+
+static int numa_interleave = 0;
+module_param(numa_interleave, int, 0444);
+MODULE_PARM_DESC(numa_interleave, "Spread the pages of the disk round-robin over all memory nodes");
+
+/* A region of the ramdisk memory, for the placement report */
+typedef struct {
+	const char *name;
+	const char *start;
+	unsigned long size;
+} rd_region;
+
+static char *disk_alloc_huge(rd_ctx *rd) {
+	gfp_t gfp = GFP_KERNEL | __GFP_COMP | __GFP_NOWARN;
+	unsigned int order;
+
+	if (rd->node != NUMA_NO_NODE)
+		gfp |= __GFP_THISNODE;
+	order = max_t(unsigned int, get_order(RD_DISK_SIZE), PMD_SHIFT - PAGE_SHIFT);
+	rd->disk_pages = (struct page**)kmalloc(sizeof(struct page*), GFP_KERNEL);
+	if (!rd->disk_pages)
+		return NULL;
+	rd->disk_pages[0] = alloc_pages_node(rd->node, gfp, order);
+	if (!rd->disk_pages[0]) {
+		kfree(rd->disk_pages);
+		rd->disk_pages = NULL;
+		return NULL;
+	}
+	rd->disk_nr_pages = 1;
+	rd->disk_order = order;
+	return (char*)page_address(rd->disk_pages[0]);
+}
+
+static char *disk_alloc_interleave(rd_ctx *rd) {
+	char *disk;
+	int i, node;
+
+	rd->disk_nr_pages = DIV_ROUND_UP(RD_DISK_SIZE, PAGE_SIZE);
+	rd->disk_pages = (struct page**)kcalloc(rd->disk_nr_pages, sizeof(struct page*), GFP_KERNEL);
+	if (!rd->disk_pages)
+		return NULL;
+	node = first_memory_node;
+	for (i = 0; i < rd->disk_nr_pages; ++i) {
+		rd->disk_pages[i] = alloc_pages_node(node, GFP_KERNEL, 0);
+		if (!rd->disk_pages[i])
+			break;
+		node = next_node_in(node, node_states[N_MEMORY]);
+	}
+	disk = NULL;
+	if (i == rd->disk_nr_pages)
+		disk = (char*)vmap(rd->disk_pages, rd->disk_nr_pages, VM_MAP, PAGE_KERNEL);
+	if (!disk) {
+		while (--i >= 0)
+			__free_pages(rd->disk_pages[i], 0);
+		kfree(rd->disk_pages);
+		rd->disk_pages = NULL;
+		return NULL;
+	}
+	rd->disk_order = 0;
+	return disk;
+}
+
+/*
+ * Allocate the disk as placed by the params, falling back to a plain
+ * vmalloc (on the pinned node, if any) when that can't be done
+ */
+static char *disk_alloc(rd_ctx *rd) {
+	char *disk;
+
+	if (rd->node != NUMA_NO_NODE &&
+	    (rd->node < 0 || rd->node >= nr_node_ids || !node_state(rd->node, N_MEMORY))) {
+		printk("Error: NUMA node %d has no memory, ignoring numa_node of %s.\n", rd->node, rd->name);
+		rd->node = NUMA_NO_NODE;
+	}
+	if (hugepages) {
+		disk = disk_alloc_huge(rd);
+		if (disk)
+			return disk;
+		printk("Error: No free huge page for %s, using 4 KB pages.\n", rd->name);
+	}
+	if (numa_interleave) {
+		disk = disk_alloc_interleave(rd);
+		if (disk)
+			return disk;
+		printk("Error: Cannot interleave %s, allocating it in one place.\n", rd->name);
+	}
+	rd->disk_nr_pages = 0;
+	rd->disk_order = 0;
+	return (char*)vmalloc_node(RD_DISK_SIZE, rd->node);
+}
+
+static void disk_free(rd_ctx *rd, char *disk) {
+	int i;
+
+	if (!rd->disk_pages) {
+		vfree(disk);
+		return;
+	}
+	/* only interleaved pages are vmapped, a huge page is in the linear map */
+	if (rd->disk_order == 0)
+		vunmap(disk);
+	for (i = 0; i < rd->disk_nr_pages; ++i)
+		__free_pages(rd->disk_pages[i], rd->disk_order);
+	kfree(rd->disk_pages);
+	rd->disk_pages = NULL;
+}
+
+/* The regions of the disk and the per-inode table, returns their number */
+static int mem_regions(rd_ctx *rd, rd_region *regions) {
+	rd_region all[] = {
+		{ "superblock", rd->first_block, RD_SUPERBLOCK_SIZE },
+		{ "inodes", rd->first_inodes_block, RD_INODES_SIZE },
+		{ "bitmap", rd->first_bitmap_block, RD_BLOCKBITMAP_SIZE },
+		{ "refcounts", (char*)rd->block_refs, RD_BLOCKREFS_SIZE },
+		{ "data", rd->first_data_block, RD_DATA_BLOCKS_SIZE },
+		{ "inode_locks", (char*)rd->inode_infos, sizeof(rd_inode_info) * RD_INODE_NUM },
+	};
+
+	memcpy(regions, all, sizeof(all));
+	return ARRAY_SIZE(all);
+}
+
+static unsigned long region_page_size(rd_ctx *rd, const rd_region *rg) {
+	if (rd->disk_pages && rg->start >= rd->first_block && rg->start < rd->first_block + RD_DISK_SIZE)
+		return PAGE_SIZE << rd->disk_order;
+	return PAGE_SIZE;
+}
+
+/* Bytes of the region that are on the given node */
+static unsigned long region_node_bytes(const rd_region *rg, int node) {
+	const char *p, *end, *page_end;
+	struct page *page;
+	unsigned long bytes;
+
+	end = rg->start + rg->size;
+	bytes = 0;
+	for (p = rg->start; p < end; p = page_end) {
+		page_end = (const char*)(((unsigned long)p & PAGE_MASK) + PAGE_SIZE);
+		if (page_end > end)
+			page_end = end;
+		page = is_vmalloc_addr(p) ? vmalloc_to_page(p) : virt_to_page(p);
+		if (page && page_to_nid(page) == node)
+			bytes += page_end - p;
+	}
+	return bytes;
+}
+
+/* "<name>: <size> bytes in <page size> KB pages on node(s) ..." */
+static void region_line(rd_ctx *rd, const rd_region *rg, char *line, int size) {
+	unsigned long bytes;
+	int node, len;
+
+	len = snprintf(line, size, "%s: %lu bytes in %lu KB pages on node", rg->name, rg->size,
+		region_page_size(rd, rg) / 1024);
+	for_each_node_state(node, N_MEMORY) {
+		if (len >= size)
+			return;
+		bytes = region_node_bytes(rg, node);
+		if (bytes == rg->size) {
+			snprintf(line + len, size - len, " %d", node);
+			return;
+		}
+		if (bytes > 0)
+			len += snprintf(line + len, size - len, " %d (%lu bytes)", node, bytes);
+	}
+}
 
 /*
- * Init the whole ramdisk, allocate memory and init all the 4 memory regions
+ * Init the whole ramdisk, allocate memory and init all the memory regions.
+ * Only the root dir is set up here: inodes and data blocks are initialized
+ * on their first allocation (see inode_hwm and block_hwm), so loading the
+ * module does not touch the whole disk.
  */
-int ramfs_init(void) {
+rd_ctx* ramfs_init(int id, const char *name) {
+	rd_region regions[RD_REGIONS];
+	char line[RD_REGION_LINE];
+	bool restored;
+	rd_ctx *rd;
+	int i, n;
 
-	first_block = (char *)vmalloc(RD_DISK_SIZE);
+	rd = (rd_ctx*)kzalloc(sizeof(rd_ctx), GFP_KERNEL);
+	if (!rd) {
+		printk("Error: Ramdisk Memory Allocation Failed.\n");
+		return NULL;
+	}
+	rd->id = id;
+	snprintf(rd->name, RD_NAME_LEN, "%s", name);
+	rd->node = id < nr_numa_node ? numa_node[id] : NUMA_NO_NODE;
+	/* an empty item leaves its instance without one, e.g. backing=,/var/rd1.img */
+	rd->backing = id < nr_backing && backing[id][0] ? backing[id] : NULL;
+	rd->first_block = disk_alloc(rd);
 
-	if (!first_block) {
+	if (!rd->first_block) {
 		printk("Error: Ramdisk Memory Allocation Failed.\n");
-		return -1;
+		kfree(rd);
+		return NULL;
 	} else {
 		printk("Ramdisk Memory Allocated.\n");
 	}
 
-	first_inodes_block = first_block + RD_SUPERBLOCK_SIZE;
-	first_bitmap_block = first_inodes_block + RD_INODES_SIZE;
-	first_data_block = first_bitmap_block + RD_BLOCKBITMAP_SIZE;
+	rd->first_inodes_block = rd->first_block + RD_SUPERBLOCK_SIZE;
+	rd->first_bitmap_block = rd->first_inodes_block + RD_INODES_SIZE;
+	rd->block_refs = (unsigned short*)(rd->first_bitmap_block + RD_BLOCKBITMAP_SIZE);
+	rd->first_data_block = (char*)rd->block_refs + RD_BLOCKREFS_SIZE;
 
-	superblock = (rd_superblock*)first_block;
-	inode_list = (rd_inode*)first_inodes_block;
+	rd->superblock = (rd_superblock*)rd->first_block;
+	rd->inode_list = (rd_inode*)rd->first_inodes_block;
+	rd->block_maps = (rd_block_map*)(rd->first_inodes_block + RD_INODE_NUM * sizeof(rd_inode));
 
-	superblock_init();
-	inodes_init();
-	bitmap_init();
-	data_init();
-	fdt_init();
-	return 0;
+	if (locks_init(rd) == -1) {
+		disk_free(rd, rd->first_block);
+		kfree(rd);
+		return NULL;
+	}
+	if (hugepages || rd->node != NUMA_NO_NODE || numa_interleave) {
+		n = mem_regions(rd, regions);
+		for (i = 0; i < n; ++i) {
+			region_line(rd, &regions[i], line, sizeof(line));
+			printk("%s %s\n", rd->name, line);
+		}
+	}
+	superblock_init(rd);
+	inodes_init(rd);
+	bitmap_init(rd);
+	data_init(rd);
+	if (compress_interval > 0)
+		schedule_delayed_work(&rd->compress_work, compress_interval * HZ);
+	if (dedup_interval > 0)
+		schedule_delayed_work(&rd->dedup_work, dedup_interval * HZ);
+	restored = false;
+	if (id < nr_image && image[id][0]) {
+		restored = image_load_path(rd, image[id]) != -1;
+		if (!restored)
+			printk("Error: Cannot restore image '%s', starting empty.\n", image[id]);
+	}
+	if (rd->backing != NULL && backing_init(rd, restored) == -1) {
+		printk("Error: Cannot use backing file '%s', write-back disabled.\n", rd->backing);
+		rd->backing = NULL;
+	}
+	return rd;
 }
 
 /*
  * Init the superblock region
  */
-int superblock_init(void) {
-	superblock->block_count = RD_BLOCK_NUM;
-	superblock->inode_count = RD_INODE_NUM;
-	superblock->freeblock_count = RD_BLOCK_NUM;
-	superblock->freeinode_count = RD_INODE_NUM;
-	superblock->first_inodes_block = first_inodes_block;
-	superblock->first_bitmap_block = first_bitmap_block;
-	superblock->first_data_block = first_data_block;
+int superblock_init(rd_ctx *rd) {
+	rd->superblock->block_count = RD_BLOCK_NUM;
+	rd->superblock->inode_count = RD_INODE_NUM;
+	rd->superblock->freeblock_count = RD_BLOCK_NUM;
+	rd->superblock->freeinode_count = RD_INODE_NUM;
+	rd->superblock->inodes_offset = rd->first_inodes_block - rd->first_block;
+	rd->superblock->bitmap_offset = rd->first_bitmap_block - rd->first_block;
+	rd->superblock->refs_offset = (char*)rd->block_refs - rd->first_block;
+	rd->superblock->data_offset = rd->first_data_block - rd->first_block;
+	rd->superblock->maps_offset = (char*)rd->block_maps - rd->first_block;
+	rd->superblock->inode_hwm = 0;
+	rd->superblock->block_hwm = 0;
 	return 0;
 }
 
+static void inode_reclaim_fn(struct work_struct *work);
+
 /*
- * Init the inodes region
+ * Init the inode at inode_hwm and its lock, and move the mark past it.
+ * Called with sb_lock held, or at init time.
  */
-int inodes_init(void) {
-	int i;
-	for (i = 0; i < RD_INODE_NUM; ++i) {
-		inode_list[i].inode_num = i;
-		inode_list[i].file_type = RD_AVAILABLE;
-		inode_list[i].block_count = 0;
-		inode_list[i].file_size = 0;
-		memset(inode_list[i].block_addr, 0, sizeof(inode_list[i].block_addr));
-	}
-
-	inode_list[0].file_type = RD_DIRECTORY;
-	inode_list[0].block_count = 1;
-	inode_list[0].block_addr[0] = first_data_block;
-	superblock->freeblock_count--;
-	superblock->freeinode_count--;
+static rd_inode* init_next_inode(rd_ctx *rd) {
+	rd_inode *inode;
+
+	inode = rd->inode_list + rd->superblock->inode_hwm;
+	inode->inode_num = rd->superblock->inode_hwm;
+	inode->file_type = RD_AVAILABLE;
+	inode->block_count = 0;
+	inode->file_size = 0;
+	memset(inode_map(rd, inode), 0xff, sizeof(rd_block_map));
+	init_rwsem(&rd->inode_infos[inode->inode_num].rwsem);
+	INIT_RCU_WORK(&rd->inode_infos[inode->inode_num].reclaim_work, inode_reclaim_fn);
+	rd->inode_infos[inode->inode_num].rd = rd;
+	/* lockless scans read the mark without sb_lock */
+	smp_store_release(&rd->superblock->inode_hwm, rd->superblock->inode_hwm + 1);
+	mark_dirty(rd, inode, sizeof(rd_inode));
+	mark_dirty(rd, inode_map(rd, inode), sizeof(rd_block_map));
+	mark_dirty(rd, rd->superblock, sizeof(rd_superblock));
+	return inode;
+}
+
+/*
+ * Make sure data block block_num is initialized: blocks past block_hwm hold
+ * garbage, as do their bitmap bits and refcounts, and count as free. The
+ * mark moves by RD_INIT_CHUNK blocks, zeroing their contents on the way.
+ * Called with sb_lock held, or at init time.
+ */
+static void init_blocks_upto(rd_ctx *rd, int block_num) {
+	int start, end;
+
+	while (rd->superblock->block_hwm <= block_num) {
+		start = rd->superblock->block_hwm;
+		end = min_t(int, start + RD_INIT_CHUNK, RD_BLOCK_NUM);
+		/* start is a multiple of 8, the chunk owns its bitmap bytes */
+		memset(rd->first_bitmap_block + start / 8, 0, (end - start + 7) / 8);
+		memset(rd->block_refs + start, 0, (end - start) * sizeof(unsigned short));
+		memset(rd->pool_map + start, 0, end - start);
+		memset(rd->first_data_block + start * RD_BLOCK_SIZE, 0, (end - start) * RD_BLOCK_SIZE);
+		rd->superblock->block_hwm = end;
+		mark_dirty(rd, rd->first_bitmap_block + start / 8, (end - start + 7) / 8);
+		mark_dirty(rd, rd->block_refs + start, (end - start) * sizeof(unsigned short));
+		mark_dirty(rd, rd->first_data_block + start * RD_BLOCK_SIZE, (end - start) * RD_BLOCK_SIZE);
+	}
+}
+
+/*
+ * Init the inodes region: only the root dir inode
+ */
+int inodes_init(rd_ctx *rd) {
+	rd_inode *root;
+
+	root = init_next_inode(rd);
+	root->file_type = RD_DIRECTORY;
+	root->block_count = 1;
+	inode_map(rd, root)[0] = 0;
+	rd->superblock->freeblock_count--;
+	rd->superblock->freeinode_count--;
 	return 0;
 }
 
 /*
- * Init the bitmap region
+ * Init the bitmap and refcounts regions: only the first chunk
  */
-int bitmap_init(void) {
+int bitmap_init(rd_ctx *rd) {
 
-	memset(first_bitmap_block, 0, RD_BLOCKBITMAP_SIZE);
+	init_blocks_upto(rd, 0);
 	/* block 0 is allocated for root dir*/
-	*first_bitmap_block = 1;
+	*rd->first_bitmap_block = 1;
+	rd->block_refs[0] = 1;
 
 	return 0;
 }
 
 /*
- * Init the data region
+ * Init the data region: the root dir entries
  */
-int data_init(void) {
-
-	memset(first_data_block, 0, RD_DATA_BLOCKS_SIZE);
+int data_init(rd_ctx *rd) {
 
-	add_dentry(&inode_list[0], 0, ".");
-	add_dentry(&inode_list[0], 0, "..");
+	add_dentry(rd, &rd->inode_list[0], 0, ".");
+	add_dentry(rd, &rd->inode_list[0], 0, "..");
 
 	return 0;
 }
 
 /*
- * Init the File Descriptor Table (FDT)
+ * Init the instance's locks and works, and allocate the per-inode locks,
+ * the RCU reclaim machinery and the per-block compression state. They live
+ * outside the ramdisk memory so the on-memory layout stays unchanged, and
+ * are initialized along with their inode or block.
  */
-int fdt_init(void) {
-	int i;
-	fd_list = (rd_file**)vmalloc(sizeof(rd_file*) * RD_MAX_FILE);
-	for (i = 0; i < RD_MAX_FILE; ++i) {
-		fd_list[i] = NULL;
+int locks_init(rd_ctx *rd) {
+	spin_lock_init(&rd->sb_lock);
+	spin_lock_init(&rd->fdt_tables_lock);
+	INIT_LIST_HEAD(&rd->fdt_tables);
+	mutex_init(&rd->compress_mutex);
+	mutex_init(&rd->flush_mutex);
+	INIT_DELAYED_WORK(&rd->compress_work, compress_work_fn);
+	INIT_DELAYED_WORK(&rd->dedup_work, dedup_work_fn);
+	INIT_DELAYED_WORK(&rd->flush_work, flush_work_fn);
+	if (percpu_init_rwsem(&rd->freeze_sem) != 0) {
+		printk("Error: Ramdisk Lock Allocation Failed.\n");
+		return -1;
+	}
+	rd->inode_infos = (rd_inode_info*)vmalloc_node(sizeof(rd_inode_info) * RD_INODE_NUM, rd->node);
+	rd->reclaim_wq = alloc_workqueue("%s_reclaim", 0, 0, rd->name);
+	rd->pool_map = (unsigned char*)vmalloc_node(RD_BLOCK_NUM, rd->node);
+	rd->block_atime = (unsigned long*)vmalloc_node(sizeof(unsigned long) * RD_BLOCK_NUM, rd->node);
+	rd->cpu_stats = alloc_percpu(rd_cpu_stats);
+	if (!rd->inode_infos || !rd->reclaim_wq || !rd->pool_map || !rd->block_atime || !rd->cpu_stats) {
+		printk("Error: Ramdisk Lock Allocation Failed.\n");
+		percpu_free_rwsem(&rd->freeze_sem);
+		if (rd->inode_infos)
+			vfree(rd->inode_infos);
+		if (rd->reclaim_wq)
+			destroy_workqueue(rd->reclaim_wq);
+		if (rd->pool_map)
+			vfree(rd->pool_map);
+		if (rd->block_atime)
+			vfree(rd->block_atime);
+		if (rd->cpu_stats)
+			free_percpu(rd->cpu_stats);
+		rd->inode_infos = NULL;
+		rd->reclaim_wq = NULL;
+		rd->pool_map = NULL;
+		rd->block_atime = NULL;
+		rd->cpu_stats = NULL;
+		return -1;
 	}
 	return 0;
 }
-int ramfs_exit(void) {
-	if (first_block) {
-		vfree(first_block);
+
+int ramfs_exit(rd_ctx *rd) {
+	cancel_delayed_work_sync(&rd->compress_work);
+	cancel_delayed_work_sync(&rd->dedup_work);
+	cancel_delayed_work_sync(&rd->flush_work);
+	if (rd->compress_wrkmem) {
+		vfree(rd->compress_wrkmem);
+	}
+	rd->compress_wrkmem = NULL;
+	/* let pending dentry/inode reclaims finish before the memory goes away */
+	if (rd->reclaim_wq) {
+		rcu_barrier();
+		destroy_workqueue(rd->reclaim_wq);
+	}
+	rd->reclaim_wq = NULL;
+	/* the last write-back, after the reclaims so they make it too */
+	if (rd->backing_filp) {
+		if (flush_dirty(rd) == -1)
+			printk("Error: Cannot write back to '%s', changes lost.\n", rd->backing);
+		filp_close(rd->backing_filp, NULL);
+		vfree(rd->dirty_map);
+		vfree(rd->flush_buf);
+		vfree(rd->flush_map);
+	}
+	rd->backing_filp = NULL;
+	rd->dirty_map = NULL;
+	rd->flush_buf = NULL;
+	rd->flush_map = NULL;
+	if (rd->inode_infos) {
+		vfree(rd->inode_infos);
+	}
+	rd->inode_infos = NULL;
+	if (rd->pool_map) {
+		vfree(rd->pool_map);
+	}
+	rd->pool_map = NULL;
+	if (rd->block_atime) {
+		vfree(rd->block_atime);
+	}
+	rd->block_atime = NULL;
+	if (rd->cpu_stats) {
+		free_percpu(rd->cpu_stats);
 	}
-	first_block = NULL;
+	rd->cpu_stats = NULL;
+	percpu_free_rwsem(&rd->freeze_sem);
+	disk_free(rd, rd->first_block);
+	kfree(rd);
 	return 0;
 }
 
 /*
- * Allocate a free inode. Find a free inode, return it
+ * Allocate a free inode. Find a free inode, claim it with the given type and return it.
+ * Freed inodes are reused first, a new one is initialized only when there is none.
+ * Inodes still waiting for their grace period are skipped, so NULL can mean
+ * that only those are left; see wait_inode_reclaims.
  */
-rd_inode* allocate_inode() {
+rd_inode* allocate_inode(rd_ctx *rd, unsigned short file_type) {
+	rd_inode *inode;
 	int i;
 
-	if (superblock->freeinode_count <= 0) {
-		return NULL;
-	}
-	for (i = 0; i < RD_INODE_NUM; ++i) {
-		if (inode_list[i].file_type == RD_AVAILABLE) {
-			superblock->freeinode_count--;
-			return inode_list + i;
+	spin_lock(&rd->sb_lock);
+	inode = NULL;
+	for (i = 0; i < rd->superblock->inode_hwm; ++i) {
+		if (rd->inode_list[i].file_type == RD_AVAILABLE) {
+			inode = rd->inode_list + i;
+			break;
 		}
 	}
-	return NULL;
+	this_cpu_add(rd->cpu_stats->inode_scanned, inode ? i + 1 : i);
+	if (inode == NULL && rd->superblock->inode_hwm < RD_INODE_NUM)
+		inode = init_next_inode(rd);
+	if (inode == NULL)
+		this_cpu_inc(rd->cpu_stats->inode_fails);
+	else
+		this_cpu_inc(rd->cpu_stats->inode_allocs);
+	if (inode != NULL) {
+		inode->file_type = file_type;
+		inode->block_count = 0;
+		inode->file_size = 0;
+		rd->superblock->freeinode_count--;
+		mark_dirty(rd, inode, sizeof(rd_inode));
+		mark_dirty(rd, rd->superblock, sizeof(rd_superblock));
+	}
+	spin_unlock(&rd->sb_lock);
+	return inode;
+}
+
+/*
+ * The last resort of an op that found no free inode: finish the pending
+ * inode reclaims. Returns whether there were any, that is whether trying
+ * again can succeed. Waits a grace period, so the caller must have dropped
+ * freeze_sem and its dir locks first.
+ */
+static bool wait_inode_reclaims(rd_ctx *rd) {
+	bool reclaiming;
+	int i;
+
+	reclaiming = false;
+	spin_lock(&rd->sb_lock);
+	for (i = 0; i < rd->superblock->inode_hwm && !reclaiming; ++i)
+		reclaiming = rd->inode_list[i].file_type == RD_RECLAIMING;
+	spin_unlock(&rd->sb_lock);
+	if (!reclaiming)
+		return false;
+	rcu_barrier();
+	flush_workqueue(rd->reclaim_wq);
+	return true;
+}
+
+/*
+ * Allocate a File Descriptor Table (FDT) for a new open of the device
+ */
+rd_fdt* allocate_fdt(rd_ctx *rd) {
+	rd_fdt *fdt;
+
+	fdt = (rd_fdt*)kzalloc(sizeof(rd_fdt), GFP_KERNEL);
+	if (fdt == NULL)
+		return NULL;
+	fdt->rd = rd;
+	spin_lock_init(&fdt->lock);
+	spin_lock(&rd->fdt_tables_lock);
+	list_add(&fdt->list, &rd->fdt_tables);
+	spin_unlock(&rd->fdt_tables_lock);
+	return fdt;
 }
 
 /*
- * Allocate a free fd.
+ * Allocate a free fd in the given FDT and install the given file in it.
  */
-int allocate_fd() {
+int allocate_fd(rd_fdt *fdt, rd_file *file) {
 	int i;
+	spin_lock(&fdt->lock);
 	for (i = 0; i < RD_MAX_FILE; ++i) {
-		if (fd_list[i] == NULL) {
-			fd_list[i] = (rd_file*)vmalloc(sizeof(rd_file));
+		if (fdt->files[i] == NULL) {
+			fdt->files[i] = file;
+			spin_unlock(&fdt->lock);
 			return i;
 		}
 	}
+	spin_unlock(&fdt->lock);
 	/* No free fd available */
 	return -1;
 }
@@ -154,149 +867,456 @@ int allocate_fd() {
 /*
  * Allocate a free block. Find a free block, set its bitmap and return its addr.
  */
-char* allocate_block() {
-	int i, j, block_num;
+char* allocate_block(rd_ctx *rd) {
+	int i, j, block_num, free;
 	char byte;
 	char *iter;
 	char *block_addr;
 
-	if (superblock->freeblock_count <= 0) {
-		printk("Error: No free blocks available.\n");
+	spin_lock(&rd->sb_lock);
+	if (rd->superblock->freeblock_count <= 0) {
+		spin_unlock(&rd->sb_lock);
+		this_cpu_inc(rd->cpu_stats->block_fails);
+		trace_ramdisk_alloc_block(-1, 1, 0, 0);
 		return NULL;
 	}
 
-	iter = first_bitmap_block;
-	for (i = 0; i < RD_BLOCKBITMAP_SIZE; ++iter, ++i) {
+	/* every initialized block in use: take the first uninitialized one */
+	block_num = rd->superblock->block_hwm;
+	iter = rd->first_bitmap_block;
+	for (i = 0; i * 8 < rd->superblock->block_hwm; ++iter, ++i) {
 		byte = *iter;
 		for (j = 0; j < 8; ++j) {
 			if (((byte >> j) & 1) == 0)
 				break;
 		}
 		if (j < 8) {
-			/* set the bitmap */
-			*iter = byte | (1 << j);
+			block_num = i * 8 + j;
 			break;
 		}
 	}
+	/* the scan looked at the bits up to the one it took, or at all of them */
+	this_cpu_add(rd->cpu_stats->block_scanned, block_num + 1);
+	this_cpu_inc(rd->cpu_stats->block_allocs);
 
-	block_num = i * 8 + j;
-	block_addr = first_data_block + block_num * RD_BLOCK_SIZE;
-	superblock->freeblock_count--;
+	init_blocks_upto(rd, block_num);
+	/* set the bitmap */
+	rd->first_bitmap_block[block_num / 8] |= 1 << (block_num % 8);
+	block_addr = rd->first_data_block + block_num * RD_BLOCK_SIZE;
+	rd->block_refs[block_num] = 1;
+	rd->block_atime[block_num] = jiffies;
+	free = --rd->superblock->freeblock_count;
+	mark_block_dirty(rd, block_num);
+	spin_unlock(&rd->sb_lock);
+	trace_ramdisk_alloc_block(block_num, 1, block_num + 1, free);
 	return block_addr;
 
 }
 
+static inline int bitmap_test(rd_ctx *rd, int block_num) {
+	if (block_num >= rd->superblock->block_hwm)
+		return 0;
+	return (rd->first_bitmap_block[block_num / 8] >> (block_num % 8)) & 1;
+}
+
+static inline void bitmap_set(rd_ctx *rd, int block_num) {
+	rd->first_bitmap_block[block_num / 8] |= 1 << (block_num % 8);
+}
+
 /*
- * Free the given inode
+ * Allocate n blocks into blocks[], as one contiguous run if the bitmap has
+ * one (first fit) so the copy engine can move them with a single memcpy,
+ * otherwise block by block. Returns the number of blocks allocated, which
+ * is less than n when the disk runs out.
  */
-void free_inode(rd_inode *inode) {
-	
+int allocate_blocks(rd_ctx *rd, char **blocks, int n) {
+	int i, run, start, got;
+
+	spin_lock(&rd->sb_lock);
+	if (n > 1 && rd->superblock->freeblock_count >= n) {
+		for (i = 0, run = 0; i < RD_BLOCK_NUM; ++i) {
+			if (bitmap_test(rd, i)) {
+				run = 0;
+				continue;
+			}
+			if (++run < n)
+				continue;
+			start = i - n + 1;
+			this_cpu_add(rd->cpu_stats->run_scanned, i + 1);
+			this_cpu_inc(rd->cpu_stats->run_allocs);
+			trace_ramdisk_alloc_block(start, n, i + 1, rd->superblock->freeblock_count - n);
+			init_blocks_upto(rd, start + n - 1);
+			rd->superblock->freeblock_count -= n;
+			for (i = 0; i < n; ++i) {
+				bitmap_set(rd, start + i);
+				rd->block_refs[start + i] = 1;
+				rd->block_atime[start + i] = jiffies;
+				blocks[i] = rd->first_data_block + (start + i) * RD_BLOCK_SIZE;
+				mark_block_dirty(rd, start + i);
+			}
+			spin_unlock(&rd->sb_lock);
+			return n;
+		}
+	}
+	spin_unlock(&rd->sb_lock);
+	if (n > 1)
+		this_cpu_inc(rd->cpu_stats->run_misses);
+
+	for (got = 0; got < n; ++got) {
+		blocks[got] = allocate_block(rd);
+		if (blocks[got] == NULL)
+			break;
+	}
+	return got;
+}
+
+/*
+ * Free the given inode. Lockless lookups may still hold it, so it is only
+ * marked RD_RECLAIMING here and becomes RD_AVAILABLE after a grace period.
+ */
+void free_inode(rd_ctx *rd, rd_inode *inode) {
+	free_inodes(rd, &inode, 1);
+}
+
+/* Free n inodes at once, under a single hold of sb_lock */
+void free_inodes(rd_ctx *rd, rd_inode **inodes, int n) {
+	int i;
+
+	spin_lock(&rd->sb_lock);
+	for (i = 0; i < n; ++i) {
+		WRITE_ONCE(inodes[i]->file_type, RD_RECLAIMING);
+		inodes[i]->block_count = 0;
+		inodes[i]->file_size = 0;
+		memset(inode_map(rd, inodes[i]), 0xff, sizeof(rd_block_map));
+		mark_dirty(rd, inodes[i], sizeof(rd_inode));
+		mark_dirty(rd, inode_map(rd, inodes[i]), sizeof(rd_block_map));
+	}
+	spin_unlock(&rd->sb_lock);
+	for (i = 0; i < n; ++i)
+		queue_rcu_work(rd->reclaim_wq, &rd->inode_infos[inodes[i]->inode_num].reclaim_work);
+}
+
+static void inode_reclaim_fn(struct work_struct *work) {
+	rd_inode_info *info;
+	rd_inode *inode;
+	rd_ctx *rd;
+
+	info = container_of(to_rcu_work(work), rd_inode_info, reclaim_work);
+	rd = info->rd;
+	inode = rd->inode_list + (info - rd->inode_infos);
+	spin_lock(&rd->sb_lock);
 	inode->file_type = RD_AVAILABLE;
-	inode->block_count = 0;
-	inode->file_size = 0;
-	memset(inode->block_addr, 0, sizeof(inode->block_addr));
-	superblock->freeinode_count++;
+	rd->superblock->freeinode_count++;
+	mark_dirty(rd, inode, sizeof(rd_inode));
+	mark_dirty(rd, rd->superblock, sizeof(rd_superblock));
+	spin_unlock(&rd->sb_lock);
 }
 
 /*
- * Free the given fd
+ * Free the given FDT when its device handle is released, closing every fd
+ * the client left open
  */
-void free_fd(int fd) {
-	vfree(fd_list[fd]);
-	fd_list[fd] = NULL;
+void free_fdt(rd_fdt *fdt) {
+	rd_ctx *rd = fdt->rd;
+	int i;
+
+	spin_lock(&rd->fdt_tables_lock);
+	list_del(&fdt->list);
+	spin_unlock(&rd->fdt_tables_lock);
+	for (i = 0; i < RD_MAX_FILE; ++i) {
+		if (fdt->files[i] != NULL)
+			free_fd(fdt, i);
+	}
+	kfree(fdt);
 }
 
 /*
- * Free the given block
+ * Free the given fd. The caller holds fdt->lock; the file itself goes away
+ * once the last in-flight op drops its reference.
  */
-void free_block(char *block) {
-	int block_num;
-	int i, j;
-	char *byte;
-	block_num = (block - first_data_block) / RD_BLOCK_SIZE;
-	i = block_num / 8;
-	j = block_num % 8;
-	byte = first_bitmap_block + i;
-	*byte = (*byte) & (~(1 << j));
-	superblock->freeblock_count++;
+void free_fd(rd_fdt *fdt, int fd) {
+	put_file(fdt->files[fd]);
+	fdt->files[fd] = NULL;
 }
 
-void free_dentry(rd_dentry *dentry) {
-	dentry->inode_num = -1;
-	memset(dentry->filename, 0, sizeof(dentry->filename));
+/*
+ * Get a reference to the file behind the given fd, NULL if the fd is not open
+ */
+rd_file* get_file(rd_fdt *fdt, int fd) {
+	rd_file *file;
+
+	if (fd < 0 || fd >= RD_MAX_FILE)
+		return NULL;
+	spin_lock(&fdt->lock);
+	file = fdt->files[fd];
+	if (file != NULL)
+		atomic_inc(&file->refcount);
+	spin_unlock(&fdt->lock);
+	return file;
 }
 
 /*
- * Parse the given ABSOLUTE file path
- * If the file exists, get its inode, its parent's inode and its filename, return 1
- * If not, get its parent's inode and its filename, return 0
- * If the path is not valid ,return -1
+ * Drop a reference taken by get_file or held by the fd table
  */
-int parse_path(const char *path, int type, rd_inode **parent_inode, rd_inode **file_inode, char *filename) {
-	char* tmp;
-	char* next_dir;
-	char* block;
+void put_file(rd_file *file) {
+	if (atomic_dec_and_test(&file->refcount))
+		kfree(file);
+}
 
-	rd_inode* cur_inode;
-	rd_inode* par_inode;
+/*
+ * Inode number and offset of the given fd, -1 if it is not open. Only for
+ * tracing, like path_inode_num.
+ */
+int fd_inode_num(rd_fdt *fdt, int fd, int *offset) {
+	rd_file *file;
+	int inode_num;
 
-	bool found = true; // if the path if '/', return true
-	int size_count;
-	int i, j;
-	int dir_num;
+	*offset = -1;
+	file = get_file(fdt, fd);
+	if (file == NULL)
+		return -1;
+	inode_num = file->inode->inode_num;
+	*offset = READ_ONCE(file->offset);
+	put_file(file);
+	return inode_num;
+}
 
+/*
+ * Drop a reference to the given block, freeing it with the last one
+ */
+void free_block(rd_ctx *rd, char *block) {
+	free_blocks(rd, &block, 1);
+}
 
-	*parent_inode = NULL;
-	*file_inode = NULL;
+/*
+ * Drop a reference to each of the n blocks, in one pass over the bitmap
+ * under a single hold of sb_lock. Returns how many blocks became free.
+ */
+int free_blocks(rd_ctx *rd, char **blocks, int n) {
+	int block_num, refs;
+	int i, freed;
+	char *byte;
 
-	/* if the path doesn't start with '/', invalid path*/
-	if (path[0] != '/') {
-		return -1;
+	/* compressed blocks go back to the pool, which takes sb_lock itself */
+	for (i = 0; i < n; ++i) {
+		if (block_compressed(blocks[i]))
+			free_centry(rd, block_centry(blocks[i]));
 	}
+	freed = 0;
+	spin_lock(&rd->sb_lock);
+	for (i = 0; i < n; ++i) {
+		if (block_compressed(blocks[i]))
+			continue;
+		block_num = (blocks[i] - rd->first_data_block) / RD_BLOCK_SIZE;
+		byte = rd->first_bitmap_block + block_num / 8;
+		/* a shared block stays allocated until its last user drops it */
+		refs = --rd->block_refs[block_num];
+		if (refs == 0) {
+			*byte = (*byte) & (~(1 << (block_num % 8)));
+			rd->superblock->freeblock_count++;
+			freed++;
+		}
+		mark_block_dirty(rd, block_num);
+		trace_ramdisk_free_block(block_num, refs);
+	}
+	spin_unlock(&rd->sb_lock);
+	return freed;
+}
 
-	/* if the path is a file path but ends with '/', invalid path */
-	if (type == RD_FILE && path[strlen(path)-1] == '/') {
-		return -1;
+/*
+ * Take another reference to the given block for a snapshot or reflink.
+ * A block can't have more users than there are inodes, so the short
+ * refcount never overflows.
+ */
+void get_block(rd_ctx *rd, char *block) {
+	spin_lock(&rd->sb_lock);
+	if (block_compressed(block)) {
+		block_centry(block)->refs++;
+		mark_dirty(rd, block_centry(block), sizeof(rd_centry));
+	} else {
+		rd->block_refs[(block - rd->first_data_block) / RD_BLOCK_SIZE]++;
+		mark_block_dirty(rd, (block - rd->first_data_block) / RD_BLOCK_SIZE);
 	}
-	tmp = (char *)vmalloc(strlen(path));
-	strcpy(tmp, path);
+	spin_unlock(&rd->sb_lock);
+}
 
+/*
+ * Compressed blocks
+ *
+ * A file block that has not been touched for compress_interval seconds is
+ * compressed with LZ4 by a background worker and moved into the pool: data
+ * blocks owned by the pool and cut into RD_POOL_SLOTS slots, each holding
+ * (part of) a compressed entry. The block map then points at the entry with
+ * RD_COMPRESSED set in the low bit, which real block addresses never have.
+ * Reads decompress the entry into a bounce buffer, writes inflate it back
+ * into a private block first (see unshare_blocks). An entry is shared by
+ * snapshots and reflinks like a block is, through its own refcount.
+ * pool_map and the entries' refcounts are protected by sb_lock.
+ */
+static void free_centry(rd_ctx *rd, rd_centry *entry) {
+	int off, slots, block_num, empty;
 
-	cur_inode = inode_list;
-	par_inode = cur_inode;
-	next_dir = strsep(&tmp, "/");
-	next_dir = strsep(&tmp, "/");
-	while (next_dir != NULL && strlen(next_dir) != 0) {
-		if (cur_inode->file_type != RD_DIRECTORY) return -1;
+	off = (char*)entry - rd->first_data_block;
+	block_num = off / RD_BLOCK_SIZE;
+	slots = centry_slots(entry->len);
+	spin_lock(&rd->sb_lock);
+	entry->refs--;
+	mark_dirty(rd, entry, sizeof(rd_centry));
+	if (entry->refs > 0) {
+		spin_unlock(&rd->sb_lock);
+		return;
+	}
+	rd->pool_map[block_num] &= ~(((1 << slots) - 1) << (off % RD_BLOCK_SIZE / RD_POOL_SLOT_SIZE));
+	empty = rd->pool_map[block_num] == 0;
+	rd->compress_stats.entries--;
+	rd->compress_stats.bytes -= entry->len;
+	if (empty)
+		rd->compress_stats.pool_blocks--;
+	spin_unlock(&rd->sb_lock);
+	/* the last entry of a pool block gives the block back */
+	if (empty)
+		free_block(rd, rd->first_data_block + block_num * RD_BLOCK_SIZE);
+}
 
-		// Current file is a directory
-		for (i = 0, size_count = 0, found = false; i < cur_inode->block_count; ++i) {
-			block = cur_inode->block_addr[i];
-			
-			dir_num = RD_BLOCK_SIZE / sizeof(rd_dentry);
-			for (j = 0; j < dir_num; ++j) {
-				rd_dentry* dentry = (rd_dentry*) (block + j*sizeof(rd_dentry));
-
-				if (strcmp(dentry->filename, next_dir) == 0) {
-					par_inode = cur_inode;
-					cur_inode = inode_list + dentry->inode_num;
-					found = true;
-					break;
-				}
+/*
+ * Find room for an entry of the given number of slots in the pool, growing
+ * it by one block if no pool block has enough free contiguous slots.
+ */
+static rd_centry* pool_alloc(rd_ctx *rd, int slots) {
+	int i, j, mask;
+	char *block;
 
-				// ensure not visiting over the border
-				size_count += sizeof(rd_dentry);
-				if (size_count >= cur_inode->file_size) break;
-			}
-			if (found) break;
-			if (size_count >= cur_inode->file_size) break;
+	mask = (1 << slots) - 1;
+	spin_lock(&rd->sb_lock);
+	for (i = 0; i < rd->superblock->block_hwm; ++i) {
+		if (rd->pool_map[i] == 0)
+			continue;
+		for (j = 0; j + slots <= RD_POOL_SLOTS; ++j) {
+			if ((rd->pool_map[i] & (mask << j)) == 0)
+				goto found;
+		}
+	}
+	spin_unlock(&rd->sb_lock);
+
+	block = allocate_block(rd);
+	if (block == NULL)
+		return NULL;
+	i = (block - rd->first_data_block) / RD_BLOCK_SIZE;
+	j = 0;
+	spin_lock(&rd->sb_lock);
+	rd->compress_stats.pool_blocks++;
+found:
+	rd->pool_map[i] |= mask << j;
+	spin_unlock(&rd->sb_lock);
+	return (rd_centry*)(rd->first_data_block + i * RD_BLOCK_SIZE + j * RD_POOL_SLOT_SIZE);
+}
+
+/* Under sb_lock like the inode reclaims, so a flush never copies one halfway */
+static void dentry_reclaim(rd_ctx *rd, rd_dentry *dentry) {
+	spin_lock(&rd->sb_lock);
+	memset(dentry->filename, 0, sizeof(dentry->filename));
+	smp_store_release(&dentry->inode_num, RD_DENTRY_FREE);
+	mark_dirty(rd, dentry, sizeof(rd_dentry));
+	spin_unlock(&rd->sb_lock);
+}
+
+static void dentry_reclaim_fn(struct work_struct *work) {
+	rd_dentry_reclaim *reclaim;
+
+	reclaim = container_of(to_rcu_work(work), rd_dentry_reclaim, reclaim_work);
+	dentry_reclaim(reclaim->rd, reclaim->dentry);
+	kfree(reclaim);
+}
+
+/*
+ * Free the given dentry. The caller holds the parent dir's lock. The slot
+ * is hidden from lookups right away but only reused after a grace period.
+ */
+void free_dentry(rd_ctx *rd, rd_dentry *dentry) {
+	rd_dentry_reclaim *reclaim;
+
+	WRITE_ONCE(dentry->inode_num, RD_DENTRY_DEAD);
+	mark_dirty(rd, dentry, sizeof(rd_dentry));
+	reclaim = (rd_dentry_reclaim*)kmalloc(sizeof(rd_dentry_reclaim), GFP_KERNEL);
+	if (reclaim == NULL) {
+		synchronize_rcu();
+		dentry_reclaim(rd, dentry);
+		return;
+	}
+	reclaim->dentry = dentry;
+	reclaim->rd = rd;
+	INIT_RCU_WORK(&reclaim->reclaim_work, dentry_reclaim_fn);
+	queue_rcu_work(rd->reclaim_wq, &reclaim->reclaim_work);
+}
+
+/*
+ * Walk the given path for parse_path
+ */
+static int walk_path(rd_ctx *rd, const char *path, int type, rd_inode **parent_inode, rd_inode **file_inode, char *filename) {
+	char buf[RD_MAX_PATH_LEN];
+	char* tmp;
+	char* next_dir;
+
+	rd_inode* cur_inode;
+	rd_inode* par_inode;
+	rd_inode* dir_inode;
+	int inode_num;
+
+	bool found = true; // if the path if '/', return true
+
+
+	*parent_inode = NULL;
+	*file_inode = NULL;
+
+	/* if the path doesn't start with '/', invalid path*/
+	if (path[0] != '/') {
+		return -1;
+	}
+
+	/* if the path is a file path but ends with '/', invalid path */
+	if (type == RD_FILE && path[strlen(path)-1] == '/') {
+		return -1;
+	}
+	if (strlen(path) >= RD_MAX_PATH_LEN) {
+		return -1;
+	}
+	strcpy(buf, path);
+	tmp = buf;
+
+
+	cur_inode = rd->inode_list;
+	par_inode = cur_inode;
+	next_dir = strsep(&tmp, "/");
+	next_dir = strsep(&tmp, "/");
+	rcu_read_lock();
+	while (next_dir != NULL && strlen(next_dir) != 0) {
+		if (READ_ONCE(cur_inode->file_type) != RD_DIRECTORY) {
+			rcu_read_unlock();
+			return -1;
+		}
+
+		if (strlen(next_dir) >= RD_MAX_FILENAME) {
+			rcu_read_unlock();
+			return -1;
+		}
+
+		// Current file is a directory
+		dir_inode = cur_inode;
+		found = (find_dentry(rd, dir_inode, next_dir, &inode_num) != NULL);
+		if (found) {
+			par_inode = dir_inode;
+			cur_inode = rd->inode_list + inode_num;
 		}
 		strcpy(filename, next_dir);
 		next_dir = strsep(&tmp, "/");
 
 		// A directory in the middle of the path not found
-		if (!found && next_dir != NULL && strlen(next_dir) != 0) return -1;
+		if (!found && next_dir != NULL && strlen(next_dir) != 0) {
+			rcu_read_unlock();
+			return -1;
+		}
     }
+	rcu_read_unlock();
 	if (found) {
 		*parent_inode = par_inode;
 		*file_inode = cur_inode;
@@ -308,13 +1328,75 @@ int parse_path(const char *path, int type, rd_inode **parent_inode, rd_inode **f
 	}
 }
 
+/*
+ * Parse the given ABSOLUTE file path
+ * If the file exists, get its inode, its parent's inode and its filename, return 1
+ * If not, get its parent's inode and its filename, return 0
+ * If the path is not valid ,return -1
+ *
+ * The walk runs under rcu_read_lock without taking any dir lock, so the
+ * result for the last component may be stale by the time this returns.
+ * Callers that act on it re-check with find_dentry under the parent's lock.
+ */
+int parse_path(rd_ctx *rd, const char *path, int type, rd_inode **parent_inode, rd_inode **file_inode, char *filename) {
+	int ret;
+
+	ret = walk_path(rd, path, type, parent_inode, file_inode, filename);
+	trace_ramdisk_parse_path(path, ret, *parent_inode ? (*parent_inode)->inode_num : -1,
+		*file_inode ? (*file_inode)->inode_num : -1);
+	return ret;
+}
+
+/*
+ * Inode number of the given path, -1 if there is no such file. Only for
+ * tracing: the answer may be stale right away.
+ */
+int path_inode_num(rd_ctx *rd, const char *path) {
+	rd_inode *parent;
+	rd_inode *file;
+	char filename[RD_MAX_FILENAME];
+
+	if (walk_path(rd, path, RD_FILEORDIR, &parent, &file, filename) != 1)
+		return -1;
+	return file->inode_num;
+}
+
+/*
+ * Find the dentry named filename in the given dir, NULL if there is none.
+ * If inode_num is not NULL it gets the entry's inode number as seen by the scan.
+ * The caller holds either the dir's lock or rcu_read_lock.
+ */
+rd_dentry* find_dentry(rd_ctx *rd, rd_inode *dir_inode, const char *filename, int *inode_num) {
+	rd_dentry *dentry;
+	int i, j, dir_num, size, remain, num;
+
+	/* file_size is published last, every slot below it is fully written */
+	size = smp_load_acquire(&dir_inode->file_size);
+	dir_num = RD_BLOCK_SIZE / sizeof(rd_dentry);
+	for (i = 0; i * RD_BLOCK_SIZE < size; ++i) {
+		remain = size - i * RD_BLOCK_SIZE;
+		dentry = (rd_dentry*)inode_block(rd, dir_inode, i);
+		for (j = 0; j < dir_num && (int)((j + 1) * sizeof(rd_dentry)) <= remain; ++j, ++dentry) {
+			num = smp_load_acquire(&dentry->inode_num);
+			if (num >= 0 && strcmp(dentry->filename, filename) == 0) {
+				if (inode_num != NULL)
+					*inode_num = num;
+				return dentry;
+			}
+		}
+	}
+	return NULL;
+}
+
 
 /*
  * Add a file's dentry to its parent's dir file.
  * First check if there is some dentry marked invalid in this dir file, if yes,
- * use this dentry, otherwise allocate some space for a new dentry
+ * use this dentry, otherwise allocate some space for a new dentry.
+ * The caller holds the parent's lock; lockless readers are kept safe by
+ * writing the name before inode_num and updating file_size last.
  */
-int add_dentry(rd_inode *parent_inode, int inode_num, char *filename) {
+int add_dentry(rd_ctx *rd, rd_inode *parent_inode, int inode_num, char *filename) {
 	int parent_file_size;
 	int parent_block_count;
 	char *parent_last_block;
@@ -327,11 +1409,12 @@ int add_dentry(rd_inode *parent_inode, int inode_num, char *filename) {
 	size_count = 0;
 	/* find if there are some invalid dentry(file deleted) */
 	for (i = 0; i < parent_inode->block_count; ++i) {
-		dentry = (rd_dentry*)parent_inode->block_addr[i];
+		dentry = (rd_dentry*)inode_block(rd, parent_inode, i);
 		for (j = 0; j < max_dentry_num; ++j) {
-			if (dentry->inode_num == -1) {
-				dentry->inode_num = inode_num;
+			if (dentry->inode_num == RD_DENTRY_FREE) {
 				strcpy(dentry->filename, filename);
+				smp_store_release(&dentry->inode_num, inode_num);
+				mark_dirty(rd, dentry, sizeof(rd_dentry));
 				return 0;
 			}
 			size_count += sizeof(rd_dentry);
@@ -345,47 +1428,42 @@ int add_dentry(rd_inode *parent_inode, int inode_num, char *filename) {
 	}
 
 	/* find the last block, if not enough block size remains, allocate a new block */
-	if (parent_block_count == RD_MAX_FILE_BLK) {
-		printk("Error: Failed to add dentry, max file size reached.\n");
+	if (parent_block_count == RD_MAX_FILE_BLK)
 		return -1;
-	}
 	if (offset + sizeof(rd_dentry) > RD_BLOCK_SIZE) {
-		parent_inode->file_size += RD_BLOCK_SIZE - offset;
-		parent_inode->block_addr[parent_block_count] = allocate_block();
-		parent_last_block = parent_inode->block_addr[parent_block_count];
-		if (parent_last_block == NULL) {
-			printk("Error: Failed to add dentry, no free blocks available.\n");
+		parent_last_block = allocate_block(rd);
+		if (parent_last_block == NULL)
 			return -1;
-		}
+		set_inode_block(rd, parent_inode, parent_block_count, parent_last_block);
 		parent_inode->block_count++;
 		
+		parent_file_size += RD_BLOCK_SIZE - offset;
 		offset = 0;
 	} else {
-		parent_last_block = parent_inode->block_addr[parent_block_count-1];
+		parent_last_block = inode_block(rd, parent_inode, parent_block_count-1);
 	}
-	/* write the dentry */
+	/* write the dentry, then publish it by growing the dir */
 	dentry = (rd_dentry*)(parent_last_block + offset);
-	dentry->inode_num = inode_num;
 	strcpy(dentry->filename, filename);
-	parent_inode->file_size += sizeof(rd_dentry);
+	dentry->inode_num = inode_num;
+	smp_store_release(&parent_inode->file_size, parent_file_size + sizeof(rd_dentry));
+	mark_dirty(rd, dentry, sizeof(rd_dentry));
+	mark_dirty(rd, parent_inode, sizeof(rd_inode));
 	return 0;
 }
 
 /*
  * Get the dentry of the given path
  */
-rd_dentry* get_dentry(const char *path) {
+rd_dentry* get_dentry(rd_ctx *rd, const char *path) {
 	rd_dentry *dentry;
 	rd_inode *par_inode;
 	rd_inode *file_inode;
-	char *filename;
-	int ret, i, j, dir_num, size_count;
+	char filename[RD_MAX_FILENAME];
+	int ret;
 
 
-	filename = (char*)vmalloc(RD_MAX_FILENAME);
-	ret = parse_path(path, RD_FILEORDIR, &par_inode, &file_inode, filename);
-	dir_num = RD_BLOCK_SIZE / sizeof(rd_dentry);
-	size_count = 0;
+	ret = parse_path(rd, path, RD_FILEORDIR, &par_inode, &file_inode, filename);
 	if (ret == -1) {
 		printk("Error: Invalid path %s.\n", path);
 		return NULL;
@@ -394,76 +1472,88 @@ rd_dentry* get_dentry(const char *path) {
 		return NULL;
 	}
 
-	for (i = 0; i < par_inode->block_count; ++i) {
-		dentry = (rd_dentry*)par_inode->block_addr[i];
-		for (j = 0; j < dir_num; ++j) {
-			if (dentry->inode_num == file_inode->inode_num) {
-				return dentry;
-			}
-			size_count += sizeof(rd_dentry);
-			if (size_count >= par_inode->file_size)
-				break;
-			dentry++;
-		}
-	}
-
-	return NULL;
+	down_read(inode_sem(rd, par_inode));
+	dentry = find_dentry(rd, par_inode, filename, NULL);
+	up_read(inode_sem(rd, par_inode));
+	return dentry;
 }
 
 /* 
  * Create a file according to the given ABSOLUTE path
  */
-int ramfs_create(const char *path, char *msg) {
+int ramfs_create(rd_ctx *rd, const char *path, char *msg) {
 	rd_inode *parent_inode;
 	rd_inode *file_inode;
 	char *file_block;
-	char *filename;
-	rd_dentry *dentry;
+	char filename[RD_MAX_FILENAME];
+	bool waited;
 	int ret;
 
-	dentry = NULL;
-	filename = (char*)vmalloc(RD_MAX_FILENAME);
-	ret = parse_path(path, RD_FILE, &parent_inode, &file_inode, filename);
+	waited = false;
+retry:
+	/* taken before the walk, so a dir removal can't free the parent under us */
+	percpu_down_read(&rd->freeze_sem);
+	ret = parse_path(rd, path, RD_FILE, &parent_inode, &file_inode, filename);
 	if (ret == -1) {
-		sprintf(msg + strlen(msg), "Error: Invalid Path '%s'.\n", path);
+		percpu_up_read(&rd->freeze_sem);
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Invalid Path '%s'.\n", path);
 		return -1;
 	} else if (ret == 1) {
-		sprintf(msg + strlen(msg), "Error: File '%s' already exists.\n", path);
+		percpu_up_read(&rd->freeze_sem);
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: File '%s' already exists.\n", path);
 		return -1;
 	}
 
+	down_write(inode_sem(rd, parent_inode));
+	/* someone may have created it since the lookup */
+	if (find_dentry(rd, parent_inode, filename, NULL) != NULL) {
+		up_write(inode_sem(rd, parent_inode));
+		percpu_up_read(&rd->freeze_sem);
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: File '%s' already exists.\n", path);
+		return -1;
+	}
 
 	/* Allocate a block for the file */
-	file_block = allocate_block();
+	file_block = allocate_block(rd);
 	if (file_block == NULL) {
+		up_write(inode_sem(rd, parent_inode));
+		percpu_up_read(&rd->freeze_sem);
 		sprintf(msg + strlen(msg), "Error: No free blocks available.\n");
 		return -1;
 	}
 	/* Allocate a inode for the file */
-	file_inode = allocate_inode();
+	file_inode = allocate_inode(rd, RD_FILE);
 
 	if (file_inode == NULL) {
+		up_write(inode_sem(rd, parent_inode));
+		percpu_up_read(&rd->freeze_sem);
+		free_block(rd, file_block);
+		if (!waited && wait_inode_reclaims(rd)) {
+			waited = true;
+			goto retry;
+		}
 		sprintf(msg + strlen(msg), "Error: No free inodes available.\n");
-		free_block(file_block);
 		return -1;
 	}
 
 	/* Init this inode */
-	file_inode->file_type = RD_FILE;
 	file_inode->file_size = 0;
 	file_inode->block_count = 1;
-	file_inode->block_addr[0] = file_block;
+	set_inode_block(rd, file_inode, 0, file_block);
+	mark_dirty(rd, file_inode, sizeof(rd_inode));
 
 	/* Add a dentry to its parent */
-	ret = add_dentry(parent_inode, file_inode->inode_num, filename);
+	ret = add_dentry(rd, parent_inode, file_inode->inode_num, filename);
+	up_write(inode_sem(rd, parent_inode));
+	percpu_up_read(&rd->freeze_sem);
 	if (ret == -1) {
 		sprintf(msg + strlen(msg), "Error: Parent dir's size reaches max-file-size.\n");
-		free_inode(file_inode);
-		free_block(file_block);
+		free_inode(rd, file_inode);
+		free_block(rd, file_block);
 		return -1;
 	}
 
-	sprintf(msg + strlen(msg), "Successfully create '%s'.\n", path);
+	scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Successfully create '%s'.\n", path);
 	return 0;
 
 }
@@ -471,454 +1561,2871 @@ int ramfs_create(const char *path, char *msg) {
 /*
  * Make a new directory according to the given path.
  */
-int ramfs_mkdir(const char *path, char *msg) {
+int ramfs_mkdir(rd_ctx *rd, const char *path, char *msg) {
 	rd_inode *parent_inode;
 	rd_inode *file_inode;
 	char *file_block;
-	char *filename;
-	rd_dentry *dentry;
+	char filename[RD_MAX_FILENAME];
+	bool waited;
 	int ret;
 
-	dentry = NULL;
-	filename = (char*)vmalloc(RD_MAX_FILENAME);
-	ret = parse_path(path, RD_DIRECTORY, &parent_inode, &file_inode, filename);
+	waited = false;
+retry:
+	percpu_down_read(&rd->freeze_sem);
+	ret = parse_path(rd, path, RD_DIRECTORY, &parent_inode, &file_inode, filename);
 	if (ret == -1) {
-		sprintf(msg + strlen(msg), "Error: Invalid Path '%s'.\n", path);
+		percpu_up_read(&rd->freeze_sem);
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Invalid Path '%s'.\n", path);
 		return -1;
 	} else if (ret == 1) {
-		sprintf(msg + strlen(msg), "Error: File '%s' already exists.\n", path);
+		percpu_up_read(&rd->freeze_sem);
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: File '%s' already exists.\n", path);
+		return -1;
+	}
+
+	down_write(inode_sem(rd, parent_inode));
+	/* someone may have created it since the lookup */
+	if (find_dentry(rd, parent_inode, filename, NULL) != NULL) {
+		up_write(inode_sem(rd, parent_inode));
+		percpu_up_read(&rd->freeze_sem);
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: File '%s' already exists.\n", path);
 		return -1;
 	}
 
 	/* Allocate a block for the file */
-	file_block = allocate_block();
+	file_block = allocate_block(rd);
 	if (file_block == NULL) {
+		up_write(inode_sem(rd, parent_inode));
+		percpu_up_read(&rd->freeze_sem);
 		sprintf(msg + strlen(msg), "Error: No free blocks available.\n");
 		return -1;
 	}
 	/* Allocate a inode for the file */
-	file_inode = allocate_inode();
+	file_inode = allocate_inode(rd, RD_DIRECTORY);
 
 	if (file_inode == NULL) {
+		up_write(inode_sem(rd, parent_inode));
+		percpu_up_read(&rd->freeze_sem);
+		free_block(rd, file_block);
+		if (!waited && wait_inode_reclaims(rd)) {
+			waited = true;
+			goto retry;
+		}
 		sprintf(msg + strlen(msg), "Error: No free inodes available.\n");
-		free_block(file_block);
 		return -1;
 	}
 
 	/* Init this inode */
-	file_inode->file_type = RD_DIRECTORY;
 	file_inode->file_size = 0;
 	file_inode->block_count = 1;
-	file_inode->block_addr[0] = file_block;
+	set_inode_block(rd, file_inode, 0, file_block);
+	mark_dirty(rd, file_inode, sizeof(rd_inode));
 
-	/* Add a dentry to its parent */
-	ret = add_dentry(parent_inode, file_inode->inode_num, filename);
+	/* Add . .. dentry before the dir becomes visible */
+	ret = add_dentry(rd, file_inode, file_inode->inode_num, ".");
 	if (ret == -1) {
+		up_write(inode_sem(rd, parent_inode));
+		percpu_up_read(&rd->freeze_sem);
 		sprintf(msg + strlen(msg), "Error: Cannot add dentry.\n");
-		free_inode(file_inode);
-		free_block(file_block);
-		return -1;
+		free_inode(rd, file_inode);
+		free_block(rd, file_block);
+		return -1;		
 	}
 
-	/* Add . .. dentry */
-	ret = add_dentry(file_inode, file_inode->inode_num, ".");
+	ret = add_dentry(rd, file_inode, parent_inode->inode_num, "..");
 	if (ret == -1) {
+		up_write(inode_sem(rd, parent_inode));
+		percpu_up_read(&rd->freeze_sem);
 		sprintf(msg + strlen(msg), "Error: Cannot add dentry.\n");
-		free_inode(file_inode);
-		free_block(file_block);
+		free_inode(rd, file_inode);
+		free_block(rd, file_block);
 		return -1;		
-	}
+	}	
 
-	ret = add_dentry(file_inode, parent_inode->inode_num, "..");
+	/* Add a dentry to its parent */
+	ret = add_dentry(rd, parent_inode, file_inode->inode_num, filename);
+	up_write(inode_sem(rd, parent_inode));
+	percpu_up_read(&rd->freeze_sem);
 	if (ret == -1) {
 		sprintf(msg + strlen(msg), "Error: Cannot add dentry.\n");
-		free_inode(file_inode);
-		free_block(file_block);
-		return -1;		
-	}	
+		free_inode(rd, file_inode);
+		free_block(rd, file_block);
+		return -1;
+	}
 
-	sprintf(msg + strlen(msg), "Successfully mkdir '%s'.\n", path);
+	scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Successfully mkdir '%s'.\n", path);
 	return 0;	
 }
 
+/*
+ * Free a regular file that was just unlinked, with its blocks, and make
+ * every open fd of it invalid. The caller holds the file's lock.
+ */
+static void drop_file(rd_ctx *rd, rd_inode *file_inode) {
+	rd_fdt *fdt;
+	int i;
+
+	for (i = 0; i < file_inode->block_count; ++i)
+		free_block(rd, inode_block(rd, file_inode, i));
+	/* the inode can't be reclaimed and reused by a new file until the scan is over */
+	rcu_read_lock();
+	free_inode(rd, file_inode);
+
+	/*
+	 * Then close its fds. A lockless open racing with us either installed
+	 * its fd before we scan, or sees RD_RECLAIMING after installing it and
+	 * backs out.
+	 */
+	spin_lock(&rd->fdt_tables_lock);
+	list_for_each_entry(fdt, &rd->fdt_tables, list) {
+		spin_lock(&fdt->lock);
+		for (i = 0; i < RD_MAX_FILE; ++i) {
+			if (fdt->files[i] != NULL && fdt->files[i]->inode == file_inode) {
+				fdt->files[i]->closed = true;
+				free_fd(fdt, i);
+			}
+		}
+		spin_unlock(&fdt->lock);
+	}
+	spin_unlock(&rd->fdt_tables_lock);
+	rcu_read_unlock();
+}
+
 /*
  * Delete a regular file according to the given path
  */
-int ramfs_delete(const char *path, char *msg) {
+int ramfs_delete(rd_ctx *rd, const char *path, char *msg) {
 	rd_inode *parent_inode;
 	rd_inode *file_inode;
-	char *filename;
+	char filename[RD_MAX_FILENAME];
 	rd_dentry *dentry;
-	int ret, i;
+	int ret;
 
-	dentry = NULL;
-	filename = (char*)vmalloc(RD_MAX_FILENAME);
-	ret = parse_path(path, RD_FILE, &parent_inode, &file_inode, filename);
+	percpu_down_read(&rd->freeze_sem);
+	ret = parse_path(rd, path, RD_FILE, &parent_inode, &file_inode, filename);
 	if (ret == -1) {
-		sprintf(msg + strlen(msg), "Error: Invalid path '%s'.\n", path);
+		percpu_up_read(&rd->freeze_sem);
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Invalid path '%s'.\n", path);
 		return -1;
 	} else if (ret == 0) {
-		sprintf(msg + strlen(msg), "Error: Path '%s' doesn't exist.\n", path);
+		percpu_up_read(&rd->freeze_sem);
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Path '%s' doesn't exist.\n", path);
+		return -1;
+	}
+
+	down_write(inode_sem(rd, parent_inode));
+	dentry = find_dentry(rd, parent_inode, filename, NULL);
+	if (dentry == NULL) {
+		up_write(inode_sem(rd, parent_inode));
+		percpu_up_read(&rd->freeze_sem);
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Path '%s' doesn't exist.\n", path);
 		return -1;
-	} else if (file_inode->file_type != RD_FILE) {
-		sprintf(msg + strlen(msg), "Error: Path '%s' is not a regular file.\n", path);
+	}
+	file_inode = rd->inode_list + dentry->inode_num;
+	if (file_inode->file_type != RD_FILE) {
+		up_write(inode_sem(rd, parent_inode));
+		percpu_up_read(&rd->freeze_sem);
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Path '%s' is not a regular file.\n", path);
 		return -1;
 	}
 
+	/* wait for in-flight I/O, unlink and free the file */
+	down_write(inode_sem(rd, file_inode));
+	free_dentry(rd, dentry);
+	drop_file(rd, file_inode);
+	up_write(inode_sem(rd, file_inode));
+	up_write(inode_sem(rd, parent_inode));
+	percpu_up_read(&rd->freeze_sem);
+	scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Successfully delete '%s'.\n", path);
+	return 0;
+}
+
+/*
+ * Whether the given dir has no entries but . and .., dead slots are only
+ * reclaimed after a grace period so file_size alone doesn't tell
+ */
+static bool dir_empty(rd_ctx *rd, rd_inode *inode) {
+	rd_dentry *dentry;
+	int i, j, dir_num, remain;
 
-	for (i = 0; i < RD_MAX_FILE; ++i) {
-		if (fd_list[i] != NULL && fd_list[i]->inode == file_inode) {
-			free_fd(i);
+	dir_num = RD_BLOCK_SIZE / sizeof(rd_dentry);
+	for (i = 0; i * RD_BLOCK_SIZE < inode->file_size; ++i) {
+		remain = inode->file_size - i * RD_BLOCK_SIZE;
+		dentry = (rd_dentry*)inode_block(rd, inode, i);
+		for (j = 0; j < dir_num && (int)((j + 1) * sizeof(rd_dentry)) <= remain; ++j, ++dentry) {
+			if (dentry->inode_num >= 0 && strcmp(dentry->filename, ".") != 0 &&
+			    strcmp(dentry->filename, "..") != 0)
+				return false;
 		}
 	}
-
-	dentry = get_dentry(path);
-	free_dentry(dentry);
-	for (i = 0; i < file_inode->block_count; ++i)
-		free_block(file_inode->block_addr[i]);
-	free_inode(file_inode);
-	sprintf(msg + strlen(msg), "Successfully delete '%s'.\n", path);
-	return 0;
+	return true;
 }
-/* 
- * Open a file according to the given path
- * Allocate a new fd for this file, then return the fd.
+
+/*
+ * Remove the file or dir at path and, if recursive, everything below it.
+ * The ramdisk is frozen like for a snapshot: the subtree is collected in one
+ * walk, unlinked, its fds closed in one scan of the fd tables, and then all
+ * its blocks and inodes are freed in bulk. Without recursive only an empty
+ * dir is removed.
  */
-int ramfs_open(const char *path, int mode, char *msg) {
-	int ret, fd;
-	rd_inode *par_inode;
+static int remove_tree(rd_ctx *rd, const char *path, bool recursive, char *msg) {
+	rd_fdt *fdt;
+	rd_inode *parent_inode;
 	rd_inode *file_inode;
-	rd_file *file;
-	char *filename;
+	rd_inode *inode;
+	rd_inode **inodes;
+	rd_dentry *dentry;
+	unsigned char *doomed;
+	char **blocks;
+	char filename[RD_MAX_FILENAME];
+	int ret, i, j, k, n, head, dir_num, remain, block_count, freed, closed;
 
-	filename = (char *)vmalloc(RD_MAX_FILENAME);
+	inodes = NULL;
+	doomed = NULL;
+	blocks = NULL;
+	percpu_down_write(&rd->freeze_sem);
+	ret = parse_path(rd, path, RD_FILEORDIR, &parent_inode, &file_inode, filename);
+	if (ret == -1) {
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Invalid path '%s'.\n", path);
+		goto out;
+	} else if (ret == 0) {
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Path '%s' doesn't exist.\n", path);
+		ret = -1;
+		goto out;
+	} else if (file_inode == rd->inode_list) {
+		sprintf(msg + strlen(msg), "Error: Cannot remove the root dir.\n");
+		ret = -1;
+		goto out;
+	} else if (strcmp(filename, ".") == 0 || strcmp(filename, "..") == 0) {
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Invalid path '%s'.\n", path);
+		ret = -1;
+		goto out;
+	} else if (!recursive && file_inode->file_type != RD_DIRECTORY) {
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Path '%s' is not a dir path.\n", path);
+		ret = -1;
+		goto out;
+	} else if (!recursive && !dir_empty(rd, file_inode)) {
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Dir '%s' is not empty.\n", path);
+		ret = -1;
+		goto out;
+	}
 
+	inodes = (rd_inode**)vmalloc(sizeof(rd_inode*) * RD_INODE_NUM);
+	doomed = (unsigned char*)vzalloc(RD_INODE_NUM);
+	if (inodes == NULL || doomed == NULL) {
+		sprintf(msg + strlen(msg), "Error: Out of memory.\n");
+		ret = -1;
+		goto out;
+	}
 
-	ret = parse_path(path, RD_FILE, &par_inode, &file_inode, filename);
+	/* collect the subtree breadth first, the queue is the result */
+	inodes[0] = file_inode;
+	doomed[file_inode->inode_num] = 1;
+	n = 1;
+	block_count = file_inode->block_count;
+	dir_num = RD_BLOCK_SIZE / sizeof(rd_dentry);
+	for (head = 0; head < n; ++head) {
+		inode = inodes[head];
+		if (inode->file_type != RD_DIRECTORY)
+			continue;
+		for (i = 0; i * RD_BLOCK_SIZE < inode->file_size; ++i) {
+			remain = inode->file_size - i * RD_BLOCK_SIZE;
+			dentry = (rd_dentry*)inode_block(rd, inode, i);
+			for (j = 0; j < dir_num && (int)((j + 1) * sizeof(rd_dentry)) <= remain; ++j, ++dentry) {
+				if (dentry->inode_num < 0 || strcmp(dentry->filename, ".") == 0 ||
+				    strcmp(dentry->filename, "..") == 0)
+					continue;
+				inodes[n++] = rd->inode_list + dentry->inode_num;
+				doomed[dentry->inode_num] = 1;
+				block_count += rd->inode_list[dentry->inode_num].block_count;
+			}
+		}
+	}
 
-	if (ret == -1) {
-		sprintf(msg + strlen(msg), "Error: Invalid path '%s'.\n", path);
-		return -1;
-	} else if (ret == 0) {
-		sprintf(msg + strlen(msg), "Error: Path '%s' doesn't exist.\n", path);
-		return -1;
-	} else if (file_inode->file_type != RD_FILE) {
-		sprintf(msg + strlen(msg), "Error: Path '%s' is not a regular file.\n", path);
-		return -1;
+	blocks = (char**)vmalloc(sizeof(char*) * (block_count > 0 ? block_count : 1));
+	if (blocks == NULL) {
+		sprintf(msg + strlen(msg), "Error: Out of memory.\n");
+		ret = -1;
+		goto out;
 	}
-	/* allocate a new fd */
 
-	fd = allocate_fd();
-	if (fd == -1) {
-		sprintf(msg + strlen(msg), "Error: No free fd available.\n");
-		return -1;
+	/* unlink, then no new lookup can get into the subtree */
+	down_write(inode_sem(rd, parent_inode));
+	dentry = find_dentry(rd, parent_inode, filename, NULL);
+	free_dentry(rd, dentry);
+	up_write(inode_sem(rd, parent_inode));
+
+	closed = 0;
+	spin_lock(&rd->fdt_tables_lock);
+	list_for_each_entry(fdt, &rd->fdt_tables, list) {
+		spin_lock(&fdt->lock);
+		for (i = 0; i < RD_MAX_FILE; ++i) {
+			if (fdt->files[i] != NULL && doomed[fdt->files[i]->inode->inode_num]) {
+				fdt->files[i]->closed = true;
+				free_fd(fdt, i);
+				closed++;
+			}
+		}
+		spin_unlock(&fdt->lock);
 	}
+	spin_unlock(&rd->fdt_tables_lock);
 
-	file = fd_list[fd];
-	strcpy(file->path, path);
-	file->inode = file_inode;
-	file->dentry = get_dentry(path);
-	file->offset = 0;
-	file->mode = mode;
+	/*
+	 * The unlink queued its reclaim after a grace period, so once that ran
+	 * no lockless walker is left in the subtree, and the dead slots of its
+	 * dirs are reclaimed before their blocks are handed out again.
+	 */
+	rcu_barrier();
+	flush_workqueue(rd->reclaim_wq);
 
-	sprintf(msg + strlen(msg), "Successfully open '%s'.\n", path);
-	return fd;
+	for (k = 0, i = 0; i < n; ++i) {
+		for (j = 0; j < inodes[i]->block_count; ++j)
+			blocks[k++] = inode_block(rd, inodes[i], j);
+	}
+	freed = free_blocks(rd, blocks, k);
+	free_inodes(rd, inodes, n);
+	if (recursive)
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Successfully remove '%s', %d inodes and %d blocks freed, %d fds closed.\n",
+			path, n, freed, closed);
+	else
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Successfully rmdir '%s'.\n", path);
+	ret = 0;
+out:
+	percpu_up_write(&rd->freeze_sem);
+	vfree(blocks);
+	vfree(doomed);
+	vfree(inodes);
+	return ret;
 }
 
 /*
- * Close a file according to the given fd.
+ * Remove the empty dir at the given path
  */
-int ramfs_close(int fd, char *msg) {
-	
-	if (fd < 0 || fd >= RD_MAX_FILE) {
-		sprintf(msg + strlen(msg), "Error: Invalid fd '%d'.\n", fd);
-		return -1;
-	}
+int ramfs_rmdir(rd_ctx *rd, const char *path, char *msg) {
+	return remove_tree(rd, path, false, msg);
+}
 
-	if (fd_list[fd] == NULL) {
-		sprintf(msg + strlen(msg), "Error: Invalid fd '%d'.\n", fd);
-		return -1;
+/*
+ * Remove the file or dir at the given path with everything below it
+ */
+int ramfs_rmtree(rd_ctx *rd, const char *path, char *msg) {
+	return remove_tree(rd, path, true, msg);
+}
+
+/* Lock the two parent dirs of a rename, in inode number order */
+static void lock_parents(rd_ctx *rd, rd_inode *a, rd_inode *b) {
+	if (a == b) {
+		down_write(inode_sem(rd, a));
+	} else if (a->inode_num < b->inode_num) {
+		down_write(inode_sem(rd, a));
+		down_write(inode_sem(rd, b));
+	} else {
+		down_write(inode_sem(rd, b));
+		down_write(inode_sem(rd, a));
 	}
-	free_fd(fd);
-	sprintf(msg + strlen(msg), "Successfully close '%d'.\n", fd);
-	return 0;
+}
+
+static void unlock_parents(rd_ctx *rd, rd_inode *a, rd_inode *b) {
+	up_write(inode_sem(rd, a));
+	if (a != b)
+		up_write(inode_sem(rd, b));
 }
 
 /*
- * Read a file according to the given fd.
- * return the number of bytes that are successfully read.
+ * Move the entry at src_path to dst_path for ramfs_rename. Only dentries
+ * change, the file's blocks are never touched. Moving a dir needs the
+ * ramdisk frozen, so the cycle check holds and no lookup is inside it;
+ * without frozen it returns 1 for a dir and changes nothing.
  */
-int ramfs_read(int fd, char *buf, size_t count, char *msg) {
-	rd_file *file;
+static int rename_entry(rd_ctx *rd, const char *src_path, const char *dst_path, bool frozen, char *msg) {
+	rd_inode *src_parent;
+	rd_inode *src_inode;
+	rd_inode *dst_parent;
+	rd_inode *dst_inode;
 	rd_inode *inode;
-	char *byte;
-	int offset, blknum, blkoffset, i, read_cnt;
+	rd_dentry *src_dentry;
+	rd_dentry *dst_dentry;
+	rd_dentry *dentry;
+	char src_name[RD_MAX_FILENAME];
+	char dst_name[RD_MAX_FILENAME];
+	int ret, num;
 
-	if (fd < 0 || fd >= RD_MAX_FILE) {
-		sprintf(msg + strlen(msg), "Error: Invalid fd %d.\n", fd);
+	ret = parse_path(rd, src_path, RD_FILEORDIR, &src_parent, &src_inode, src_name);
+	if (ret == -1) {
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Invalid path '%s'.\n", src_path);
+		return -1;
+	} else if (ret == 0) {
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Path '%s' doesn't exist.\n", src_path);
+		return -1;
+	} else if (src_inode == rd->inode_list) {
+		sprintf(msg + strlen(msg), "Error: Cannot rename the root dir.\n");
+		return -1;
+	} else if (strcmp(src_name, ".") == 0 || strcmp(src_name, "..") == 0) {
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Invalid path '%s'.\n", src_path);
 		return -1;
 	}
-
-	file = fd_list[fd];
-	/* check if the fd is valid */
-	if (file == NULL) {
-		sprintf(msg + strlen(msg), "Error: Invalid fd '%d'.\n", fd);
+	ret = parse_path(rd, dst_path, RD_FILEORDIR, &dst_parent, &dst_inode, dst_name);
+	if (ret == -1 || (ret == 1 && (dst_inode == rd->inode_list ||
+	    strcmp(dst_name, ".") == 0 || strcmp(dst_name, "..") == 0))) {
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Invalid path '%s'.\n", dst_path);
 		return -1;
 	}
-	/* check if the file is write-only */
-	if (file->mode == RD_WRONLY) {
-		sprintf(msg + strlen(msg), "Error: Write only file '%s'.\n", file->path);
+	if (READ_ONCE(src_inode->file_type) == RD_DIRECTORY) {
+		if (!frozen)
+			return 1;
+		/* a dir can't move below itself, look for it on the way up from the new parent */
+		for (inode = dst_parent; inode != src_inode && inode != rd->inode_list; inode = rd->inode_list + num)
+			find_dentry(rd, inode, "..", &num);
+		if (inode == src_inode) {
+			scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Cannot move '%s' into itself.\n", src_path);
+			return -1;
+		}
+	}
+
+	lock_parents(rd, src_parent, dst_parent);
+	/* both may have changed since the lookups */
+	src_dentry = find_dentry(rd, src_parent, src_name, &num);
+	if (src_dentry == NULL) {
+		unlock_parents(rd, src_parent, dst_parent);
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Path '%s' doesn't exist.\n", src_path);
 		return -1;
 	}
-	offset = file->offset;
-	inode = file->inode;
-	/* check if the file reaches the max-file-size */
-	if (offset == inode->file_size) {
+	src_inode = rd->inode_list + num;
+	if (src_inode->file_type == RD_DIRECTORY && !frozen) {
+		unlock_parents(rd, src_parent, dst_parent);
+		return 1;
+	}
+	dst_dentry = find_dentry(rd, dst_parent, dst_name, &num);
+	if (dst_dentry == src_dentry) {
+		unlock_parents(rd, src_parent, dst_parent);
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Successfully rename '%s' to '%s'.\n", src_path, dst_path);
 		return 0;
 	}
 
-	blknum = offset / RD_BLOCK_SIZE;
-	blkoffset = offset % RD_BLOCK_SIZE;
-	byte = inode->block_addr[blknum] + blkoffset;
-	read_cnt = 0;
-
-	for (i = 0; i < count; ++i) {
-		*(buf++) = *(byte++);
-		read_cnt++;
-		offset++;
-		if (offset == inode->file_size) {
-			break;
+	if (dst_dentry != NULL) {
+		/* replace a file in place, lookups see either the old or the new one */
+		dst_inode = rd->inode_list + num;
+		if (src_inode->file_type != RD_FILE || dst_inode->file_type != RD_FILE) {
+			unlock_parents(rd, src_parent, dst_parent);
+			scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: File '%s' already exists.\n", dst_path);
+			return -1;
 		}
-		if (offset % RD_BLOCK_SIZE == 0) {
-			/* go to the next block */
-			blknum++;
-			byte = inode->block_addr[blknum];
+		down_write(inode_sem(rd, dst_inode));
+		smp_store_release(&dst_dentry->inode_num, src_inode->inode_num);
+		mark_dirty(rd, dst_dentry, sizeof(rd_dentry));
+		free_dentry(rd, src_dentry);
+		drop_file(rd, dst_inode);
+		up_write(inode_sem(rd, dst_inode));
+	} else {
+		/* link the new name before the old one goes, so the file is never missing */
+		if (add_dentry(rd, dst_parent, src_inode->inode_num, dst_name) == -1) {
+			unlock_parents(rd, src_parent, dst_parent);
+			sprintf(msg + strlen(msg), "Error: Cannot add dentry.\n");
+			return -1;
 		}
+		free_dentry(rd, src_dentry);
 	}
-	file->offset = offset;
-	sprintf(msg + strlen(msg), "Successfully read '%d' bytes from fd '%d'.\n", read_cnt, fd);
-	return read_cnt;
+	if (src_inode->file_type == RD_DIRECTORY && src_parent != dst_parent) {
+		dentry = find_dentry(rd, src_inode, "..", NULL);
+		smp_store_release(&dentry->inode_num, dst_parent->inode_num);
+		mark_dirty(rd, dentry, sizeof(rd_dentry));
+	}
+	unlock_parents(rd, src_parent, dst_parent);
+	scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Successfully rename '%s' to '%s'.\n", src_path, dst_path);
+	return 0;
 }
 
 /*
- * Write a file according to the given fd.
- * return the number of bytes that are successfully written.
+ * Rename or move the file or dir at src_path to dst_path. An existing file
+ * at dst_path is replaced atomically and its open fds are closed, anything
+ * else there is an error. Moving a file only takes the two dirs' locks,
+ * moving a dir freezes the ramdisk like a snapshot.
  */
-int ramfs_write(int fd, char *buf, size_t count, char *msg) {
+int ramfs_rename(rd_ctx *rd, const char *src_path, const char *dst_path, char *msg) {
+	int ret;
 
-	rd_file *file;
-	rd_inode *inode;
-	char *byte;
-	int offset, blknum, blkoffset, i, write_cnt;
-	if (fd < 0 || fd >= RD_MAX_FILE) {
-		sprintf(msg + strlen(msg), "Error: Invalid fd %d.\n", fd);
+	percpu_down_read(&rd->freeze_sem);
+	ret = rename_entry(rd, src_path, dst_path, false, msg);
+	percpu_up_read(&rd->freeze_sem);
+	if (ret == 1) {
+		percpu_down_write(&rd->freeze_sem);
+		ret = rename_entry(rd, src_path, dst_path, true, msg);
+		percpu_up_write(&rd->freeze_sem);
+	}
+	return ret;
+}
+
+/*
+ * Bulk stat
+ *
+ * One call fills an rd_stat for every entry of a dir, or for every path of
+ * a list, so a scanner doesn't need an ioctl per file.
+ * Both return the number of entries and fill in at most max of them.
+ */
+static void stat_entry(struct rd_stat *st, const char *filename, rd_inode *inode) {
+	strcpy(st->filename, filename);
+	if (inode == NULL) {
+		st->inode_num = -1;
+		st->file_type = 0;
+		st->file_size = 0;
+		st->block_count = 0;
+		return;
+	}
+	st->inode_num = inode->inode_num;
+	st->file_type = READ_ONCE(inode->file_type);
+	st->file_size = READ_ONCE(inode->file_size);
+	st->block_count = READ_ONCE(inode->block_count);
+}
+
+/*
+ * Stat every entry of the dir at path but . and .., straight from its
+ * dentries. The dir's lock keeps its entries from being freed meanwhile.
+ */
+int ramfs_stat_dir(rd_ctx *rd, const char *path, struct rd_stat *stats, int max, char *msg) {
+	rd_inode *par_inode;
+	rd_inode *inode;
+	rd_dentry *dentry;
+	char filename[RD_MAX_FILENAME];
+	int ret, i, j, n, dir_num, remain;
+
+	percpu_down_read(&rd->freeze_sem);
+	ret = parse_path(rd, path, RD_DIRECTORY, &par_inode, &inode, filename);
+	if (ret == -1) {
+		percpu_up_read(&rd->freeze_sem);
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Invalid path '%s'.\n", path);
+		return -1;
+	} else if (ret == 0) {
+		percpu_up_read(&rd->freeze_sem);
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Path '%s' doesn't exist.\n", path);
+		return -1;
+	} else if (inode->file_type != RD_DIRECTORY) {
+		percpu_up_read(&rd->freeze_sem);
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Path '%s' is not a dir path.\n", path);
+		return -1;
+	}
+	down_read(inode_sem(rd, inode));
+	n = 0;
+	dir_num = RD_BLOCK_SIZE / sizeof(rd_dentry);
+	for (i = 0; i * RD_BLOCK_SIZE < inode->file_size; ++i) {
+		remain = inode->file_size - i * RD_BLOCK_SIZE;
+		dentry = (rd_dentry*)inode_block(rd, inode, i);
+		for (j = 0; j < dir_num && (int)((j + 1) * sizeof(rd_dentry)) <= remain; ++j, ++dentry) {
+			if (dentry->inode_num < 0 || strcmp(dentry->filename, ".") == 0 ||
+			    strcmp(dentry->filename, "..") == 0)
+				continue;
+			if (n < max)
+				stat_entry(stats + n, dentry->filename, rd->inode_list + dentry->inode_num);
+			n++;
+		}
+	}
+	up_read(inode_sem(rd, inode));
+	percpu_up_read(&rd->freeze_sem);
+	scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Successfully stat '%d' entries of '%s'.\n", n, path);
+	return n;
+}
+
+/*
+ * Stat every path of a newline separated list, in order. A path that
+ * doesn't exist gets an inode_num of -1. The list is cut up in place.
+ */
+int ramfs_stat_paths(rd_ctx *rd, char *paths, struct rd_stat *stats, int max, char *msg) {
+	rd_inode *par_inode;
+	rd_inode *inode;
+	char filename[RD_MAX_FILENAME];
+	char *path;
+	int ret, n, missing;
+
+	n = 0;
+	missing = 0;
+	percpu_down_read(&rd->freeze_sem);
+	while ((path = strsep(&paths, "\n")) != NULL) {
+		if (strlen(path) == 0)
+			continue;
+		strcpy(filename, "/");
+		/* the inode can't be reused before we are done with it */
+		rcu_read_lock();
+		ret = parse_path(rd, path, RD_FILEORDIR, &par_inode, &inode, filename);
+		/* a file deleted since the lookup is gone as well */
+		if (ret != 1 || (READ_ONCE(inode->file_type) != RD_FILE &&
+		    READ_ONCE(inode->file_type) != RD_DIRECTORY)) {
+			inode = NULL;
+			missing++;
+		}
+		if (n < max)
+			stat_entry(stats + n, filename, inode);
+		rcu_read_unlock();
+		n++;
+	}
+	percpu_up_read(&rd->freeze_sem);
+	sprintf(msg + strlen(msg), "Successfully stat '%d' paths, '%d' not found.\n", n, missing);
+	return n;
+}
+/* 
+ * Open a file according to the given path
+ * Allocate a new fd for this file, then return the fd.
+ * Takes no lock except the short fd table one: the lookup and the fd install
+ * both run under rcu_read_lock so the inode cannot be reused in between.
+ */
+int ramfs_open(rd_fdt *fdt, const char *path, int mode, char *msg) {
+	rd_ctx *rd = fdt->rd;
+	int ret, fd;
+	rd_inode *par_inode;
+	rd_inode *file_inode;
+	rd_file *file;
+	char filename[RD_MAX_FILENAME];
+
+	file = (rd_file*)kmalloc(sizeof(rd_file), GFP_KERNEL);
+	if (file == NULL) {
+		sprintf(msg + strlen(msg), "Error: No free fd available.\n");
+		return -1;
+	}
+
+	percpu_down_read(&rd->freeze_sem);
+	rcu_read_lock();
+	ret = parse_path(rd, path, RD_FILE, &par_inode, &file_inode, filename);
+
+	if (ret == -1) {
+		rcu_read_unlock();
+		percpu_up_read(&rd->freeze_sem);
+		kfree(file);
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Invalid path '%s'.\n", path);
+		return -1;
+	} else if (ret == 0) {
+		rcu_read_unlock();
+		percpu_up_read(&rd->freeze_sem);
+		kfree(file);
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Path '%s' doesn't exist.\n", path);
+		return -1;
+	} else if (READ_ONCE(file_inode->file_type) != RD_FILE) {
+		rcu_read_unlock();
+		percpu_up_read(&rd->freeze_sem);
+		kfree(file);
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Path '%s' is not a regular file.\n", path);
+		return -1;
+	}
+
+	strcpy(file->path, path);
+	file->inode = file_inode;
+	file->offset = 0;
+	file->mode = mode;
+	mutex_init(&file->pos_lock);
+	/* one ref for the fd table, one held by us until the install is checked */
+	atomic_set(&file->refcount, 2);
+	file->closed = false;
+
+	/* allocate a new fd */
+	fd = allocate_fd(fdt, file);
+	if (fd == -1) {
+		rcu_read_unlock();
+		percpu_up_read(&rd->freeze_sem);
+		kfree(file);
+		sprintf(msg + strlen(msg), "Error: No free fd available.\n");
+		return -1;
+	}
+
+	/* a delete may have unlinked the file before it could see our fd */
+	if (READ_ONCE(file_inode->file_type) != RD_FILE) {
+		spin_lock(&fdt->lock);
+		if (fdt->files[fd] == file)
+			free_fd(fdt, fd);
+		spin_unlock(&fdt->lock);
+		rcu_read_unlock();
+		percpu_up_read(&rd->freeze_sem);
+		put_file(file);
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Path '%s' doesn't exist.\n", path);
+		return -1;
+	}
+	rcu_read_unlock();
+	percpu_up_read(&rd->freeze_sem);
+	put_file(file);
+
+	scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Successfully open '%s'.\n", path);
+	return fd;
+}
+
+/*
+ * Close a file according to the given fd.
+ */
+int ramfs_close(rd_fdt *fdt, int fd, char *msg) {
+	
+	if (fd < 0 || fd >= RD_MAX_FILE) {
+		sprintf(msg + strlen(msg), "Error: Invalid fd '%d'.\n", fd);
+		return -1;
+	}
+
+	spin_lock(&fdt->lock);
+	if (fdt->files[fd] == NULL) {
+		spin_unlock(&fdt->lock);
+		sprintf(msg + strlen(msg), "Error: Invalid fd '%d'.\n", fd);
+		return -1;
+	}
+	free_fd(fdt, fd);
+	spin_unlock(&fdt->lock);
+	sprintf(msg + strlen(msg), "Successfully close '%d'.\n", fd);
+	return 0;
+}
+
+/*
+ * Copy engine
+ *
+ * A read or write is split into runs of physically contiguous bytes: a run
+ * starts at the offset's position in its block and extends over the
+ * following blocks as long as they are adjacent in the data region. Each
+ * run is moved with a single memcpy. Writes of at least nt_write_threshold
+ * bytes use non-temporal stores so streaming ingest does not evict hot
+ * metadata (inodes, bitmap, dir blocks) from the cache.
+ */
+static int nt_write_threshold = 0;
+module_param(nt_write_threshold, int, 0644);
+MODULE_PARM_DESC(nt_write_threshold, "Writes of at least this many bytes bypass the cache (0 = never)");
+
+/*
+ * Length of the contiguous run starting at offset, at most limit bytes.
+ * The caller holds the inode's lock and every block of the range exists.
+ * A compressed block is a run of its own. Every block of the run counts
+ * as accessed.
+ */
+static int block_run(rd_ctx *rd, rd_inode *inode, int offset, int limit) {
+	int blknum, run;
+	char *block;
+
+	blknum = offset / RD_BLOCK_SIZE;
+	block = inode_block(rd, inode, blknum);
+	run = RD_BLOCK_SIZE - offset % RD_BLOCK_SIZE;
+	if (block_compressed(block))
+		return run < limit ? run : limit;
+	touch_block(rd, block);
+	while (run < limit && blknum + 1 < inode->block_count &&
+	       inode_map(rd, inode)[blknum + 1] == inode_map(rd, inode)[blknum] + 1) {
+		blknum++;
+		run += RD_BLOCK_SIZE;
+		touch_block(rd, inode_block(rd, inode, blknum));
+	}
+	return run < limit ? run : limit;
+}
+
+static int copy_from_blocks(rd_ctx *rd, rd_inode *inode, char *buf, int offset, int count) {
+	char bounce[RD_BLOCK_SIZE];
+	rd_centry *entry;
+	char *block;
+	int run;
+
+	while (count > 0) {
+		run = block_run(rd, inode, offset, count);
+		block = inode_block(rd, inode, offset / RD_BLOCK_SIZE);
+		if (block_compressed(block)) {
+			entry = block_centry(block);
+			if (LZ4_decompress_safe(entry->data, bounce, entry->len, RD_BLOCK_SIZE) != RD_BLOCK_SIZE)
+				return -1;
+			memcpy(buf, bounce + offset % RD_BLOCK_SIZE, run);
+			atomic_inc(&rd->compress_stats.reads);
+		} else {
+			memcpy(buf, block + offset % RD_BLOCK_SIZE, run);
+		}
+		buf += run;
+		offset += run;
+		count -= run;
+	}
+	return 0;
+}
+
+static void zero_blocks(rd_ctx *rd, rd_inode *inode, int offset, int count) {
+	int run;
+
+	while (count > 0) {
+		run = block_run(rd, inode, offset, count);
+		memset(inode_block(rd, inode, offset / RD_BLOCK_SIZE) + offset % RD_BLOCK_SIZE, 0, run);
+		mark_dirty(rd, inode_block(rd, inode, offset / RD_BLOCK_SIZE) + offset % RD_BLOCK_SIZE, run);
+		offset += run;
+		count -= run;
+	}
+}
+
+static void copy_to_blocks(rd_ctx *rd, rd_inode *inode, const char *buf, int offset, int count) {
+	int run;
+	bool stream;
+
+	stream = nt_write_threshold > 0 && count >= nt_write_threshold;
+	while (count > 0) {
+		run = block_run(rd, inode, offset, count);
+		if (stream)
+			memcpy_flushcache(inode_block(rd, inode, offset / RD_BLOCK_SIZE) + offset % RD_BLOCK_SIZE, buf, run);
+		else
+			memcpy(inode_block(rd, inode, offset / RD_BLOCK_SIZE) + offset % RD_BLOCK_SIZE, buf, run);
+		mark_dirty(rd, inode_block(rd, inode, offset / RD_BLOCK_SIZE) + offset % RD_BLOCK_SIZE, run);
+		buf += run;
+		offset += run;
+		count -= run;
+	}
+	/* order the non-temporal stores before the inode lock is released */
+	if (stream)
+		wmb();
+}
+
+/*
+ * Make sure the blocks of the inode cover [0, end), allocating the missing
+ * ones in one go. Returns how far the blocks reach, less than end if the
+ * disk is full. The caller holds the inode's write lock.
+ */
+static int reserve_blocks(rd_ctx *rd, rd_inode *inode, int end) {
+	char *blocks[RD_MAX_FILE_BLK];
+	int i, need, got;
+
+	need = (end + RD_BLOCK_SIZE - 1) / RD_BLOCK_SIZE - (int)inode->block_count;
+	if (need <= 0)
+		return end;
+	got = allocate_blocks(rd, blocks, need);
+	for (i = 0; i < got; ++i)
+		set_inode_block(rd, inode, inode->block_count + i, blocks[i]);
+	inode->block_count += got;
+	mark_dirty(rd, inode, sizeof(rd_inode));
+	if (got < need)
+		return inode->block_count * RD_BLOCK_SIZE;
+	return end;
+}
+
+/*
+ * Give the inode its own uncompressed copy of every shared or compressed
+ * block in [offset, offset + count) so the range can be written in place.
+ * Returns -1 with a message if the disk runs out or a compressed block
+ * doesn't inflate, the blocks copied so far stay with the inode. The caller
+ * holds the inode's write lock.
+ */
+static int unshare_blocks(rd_ctx *rd, rd_inode *inode, int offset, int count, char *msg) {
+	int i, last, shared;
+	rd_centry *entry;
+	char *block;
+
+	if (count <= 0)
+		return 0;
+	last = (offset + count - 1) / RD_BLOCK_SIZE;
+	for (i = offset / RD_BLOCK_SIZE; i <= last; ++i) {
+		if (block_compressed(inode_block(rd, inode, i))) {
+			block = allocate_block(rd);
+			if (block == NULL) {
+				sprintf(msg + strlen(msg), "Error: No free blocks available.\n");
+				return -1;
+			}
+			entry = block_centry(inode_block(rd, inode, i));
+			if (LZ4_decompress_safe(entry->data, block, entry->len, RD_BLOCK_SIZE) != RD_BLOCK_SIZE) {
+				free_block(rd, block);
+				sprintf(msg + strlen(msg), "Error: Corrupted compressed block %d.\n", i);
+				return -1;
+			}
+			mark_dirty(rd, block, RD_BLOCK_SIZE);
+			free_block(rd, inode_block(rd, inode, i));
+			set_inode_block(rd, inode, i, block);
+			atomic_inc(&rd->compress_stats.inflates);
+			continue;
+		}
+		spin_lock(&rd->sb_lock);
+		shared = rd->block_refs[inode_map(rd, inode)[i]] > 1;
+		spin_unlock(&rd->sb_lock);
+		if (!shared)
+			continue;
+		block = allocate_block(rd);
+		if (block == NULL) {
+			sprintf(msg + strlen(msg), "Error: No free blocks available.\n");
+			return -1;
+		}
+		memcpy(block, inode_block(rd, inode, i), RD_BLOCK_SIZE);
+		mark_dirty(rd, block, RD_BLOCK_SIZE);
+		free_block(rd, inode_block(rd, inode, i));
+		set_inode_block(rd, inode, i, block);
+	}
+	return 0;
+}
+
+/*
+ * Read a file according to the given fd.
+ * return the number of bytes that are successfully read.
+ */
+int ramfs_read(rd_fdt *fdt, int fd, char *buf, size_t count, char *msg) {
+	rd_ctx *rd = fdt->rd;
+	rd_file *file;
+	rd_inode *inode;
+	int offset, read_cnt;
+
+	if (fd < 0 || fd >= RD_MAX_FILE) {
+		sprintf(msg + strlen(msg), "Error: Invalid fd %d.\n", fd);
+		return -1;
+	}
+
+	file = get_file(fdt, fd);
+	/* check if the fd is valid */
+	if (file == NULL) {
+		sprintf(msg + strlen(msg), "Error: Invalid fd '%d'.\n", fd);
+		return -1;
+	}
+	/* check if the file is write-only */
+	if ((file->mode & RD_ACCMODE) == RD_WRONLY) {
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Write only file '%s'.\n", file->path);
+		put_file(file);
+		return -1;
+	}
+	inode = file->inode;
+	percpu_down_read(&rd->freeze_sem);
+	mutex_lock(&file->pos_lock);
+	down_read(inode_sem(rd, inode));
+	if (file->closed) {
+		sprintf(msg + strlen(msg), "Error: Invalid fd '%d'.\n", fd);
+		read_cnt = -1;
+		goto out;
+	}
+	offset = file->offset;
+	read_cnt = 0;
+	/* check if the offset reaches the end of file */
+	if (offset >= inode->file_size) {
+		goto out;
+	}
+
+	read_cnt = inode->file_size - offset;
+	if (count < (size_t)read_cnt)
+		read_cnt = count;
+	if (copy_from_blocks(rd, inode, buf, offset, read_cnt) == -1) {
+		sprintf(msg + strlen(msg), "Error: Corrupted compressed block in fd '%d'.\n", fd);
+		read_cnt = -1;
+		goto out;
+	}
+	offset += read_cnt;
+	file->offset = offset;
+	sprintf(msg + strlen(msg), "Successfully read '%d' bytes from fd '%d'.\n", read_cnt, fd);
+out:
+	up_read(inode_sem(rd, inode));
+	mutex_unlock(&file->pos_lock);
+	percpu_up_read(&rd->freeze_sem);
+	put_file(file);
+	return read_cnt;
+}
+
+/*
+ * Write a file according to the given fd.
+ * return the number of bytes that are successfully written.
+ */
+int ramfs_write(rd_fdt *fdt, int fd, char *buf, size_t count, char *msg) {
+	rd_ctx *rd = fdt->rd;
+
+	rd_file *file;
+	rd_inode *inode;
+	int offset, start, end, block_end, write_cnt;
+	if (fd < 0 || fd >= RD_MAX_FILE) {
+		sprintf(msg + strlen(msg), "Error: Invalid fd %d.\n", fd);
+		return -1;
+	}
+	file = get_file(fdt, fd);
+	/* check if the fd is valid */
+	if (file == NULL) {
+		sprintf(msg + strlen(msg), "Error: Invalid fd '%d'.\n", fd);
+		return -1;
+	}
+	/* check if the file is read-only */
+	if ((file->mode & RD_ACCMODE) == RD_RDONLY) {
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Read only file '%s'.\n", file->path);
+		put_file(file);
+		return -1;
+	}
+	
+	inode = file->inode;
+	percpu_down_read(&rd->freeze_sem);
+	mutex_lock(&file->pos_lock);
+	down_write(inode_sem(rd, inode));
+	if (file->closed) {
+		sprintf(msg + strlen(msg), "Error: Invalid fd '%d'.\n", fd);
+		write_cnt = -1;
+		goto out;
+	}
+	/* in append mode every write lands at EOF, atomically under the inode lock */
+	if (file->mode & RD_APPEND)
+		file->offset = inode->file_size;
+	offset = file->offset;
+	write_cnt = 0;
+	/* check if the file reaches the max-file-size */
+	if (offset >= RD_MAX_FILE_SIZE) {
+		sprintf(msg + strlen(msg), "Warning: Max file size reached.\n");
+		goto out;
+	}
+	/* allocate every block the write reaches up front (none if preallocated), then copy run by run */
+	if (count > RD_MAX_FILE_SIZE - offset)
+		count = RD_MAX_FILE_SIZE - offset;
+	end = offset + count;
+	block_end = reserve_blocks(rd, inode, end);
+	if (block_end < end) {
+		sprintf(msg + strlen(msg), "Error: No free blocks available.\n");
+		end = block_end < offset ? offset : block_end;
+	}
+	write_cnt = end - offset;
+	/* blocks shared with a snapshot or reflink are copied on first write */
+	start = offset > inode->file_size ? inode->file_size : offset;
+	if (write_cnt > 0 && unshare_blocks(rd, inode, start, end - start, msg) == -1) {
+		write_cnt = 0;
+		goto out;
+	}
+	/* writing past EOF (after a truncate) leaves a hole that reads as zeros */
+	if (write_cnt > 0 && offset > inode->file_size)
+		zero_blocks(rd, inode, inode->file_size, offset - inode->file_size);
+	copy_to_blocks(rd, inode, buf, offset, write_cnt);
+	offset = end;
+
+	/* overwriting existing bytes does not grow the file */
+	if (end > inode->file_size) {
+		inode->file_size = end;
+		mark_dirty(rd, inode, sizeof(rd_inode));
+	}
+	file->offset = offset;
+	sprintf(msg + strlen(msg), "Successfully write '%d' bytes to fd '%d'.\n", write_cnt, fd);
+out:
+	up_write(inode_sem(rd, inode));
+	mutex_unlock(&file->pos_lock);
+	percpu_up_read(&rd->freeze_sem);
+	put_file(file);
+	return write_cnt;
+}
+
+/*
+ * lseek (change the offset in fd) a file according to the given fd.
+ */
+int ramfs_lseek(rd_fdt *fdt, int fd, int offset, char *msg) {
+	rd_ctx *rd = fdt->rd;
+	rd_file *file;
+	rd_inode *inode;
+	int ret;
+	if (fd < 0 || fd >= RD_MAX_FILE) {
+		sprintf(msg + strlen(msg), "Error: Invalid fd '%d'.\n", fd);
+		return -1;
+	}
+	file = get_file(fdt, fd);
+	/* check if the fd is valid */
+	if (file == NULL) {
+		sprintf(msg + strlen(msg), "Error: Invalid fd '%d'.\n", fd);
+		return -1;
+	}
+
+	inode = file->inode;
+	ret = 0;
+	percpu_down_read(&rd->freeze_sem);
+	mutex_lock(&file->pos_lock);
+	down_read(inode_sem(rd, inode));
+	if (file->closed) {
+		sprintf(msg + strlen(msg), "Error: Invalid fd '%d'.\n", fd);
+		ret = -1;
+	} else if (offset < 0) {
+		sprintf(msg + strlen(msg), "Error: Invalid offset '%d'.\n", offset);
+		ret = -1;
+	} else if (offset > inode->file_size) {
+		sprintf(msg + strlen(msg), "Error: Offset '%d' is larger than file size '%d'.\n", offset, inode->file_size);
+		ret = -1;
+	} else {
+		file->offset = offset;
+		sprintf(msg + strlen(msg), "Successfully lseek, current offset of fd '%d' is '%d'.\n", fd, offset);
+	}
+	up_read(inode_sem(rd, inode));
+	mutex_unlock(&file->pos_lock);
+	percpu_up_read(&rd->freeze_sem);
+	put_file(file);
+	return ret;
+}
+
+/*
+ * Preallocate blocks so that the first len bytes of a file can be written
+ * without calling the allocator. The file size does not change.
+ */
+int ramfs_fallocate(rd_fdt *fdt, int fd, int len, char *msg) {
+	rd_ctx *rd = fdt->rd;
+	rd_file *file;
+	rd_inode *inode;
+	int ret;
+
+	file = get_file(fdt, fd);
+	/* check if the fd is valid */
+	if (file == NULL) {
+		sprintf(msg + strlen(msg), "Error: Invalid fd '%d'.\n", fd);
+		return -1;
+	}
+	if ((file->mode & RD_ACCMODE) == RD_RDONLY) {
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Read only file '%s'.\n", file->path);
+		put_file(file);
+		return -1;
+	}
+	if (len < 0 || len > RD_MAX_FILE_SIZE) {
+		sprintf(msg + strlen(msg), "Error: Length '%d' is larger than max file size '%d'.\n", len, RD_MAX_FILE_SIZE);
+		put_file(file);
+		return -1;
+	}
+
+	inode = file->inode;
+	ret = 0;
+	percpu_down_read(&rd->freeze_sem);
+	down_write(inode_sem(rd, inode));
+	if (file->closed) {
+		sprintf(msg + strlen(msg), "Error: Invalid fd '%d'.\n", fd);
+		ret = -1;
+	} else if (reserve_blocks(rd, inode, len) < len) {
+		sprintf(msg + strlen(msg), "Error: No free blocks available.\n");
+		ret = -1;
+	} else {
+		sprintf(msg + strlen(msg), "Successfully fallocate '%d' bytes for fd '%d'.\n", len, fd);
+	}
+	up_write(inode_sem(rd, inode));
+	percpu_up_read(&rd->freeze_sem);
+	put_file(file);
+	return ret;
+}
+
+/*
+ * Truncate a file to the given size. Shrinking frees the blocks past the
+ * new end (a file always keeps its first block), growing zero-fills.
+ */
+int ramfs_truncate(rd_fdt *fdt, int fd, int size, char *msg) {
+	rd_ctx *rd = fdt->rd;
+	rd_file *file;
+	rd_inode *inode;
+	int i, keep, ret;
+
+	file = get_file(fdt, fd);
+	/* check if the fd is valid */
+	if (file == NULL) {
+		sprintf(msg + strlen(msg), "Error: Invalid fd '%d'.\n", fd);
+		return -1;
+	}
+	if ((file->mode & RD_ACCMODE) == RD_RDONLY) {
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Read only file '%s'.\n", file->path);
+		put_file(file);
+		return -1;
+	}
+	if (size < 0 || size > RD_MAX_FILE_SIZE) {
+		sprintf(msg + strlen(msg), "Error: Size '%d' is larger than max file size '%d'.\n", size, RD_MAX_FILE_SIZE);
+		put_file(file);
+		return -1;
+	}
+
+	inode = file->inode;
+	ret = 0;
+	percpu_down_read(&rd->freeze_sem);
+	down_write(inode_sem(rd, inode));
+	if (file->closed) {
+		sprintf(msg + strlen(msg), "Error: Invalid fd '%d'.\n", fd);
+		ret = -1;
+		goto out;
+	}
+	if (size > inode->file_size) {
+		if (reserve_blocks(rd, inode, size) < size) {
+			sprintf(msg + strlen(msg), "Error: No free blocks available.\n");
+			ret = -1;
+			goto out;
+		}
+		if (unshare_blocks(rd, inode, inode->file_size, size - inode->file_size, msg) == -1) {
+			ret = -1;
+			goto out;
+		}
+		zero_blocks(rd, inode, inode->file_size, size - inode->file_size);
+	} else {
+		keep = (size + RD_BLOCK_SIZE - 1) / RD_BLOCK_SIZE;
+		if (keep == 0)
+			keep = 1;
+		for (i = keep; i < inode->block_count; ++i) {
+			free_block(rd, inode_block(rd, inode, i));
+			inode_map(rd, inode)[i] = RD_NO_BLOCK;
+		}
+		mark_dirty(rd, inode_map(rd, inode), sizeof(rd_block_map));
+		if (inode->block_count > keep)
+			inode->block_count = keep;
+	}
+	inode->file_size = size;
+	mark_dirty(rd, inode, sizeof(rd_inode));
+	sprintf(msg + strlen(msg), "Successfully truncate fd '%d' to '%d' bytes.\n", fd, size);
+out:
+	up_write(inode_sem(rd, inode));
+	percpu_up_read(&rd->freeze_sem);
+	put_file(file);
+	return ret;
+}
+
+/*
+ * Compress the blocks of the given file not accessed for age jiffies. Blocks
+ * shared with a snapshot or reflink are left alone. The caller holds the
+ * inode's write lock and compress_mutex. Returns the number of blocks compressed.
+ */
+static int compress_inode(rd_ctx *rd, rd_inode *inode, unsigned long age, char *cbuf) {
+	int i, n, len, block_num, shared;
+	rd_centry *entry;
+	char *block;
+
+	n = 0;
+	for (i = 0; i < inode->block_count; ++i) {
+		block = inode_block(rd, inode, i);
+		if (block_compressed(block))
+			continue;
+		block_num = (block - rd->first_data_block) / RD_BLOCK_SIZE;
+		if (time_before(jiffies, READ_ONCE(rd->block_atime[block_num]) + age))
+			continue;
+		spin_lock(&rd->sb_lock);
+		shared = rd->block_refs[block_num] > 1;
+		spin_unlock(&rd->sb_lock);
+		if (shared)
+			continue;
+		len = LZ4_compress_default(block, cbuf, RD_BLOCK_SIZE, RD_CENTRY_MAX, rd->compress_wrkmem);
+		if (len <= 0)
+			continue;	/* does not save a slot */
+		entry = pool_alloc(rd, centry_slots(len));
+		if (entry == NULL)
+			break;
+		entry->len = len;
+		entry->refs = 1;
+		memcpy(entry->data, cbuf, len);
+		mark_dirty(rd, entry, sizeof(rd_centry) + len);
+		spin_lock(&rd->sb_lock);
+		rd->compress_stats.entries++;
+		rd->compress_stats.bytes += len;
+		spin_unlock(&rd->sb_lock);
+		set_inode_block(rd, inode, i, (char*)entry + RD_COMPRESSED);
+		free_block(rd, block);
+		n++;
+	}
+	return n;
+}
+
+/*
+ * One compression pass over every file. Busy files are skipped rather than
+ * waited for, the next pass gets them.
+ */
+static int compress_cold_blocks(rd_ctx *rd, unsigned long age) {
+	char cbuf[RD_BLOCK_SIZE];
+	rd_inode *inode;
+	int i, n;
+
+	n = 0;
+	mutex_lock(&rd->compress_mutex);
+	if (rd->compress_wrkmem == NULL)
+		rd->compress_wrkmem = vmalloc(LZ4_MEM_COMPRESS);
+	if (rd->compress_wrkmem == NULL) {
+		mutex_unlock(&rd->compress_mutex);
+		return -1;
+	}
+	percpu_down_read(&rd->freeze_sem);
+	for (i = 0; i < smp_load_acquire(&rd->superblock->inode_hwm); ++i) {
+		inode = rd->inode_list + i;
+		if (READ_ONCE(inode->file_type) != RD_FILE)
+			continue;
+		if (!down_write_trylock(inode_sem(rd, inode)))
+			continue;
+		if (inode->file_type == RD_FILE)
+			n += compress_inode(rd, inode, age, cbuf);
+		up_write(inode_sem(rd, inode));
+	}
+	percpu_up_read(&rd->freeze_sem);
+	mutex_unlock(&rd->compress_mutex);
+	return n;
+}
+
+static void compress_work_fn(struct work_struct *work) {
+	rd_ctx *rd = container_of(to_delayed_work(work), rd_ctx, compress_work);
+
+	compress_cold_blocks(rd, compress_interval * HZ);
+	schedule_delayed_work(&rd->compress_work, compress_interval * HZ);
+}
+
+/*
+ * Compress every unshared file block now, regardless of when it was last accessed
+ */
+int ramfs_compress(rd_ctx *rd, char *msg) {
+	int n;
+
+	n = compress_cold_blocks(rd, 0);
+	if (n == -1) {
+		sprintf(msg + strlen(msg), "Error: Cannot allocate compression state.\n");
+		return -1;
+	}
+	sprintf(msg + strlen(msg), "Successfully compress '%d' blocks.\n", n);
+	return n;
+}
+
+/*
+ * Deduplication
+ *
+ * A dedup pass hashes every full, uncompressed block of every file and
+ * makes block maps that point at identical blocks point at the same one,
+ * sharing it through its refcount exactly like a reflink does; the first
+ * write to it copies it again (see unshare_blocks). Equal hashes are
+ * confirmed with memcmp. The hash table only lives for the pass, which
+ * holds freeze_sem for write so no block changes under it.
+ */
+#define RD_DEDUP_BUCKETS	1024
+
+static int dedup_blocks(rd_ctx *rd) {
+	u64 *hashes;
+	int *buckets;
+	int *next;
+	rd_inode *inode;
+	char *block;
+	u64 hash;
+	int i, j, k, n, block_num, bucket;
+
+	hashes = (u64*)vmalloc(sizeof(u64) * RD_BLOCK_NUM);
+	next = (int*)vmalloc(sizeof(int) * RD_BLOCK_NUM);
+	buckets = (int*)vmalloc(sizeof(int) * RD_DEDUP_BUCKETS);
+	if (!hashes || !next || !buckets) {
+		if (hashes)
+			vfree(hashes);
+		if (next)
+			vfree(next);
+		if (buckets)
+			vfree(buckets);
+		return -1;
+	}
+	for (i = 0; i < RD_DEDUP_BUCKETS; ++i)
+		buckets[i] = -1;
+
+	n = 0;
+	percpu_down_write(&rd->freeze_sem);
+	for (i = 0; i < rd->superblock->inode_hwm; ++i) {
+		inode = rd->inode_list + i;
+		if (inode->file_type != RD_FILE)
+			continue;
+		for (j = 0; (j + 1) * RD_BLOCK_SIZE <= inode->file_size; ++j) {
+			block = inode_block(rd, inode, j);
+			if (block_compressed(block))
+				continue;
+			block_num = (block - rd->first_data_block) / RD_BLOCK_SIZE;
+			hash = xxh64(block, RD_BLOCK_SIZE, 0);
+			bucket = hash % RD_DEDUP_BUCKETS;
+			rd->dedup_stats.scanned++;
+			for (k = buckets[bucket]; k != -1; k = next[k]) {
+				if (k == block_num)
+					break;	/* already seen through another file sharing it */
+				if (hashes[k] == hash &&
+				    memcmp(rd->first_data_block + k * RD_BLOCK_SIZE, block, RD_BLOCK_SIZE) == 0)
+					break;
+			}
+			if (k == -1) {
+				hashes[block_num] = hash;
+				next[block_num] = buckets[bucket];
+				buckets[bucket] = block_num;
+			} else if (k != block_num) {
+				inode_map(rd, inode)[j] = k;
+				mark_dirty(rd, &inode_map(rd, inode)[j], sizeof(unsigned int));
+				get_block(rd, inode_block(rd, inode, j));
+				free_block(rd, block);
+				rd->dedup_stats.hits++;
+				n++;
+			}
+		}
+	}
+	percpu_up_write(&rd->freeze_sem);
+	vfree(hashes);
+	vfree(next);
+	vfree(buckets);
+	return n;
+}
+
+static void dedup_work_fn(struct work_struct *work) {
+	rd_ctx *rd = container_of(to_delayed_work(work), rd_ctx, dedup_work);
+
+	dedup_blocks(rd);
+	schedule_delayed_work(&rd->dedup_work, dedup_interval * HZ);
+}
+
+/*
+ * Run a dedup pass now
+ */
+int ramfs_dedup(rd_ctx *rd, char *msg) {
+	int n;
+
+	n = dedup_blocks(rd);
+	if (n == -1) {
+		sprintf(msg + strlen(msg), "Error: Cannot allocate dedup table.\n");
+		return -1;
+	}
+	sprintf(msg + strlen(msg), "Successfully merge '%d' duplicate blocks.\n", n);
+	return n;
+}
+
+/*
+ * Images
+ *
+ * An image is an rd_image_header, the metadata regions as they are in
+ * memory and then the allocated data blocks in block number order, each
+ * run of adjacent blocks moved with one read or write. Free blocks are
+ * neither saved nor restored. The regions hold no pointers, so they are
+ * loaded as they are wherever the ramdisk memory now lives. Both directions
+ * hold freeze_sem for write, after flushing pending RCU reclaims so no
+ * inode or dentry is caught half freed.
+ */
+static int image_write(struct file *filp, const void *buf, size_t len, loff_t *pos) {
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = kernel_write(filp, buf, len, pos);
+		if (ret <= 0)
+			return -1;
+		buf = (const char*)buf + ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int image_read(struct file *filp, void *buf, size_t len, loff_t *pos) {
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = kernel_read(filp, buf, len, pos);
+		if (ret <= 0)
+			return -1;
+		buf = (char*)buf + ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* Bit i of a bitmap laid out like ours, e.g. in a buffer holding an image */
+static inline bool disk_bit(const char *bitmap, int i) {
+	return (bitmap[i / 8] >> (i % 8)) & 1;
+}
+
+/*
+ * Move every run of allocated blocks below block_hwm in one go, to the
+ * image or from it. disk is laid out like the ramdisk: the ramdisk itself
+ * when saving, the buffer the image is staged in when loading.
+ */
+static int image_blocks(rd_ctx *rd, char *disk, struct file *filp, loff_t *pos, bool save) {
+	char *bitmap = disk + (rd->first_bitmap_block - rd->first_block);
+	char *data = disk + (rd->first_data_block - rd->first_block);
+	int hwm = ((rd_superblock*)disk)->block_hwm;
+	int i, start, ret;
+
+	for (i = 0; i < hwm; ) {
+		if (!disk_bit(bitmap, i)) {
+			++i;
+			continue;
+		}
+		for (start = i; i < hwm && disk_bit(bitmap, i); ++i)
+			;
+		if (save)
+			ret = image_write(filp, data + start * RD_BLOCK_SIZE, (i - start) * RD_BLOCK_SIZE, pos);
+		else
+			ret = image_read(filp, data + start * RD_BLOCK_SIZE, (i - start) * RD_BLOCK_SIZE, pos);
+		if (ret == -1)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Check a whole ramdisk read into a buffer (an image or the backing file)
+ * before it replaces the contents. The fs trusts its own metadata, so every
+ * inode, block map entry, refcount, compressed entry and dentry is checked
+ * here: a block map must point below block_hwm at allocated blocks, a
+ * dentry at an inode in use, and the counts must add up. Returns 0 if the
+ * buffer is consistent, -1 otherwise.
+ */
+static int image_check(rd_ctx *rd, char *disk) {
+	rd_superblock *sb = (rd_superblock*)disk;
+	rd_inode *inodes = (rd_inode*)(disk + ((char*)rd->inode_list - rd->first_block));
+	rd_block_map *maps = (rd_block_map*)(disk + ((char*)rd->block_maps - rd->first_block));
+	char *bitmap = disk + (rd->first_bitmap_block - rd->first_block);
+	unsigned short *refs = (unsigned short*)(disk + ((char*)rd->block_refs - rd->first_block));
+	char *data = disk + (rd->first_data_block - rd->first_block);
+	unsigned short *block_maps;	/* block maps pointing at each block */
+	unsigned short *slot_maps;	/* block maps pointing at each pool slot */
+	unsigned char *slot_used;	/* slots of each pool block taken by an entry */
+	unsigned short *parents;	/* the dir linking each inode */
+	unsigned short *queue;		/* dirs of the tree walk */
+	unsigned char *seen;		/* inodes the tree walk reached */
+	rd_inode *inode;
+	rd_dentry *dentry;
+	rd_centry *entry;
+	unsigned int n;
+	int i, j, k, ret, used, nfree, live, head, tail, dots, dotdots, slots, mask, dir_num, remain;
+
+	if (!backing_matches(rd, sb) || sb->inode_hwm == 0 || inodes[0].file_type != RD_DIRECTORY)
+		return -1;
+	block_maps = (unsigned short*)vzalloc((RD_BLOCK_NUM * (RD_POOL_SLOTS + 1) + 2 * RD_INODE_NUM) * sizeof(unsigned short) +
+					     RD_BLOCK_NUM + RD_INODE_NUM);
+	if (block_maps == NULL)
+		return -1;
+	slot_maps = block_maps + RD_BLOCK_NUM;
+	parents = slot_maps + RD_BLOCK_NUM * RD_POOL_SLOTS;
+	queue = parents + RD_INODE_NUM;
+	slot_used = (unsigned char*)(queue + RD_INODE_NUM);
+	seen = slot_used + RD_BLOCK_NUM;
+	ret = -1;
+
+	/* inodes and their block maps */
+	nfree = RD_INODE_NUM - sb->inode_hwm;
+	live = 0;
+	for (i = 0; i < sb->inode_hwm; ++i) {
+		inode = inodes + i;
+		if (inode->inode_num != i)
+			goto out;
+		if (inode->file_type == RD_AVAILABLE)
+			nfree++;
+		if (inode->file_type == RD_AVAILABLE || inode->file_type == RD_RECLAIMING)
+			continue;
+		if ((inode->file_type != RD_FILE && inode->file_type != RD_DIRECTORY) ||
+		    inode->block_count > RD_MAX_FILE_BLK || inode->file_size > inode->block_count * RD_BLOCK_SIZE)
+			goto out;
+		live++;
+		for (j = 0; j < inode->block_count; ++j) {
+			n = maps[i].blocks[j];
+			if (n & RD_COMPRESSED_BLOCK) {
+				n &= ~RD_COMPRESSED_BLOCK;
+				/* dirs are never compressed */
+				if (inode->file_type == RD_DIRECTORY || n >= sb->block_hwm * RD_POOL_SLOTS ||
+				    !disk_bit(bitmap, n / RD_POOL_SLOTS))
+					goto out;
+				slot_maps[n]++;
+			} else {
+				if (n >= sb->block_hwm || !disk_bit(bitmap, n))
+					goto out;
+				block_maps[n]++;
+			}
+		}
+	}
+	if (nfree != sb->freeinode_count)
+		goto out;
+
+	/* compressed entries fit in their pool block without overlapping */
+	for (n = 0; n < sb->block_hwm * RD_POOL_SLOTS; ++n) {
+		if (slot_maps[n] == 0)
+			continue;
+		entry = (rd_centry*)(data + n * RD_POOL_SLOT_SIZE);
+		if (entry->len == 0 || entry->len > RD_CENTRY_MAX || entry->refs != slot_maps[n])
+			goto out;
+		slots = centry_slots(entry->len);
+		if (n % RD_POOL_SLOTS + slots > RD_POOL_SLOTS)
+			goto out;
+		mask = ((1 << slots) - 1) << (n % RD_POOL_SLOTS);
+		if ((slot_used[n / RD_POOL_SLOTS] & mask) || block_maps[n / RD_POOL_SLOTS] > 0)
+			goto out;
+		slot_used[n / RD_POOL_SLOTS] |= mask;
+	}
+
+	/* a block is allocated iff it has references, one per block map pointing at it */
+	for (i = 0, used = 0; i < sb->block_hwm; ++i) {
+		used += disk_bit(bitmap, i);
+		if (disk_bit(bitmap, i) != (refs[i] > 0) || (block_maps[i] > 0 && block_maps[i] != refs[i]))
+			goto out;
+	}
+	if (sb->freeblock_count != RD_BLOCK_NUM - used)
+		goto out;
+
+	/*
+	 * The dentries form a tree: walking it from the root reaches every inode
+	 * in use exactly once, and every dir has a "." to itself and a ".." to
+	 * the dir linking it. The code removing and cloning trees relies on it.
+	 */
+	dir_num = RD_BLOCK_SIZE / sizeof(rd_dentry);
+	queue[0] = 0;
+	seen[0] = 1;
+	for (head = 0, tail = 1; head < tail; ++head) {
+		i = queue[head];
+		inode = inodes + i;
+		dots = 0;
+		dotdots = 0;
+		for (j = 0; j * RD_BLOCK_SIZE < inode->file_size; ++j) {
+			remain = inode->file_size - j * RD_BLOCK_SIZE;
+			dentry = (rd_dentry*)(data + maps[i].blocks[j] * RD_BLOCK_SIZE);
+			for (k = 0; k < dir_num && (int)((k + 1) * sizeof(rd_dentry)) <= remain; ++k, ++dentry) {
+				if (dentry->inode_num == RD_DENTRY_FREE || dentry->inode_num == RD_DENTRY_DEAD)
+					continue;
+				if (dentry->inode_num < 0 || dentry->inode_num >= sb->inode_hwm ||
+				    (inodes[dentry->inode_num].file_type != RD_FILE &&
+				     inodes[dentry->inode_num].file_type != RD_DIRECTORY) ||
+				    memchr(dentry->filename, 0, RD_MAX_FILENAME) == NULL)
+					goto out;
+				if (strcmp(dentry->filename, ".") == 0) {
+					if (dentry->inode_num != i)
+						goto out;
+					dots++;
+				} else if (strcmp(dentry->filename, "..") == 0) {
+					if (dentry->inode_num != (i == 0 ? 0 : parents[i]))
+						goto out;
+					dotdots++;
+				} else {
+					/* a second link or a cycle */
+					if (seen[dentry->inode_num])
+						goto out;
+					seen[dentry->inode_num] = 1;
+					parents[dentry->inode_num] = i;
+					if (inodes[dentry->inode_num].file_type == RD_DIRECTORY)
+						queue[tail++] = dentry->inode_num;
+					live--;
+				}
+			}
+		}
+		if (dots != 1 || dotdots != 1)
+			goto out;
+	}
+	/* the root is not linked by any dentry */
+	if (live != 1)
+		goto out;
+	ret = 0;
+out:
+	vfree(block_maps);
+	return ret;
+}
+
+/*
+ * Make a freshly loaded image usable: finish the reclaims that were pending
+ * when it was saved and rebuild the in-memory state (compression pool map,
+ * access times) that is not part of it.
+ */
+static void image_fixup(rd_ctx *rd) {
+	rd_inode *inode;
+	rd_dentry *dentry;
+	rd_centry *entry;
+	int i, j, k, off, mask, dir_num, remain;
+
+	memset(rd->pool_map, 0, RD_BLOCK_NUM);
+	rd->compress_stats.entries = 0;
+	rd->compress_stats.bytes = 0;
+	rd->compress_stats.pool_blocks = 0;
+
+	dir_num = RD_BLOCK_SIZE / sizeof(rd_dentry);
+	for (i = 0; i < rd->superblock->inode_hwm; ++i) {
+		inode = rd->inode_list + i;
+		init_rwsem(&rd->inode_infos[i].rwsem);
+		INIT_RCU_WORK(&rd->inode_infos[i].reclaim_work, inode_reclaim_fn);
+		if (inode->file_type == RD_RECLAIMING) {
+			inode->file_type = RD_AVAILABLE;
+			rd->superblock->freeinode_count++;
+		}
+		if (inode->file_type == RD_AVAILABLE)
+			continue;
+		for (j = 0; j < inode->block_count; ++j) {
+			if (!(inode_map(rd, inode)[j] & RD_COMPRESSED_BLOCK))
+				continue;
+			/* the first block map pointing at an entry claims its slots */
+			entry = block_centry(inode_block(rd, inode, j));
+			off = (char*)entry - rd->first_data_block;
+			mask = ((1 << centry_slots(entry->len)) - 1) << (off % RD_BLOCK_SIZE / RD_POOL_SLOT_SIZE);
+			if (rd->pool_map[off / RD_BLOCK_SIZE] & mask)
+				continue;
+			if (rd->pool_map[off / RD_BLOCK_SIZE] == 0)
+				rd->compress_stats.pool_blocks++;
+			rd->pool_map[off / RD_BLOCK_SIZE] |= mask;
+			rd->compress_stats.entries++;
+			rd->compress_stats.bytes += entry->len;
+		}
+		if (inode->file_type != RD_DIRECTORY)
+			continue;
+		for (j = 0; j * RD_BLOCK_SIZE < inode->file_size; ++j) {
+			remain = inode->file_size - j * RD_BLOCK_SIZE;
+			dentry = (rd_dentry*)inode_block(rd, inode, j);
+			for (k = 0; k < dir_num && (int)((k + 1) * sizeof(rd_dentry)) <= remain; ++k, ++dentry) {
+				if (dentry->inode_num == RD_DENTRY_DEAD)
+					dentry_reclaim(rd, dentry);
+			}
+		}
+	}
+	for (i = 0; i < rd->superblock->block_hwm; ++i)
+		rd->block_atime[i] = jiffies;
+	/* everything changed as far as the backing file is concerned */
+	mark_dirty(rd, rd->first_block, rd->first_data_block - rd->first_block + rd->superblock->block_hwm * RD_BLOCK_SIZE);
+}
+
+/*
+ * Load an image over the current contents. The caller holds freeze_sem for
+ * write and no file is open. The image is read into a buffer and checked
+ * first, so a broken one leaves the ramdisk as it was. Returns the number
+ * of data blocks loaded.
+ */
+static int image_load(rd_ctx *rd, struct file *filp, loff_t *pos, char *msg) {
+	rd_image_header header;
+	rd_superblock *sb;
+	char *disk;
+	char *bitmap;
+	int i, used, meta_size;
+
+	meta_size = rd->first_data_block - rd->first_block;
+	if (image_read(filp, &header, sizeof(header), pos) == -1 ||
+	    memcmp(header.magic, RD_IMAGE_MAGIC, sizeof(RD_IMAGE_MAGIC)) != 0 ||
+	    header.version != RD_IMAGE_VERSION || header.disk_size != RD_DISK_SIZE ||
+	    header.meta_size != meta_size) {
+		sprintf(msg + strlen(msg), "Error: Not an image of this ramdisk layout.\n");
+		return -1;
+	}
+	disk = (char*)vzalloc(RD_DISK_SIZE);
+	if (disk == NULL) {
+		sprintf(msg + strlen(msg), "Error: Cannot allocate image buffer.\n");
+		return -1;
+	}
+	if (image_read(filp, disk, meta_size, pos) == -1) {
+		vfree(disk);
+		sprintf(msg + strlen(msg), "Error: Image is truncated.\n");
+		return -1;
+	}
+	/* only the bitmap bits below the image's block_hwm mean anything */
+	sb = (rd_superblock*)disk;
+	bitmap = disk + (rd->first_bitmap_block - rd->first_block);
+	used = 0;
+	if (backing_matches(rd, sb)) {
+		for (i = 0; i < sb->block_hwm; ++i)
+			used += disk_bit(bitmap, i);
+	}
+	if (!backing_matches(rd, sb) || used != header.used_blocks) {
+		vfree(disk);
+		sprintf(msg + strlen(msg), "Error: Image is corrupted.\n");
+		return -1;
+	}
+	if (image_blocks(rd, disk, filp, pos, false) == -1) {
+		vfree(disk);
+		sprintf(msg + strlen(msg), "Error: Image is truncated.\n");
+		return -1;
+	}
+	if (image_check(rd, disk) == -1) {
+		vfree(disk);
+		sprintf(msg + strlen(msg), "Error: Image is corrupted.\n");
+		return -1;
+	}
+
+	/* from here on the old contents are gone */
+	memcpy(rd->first_block, disk, meta_size + sb->block_hwm * RD_BLOCK_SIZE);
+	vfree(disk);
+	image_fixup(rd);
+	return used;
+}
+
+static int image_load_path(rd_ctx *rd, const char *path) {
+	struct file *filp;
+	loff_t pos;
+	char msg[256];
+	int ret;
+
+	filp = filp_open(path, O_RDONLY, 0);
+	if (IS_ERR(filp))
+		return -1;
+	msg[0] = 0;
+	pos = 0;
+	percpu_down_write(&rd->freeze_sem);
+	ret = image_load(rd, filp, &pos, msg);
+	percpu_up_write(&rd->freeze_sem);
+	filp_close(filp, NULL);
+	if (ret == -1)
+		printk("%s", msg);
+	else
+		printk("Ramdisk restored from '%s', %d used blocks.\n", path, ret);
+	return ret;
+}
+
+/*
+ * Save the whole ramdisk to the given file descriptor of the calling process
+ */
+int ramfs_save(rd_ctx *rd, int fd, char *msg) {
+	rd_image_header header;
+	struct file *filp;
+	loff_t pos;
+	int ret;
+
+	filp = fget(fd);
+	if (filp == NULL) {
+		sprintf(msg + strlen(msg), "Error: Invalid image fd '%d'.\n", fd);
+		return -1;
+	}
+	percpu_down_write(&rd->freeze_sem);
+	rcu_barrier();
+	flush_workqueue(rd->reclaim_wq);
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RD_IMAGE_MAGIC, sizeof(RD_IMAGE_MAGIC));
+	header.version = RD_IMAGE_VERSION;
+	header.disk_size = RD_DISK_SIZE;
+	header.meta_size = rd->first_data_block - rd->first_block;
+	header.used_blocks = rd->superblock->block_count - rd->superblock->freeblock_count;
+	pos = filp->f_pos;
+	ret = header.used_blocks;
+	if (image_write(filp, &header, sizeof(header), &pos) == -1 ||
+	    image_write(filp, rd->first_block, header.meta_size, &pos) == -1 ||
+	    image_blocks(rd, rd->first_block, filp, &pos, true) == -1) {
+		sprintf(msg + strlen(msg), "Error: Cannot write image.\n");
+		ret = -1;
+	}
+	filp->f_pos = pos;
+	percpu_up_write(&rd->freeze_sem);
+	fput(filp);
+	if (ret != -1)
+		sprintf(msg + strlen(msg), "Successfully save '%d' used blocks.\n", ret);
+	return ret;
+}
+
+static bool files_open(rd_ctx *rd) {
+	rd_fdt *fdt;
+	bool open;
+	int i;
+
+	open = false;
+	spin_lock(&rd->fdt_tables_lock);
+	list_for_each_entry(fdt, &rd->fdt_tables, list) {
+		spin_lock(&fdt->lock);
+		for (i = 0; i < RD_MAX_FILE && !open; ++i)
+			open = fdt->files[i] != NULL;
+		spin_unlock(&fdt->lock);
+	}
+	spin_unlock(&rd->fdt_tables_lock);
+	return open;
+}
+
+/*
+ * Replace the whole ramdisk with the image read from the given file
+ * descriptor of the calling process. Every file must be closed.
+ */
+int ramfs_restore(rd_ctx *rd, int fd, char *msg) {
+	struct file *filp;
+	loff_t pos;
+	int ret;
+
+	filp = fget(fd);
+	if (filp == NULL) {
+		sprintf(msg + strlen(msg), "Error: Invalid image fd '%d'.\n", fd);
+		return -1;
+	}
+	percpu_down_write(&rd->freeze_sem);
+	if (files_open(rd)) {
+		percpu_up_write(&rd->freeze_sem);
+		fput(filp);
+		sprintf(msg + strlen(msg), "Error: Close all files before restoring an image.\n");
+		return -1;
+	}
+	rcu_barrier();
+	flush_workqueue(rd->reclaim_wq);
+	pos = filp->f_pos;
+	ret = image_load(rd, filp, &pos, msg);
+	filp->f_pos = pos;
+	percpu_up_write(&rd->freeze_sem);
+	fput(filp);
+	if (ret != -1)
+		sprintf(msg + strlen(msg), "Successfully restore '%d' used blocks.\n", ret);
+	return ret;
+}
+
+/*
+ * Write-back
+ *
+ * With backing=<FILE> the ramdisk is mirrored to a file laid out exactly
+ * like the ramdisk memory. Every change marks the RD_BLOCK_SIZE units it
+ * touched in dirty_map, and a worker writes the dirty units back every
+ * flush_interval seconds, each run of adjacent units with one write, so
+ * the write path never waits for the file. A flush first copies the dirty
+ * units out while the ramdisk keeps running, clearing each bit before the
+ * copy so a unit changed meanwhile is marked again. Only the units marked
+ * again during that copy are then copied with freeze_sem held for write and
+ * sb_lock held, which the inode and dentry reclaim workers take too. That
+ * makes every flush a consistent point in time of the whole ramdisk for the
+ * cost of a short freeze. The file is written after it is released. RD_SYNC flushes and
+ * waits for it, unloading the module flushes one last time. Only the flush
+ * that is under way at a crash can be torn.
+ */
+
+/*
+ * Write every dirty unit to the backing file and sync it. Returns the number
+ * of units written, -1 if the file could not be written; the units stay
+ * dirty then and the next flush retries them.
+ */
+static int flush_dirty(rd_ctx *rd) {
+	unsigned long since;
+	loff_t pos;
+	u64 start, frozen;
+	int i, n, run, ret;
+
+	mutex_lock(&rd->flush_mutex);
+	since = READ_ONCE(rd->dirty_since);
+	n = 0;
+	for (i = find_first_bit(rd->dirty_map, RD_DISK_UNITS); i < RD_DISK_UNITS; i = find_next_bit(rd->dirty_map, RD_DISK_UNITS, i + 1)) {
+		if (!test_and_clear_bit(i, rd->dirty_map))
+			continue;
+		memcpy(rd->flush_buf + i * RD_BLOCK_SIZE, rd->first_block + i * RD_BLOCK_SIZE, RD_BLOCK_SIZE);
+		set_bit(i, rd->flush_map);
+		n++;
+	}
+
+	start = ktime_get_ns();
+	percpu_down_write(&rd->freeze_sem);
+	spin_lock(&rd->sb_lock);
+	for (i = find_first_bit(rd->dirty_map, RD_DISK_UNITS); i < RD_DISK_UNITS; i = find_next_bit(rd->dirty_map, RD_DISK_UNITS, i + 1)) {
+		clear_bit(i, rd->dirty_map);
+		memcpy(rd->flush_buf + i * RD_BLOCK_SIZE, rd->first_block + i * RD_BLOCK_SIZE, RD_BLOCK_SIZE);
+		if (!test_bit(i, rd->flush_map)) {
+			set_bit(i, rd->flush_map);
+			n++;
+		}
+	}
+	if (since == 0)
+		since = rd->dirty_since;
+	rd->dirty_since = 0;
+	spin_unlock(&rd->sb_lock);
+	percpu_up_write(&rd->freeze_sem);
+	frozen = ktime_get_ns() - start;
+	rd->flush_stats.freeze_ns += frozen;
+	if (frozen > rd->flush_stats.max_freeze_ns)
+		rd->flush_stats.max_freeze_ns = frozen;
+
+	ret = 0;
+	start = ktime_get_ns();
+	for (i = find_first_bit(rd->flush_map, RD_DISK_UNITS); i < RD_DISK_UNITS && ret == 0; i = find_next_bit(rd->flush_map, RD_DISK_UNITS, i + run)) {
+		for (run = 1; i + run < RD_DISK_UNITS && test_bit(i + run, rd->flush_map); ++run)
+			;
+		pos = (loff_t)i * RD_BLOCK_SIZE;
+		ret = image_write(rd->backing_filp, rd->flush_buf + i * RD_BLOCK_SIZE, run * RD_BLOCK_SIZE, &pos);
+	}
+	if (ret == 0 && n > 0 && vfs_fsync(rd->backing_filp, 0) != 0)
+		ret = -1;
+	if (ret == -1) {
+		for (i = find_first_bit(rd->flush_map, RD_DISK_UNITS); i < RD_DISK_UNITS; i = find_next_bit(rd->flush_map, RD_DISK_UNITS, i + 1))
+			set_bit(i, rd->dirty_map);
+		bitmap_zero(rd->flush_map, RD_DISK_UNITS);
+		cmpxchg(&rd->dirty_since, 0, since);
+		rd->flush_stats.errors++;
+		mutex_unlock(&rd->flush_mutex);
+		return -1;
+	}
+	bitmap_zero(rd->flush_map, RD_DISK_UNITS);
+	rd->flush_stats.passes++;
+	rd->flush_stats.units += n;
+	rd->flush_stats.bytes += (u64)n * RD_BLOCK_SIZE;
+	rd->flush_stats.write_ns += ktime_get_ns() - start;
+	if (n > 0 && since != 0) {
+		rd->flush_stats.last_lag = time_after(jiffies, since) ? jiffies - since : 0;
+		if (rd->flush_stats.last_lag > rd->flush_stats.max_lag)
+			rd->flush_stats.max_lag = rd->flush_stats.last_lag;
+	}
+	mutex_unlock(&rd->flush_mutex);
+	return n;
+}
+
+static void flush_work_fn(struct work_struct *work) {
+	rd_ctx *rd = container_of(to_delayed_work(work), rd_ctx, flush_work);
+
+	if (flush_dirty(rd) == -1)
+		printk("Error: Cannot write back to '%s', retrying.\n", rd->backing);
+	schedule_delayed_work(&rd->flush_work, flush_interval * HZ);
+}
+
+/*
+ * Whether the superblock read from a backing file is one of this ramdisk layout
+ */
+static bool backing_matches(rd_ctx *rd, rd_superblock *sb) {
+	return sb->block_count == RD_BLOCK_NUM && sb->inode_count == RD_INODE_NUM &&
+	       sb->inodes_offset == rd->superblock->inodes_offset && sb->bitmap_offset == rd->superblock->bitmap_offset &&
+	       sb->refs_offset == rd->superblock->refs_offset && sb->data_offset == rd->superblock->data_offset &&
+	       sb->maps_offset == rd->superblock->maps_offset &&
+	       sb->inode_hwm <= RD_INODE_NUM && sb->block_hwm <= RD_BLOCK_NUM;
+}
+
+/*
+ * Read the ramdisk back from the backing file. The file ends with the last
+ * unit ever flushed, which is at least everything below the high-water marks.
+ * It is read into flush_buf and checked like an image before it is used.
+ */
+static int backing_read(rd_ctx *rd, rd_superblock *sb) {
+	loff_t pos;
+	ssize_t ret;
+	int len, size;
+
+	pos = 0;
+	for (len = 0; len < RD_DISK_SIZE; len += ret) {
+		ret = kernel_read(rd->backing_filp, rd->flush_buf + len, RD_DISK_SIZE - len, &pos);
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			break;
+	}
+	size = rd->first_data_block - rd->first_block + sb->block_hwm * RD_BLOCK_SIZE;
+	if (len < size || memcmp(rd->flush_buf, sb, sizeof(*sb)) != 0 || image_check(rd, rd->flush_buf) == -1)
+		return -1;
+	memcpy(rd->first_block, rd->flush_buf, size);
+	return 0;
+}
+
+/*
+ * Open the backing file at load time. Unless an image was just restored,
+ * a backing file holding a ramdisk of this layout becomes the contents;
+ * otherwise the first flush writes the whole ramdisk to it.
+ */
+static int backing_init(rd_ctx *rd, bool restored) {
+	rd_superblock sb;
+	loff_t pos;
+
+	rd->backing_filp = filp_open(rd->backing, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+	if (IS_ERR(rd->backing_filp)) {
+		rd->backing_filp = NULL;
+		return -1;
+	}
+	rd->dirty_map = (unsigned long*)vzalloc(BITS_TO_LONGS(RD_DISK_UNITS) * sizeof(unsigned long));
+	rd->flush_buf = (char*)vmalloc(RD_DISK_SIZE);
+	rd->flush_map = (unsigned long*)vzalloc(BITS_TO_LONGS(RD_DISK_UNITS) * sizeof(unsigned long));
+	if (!rd->dirty_map || !rd->flush_buf || !rd->flush_map) {
+		vfree(rd->dirty_map);
+		vfree(rd->flush_buf);
+		vfree(rd->flush_map);
+		rd->dirty_map = NULL;
+		rd->flush_buf = NULL;
+		rd->flush_map = NULL;
+		filp_close(rd->backing_filp, NULL);
+		rd->backing_filp = NULL;
+		return -1;
+	}
+
+	pos = 0;
+	if (!restored && image_read(rd->backing_filp, &sb, sizeof(sb), &pos) == 0 && backing_matches(rd, &sb)) {
+		percpu_down_write(&rd->freeze_sem);
+		if (backing_read(rd, &sb) == 0) {
+			image_fixup(rd);
+			/* the file already holds all of it */
+			bitmap_zero(rd->dirty_map, RD_DISK_UNITS);
+			rd->dirty_since = 0;
+			percpu_up_write(&rd->freeze_sem);
+			printk("Ramdisk loaded from backing file '%s'.\n", rd->backing);
+			goto out;
+		}
+		/* nothing was copied, the empty ramdisk is still in place */
+		percpu_up_write(&rd->freeze_sem);
+		printk("Error: Backing file '%s' is truncated or corrupted, starting empty.\n", rd->backing);
+	}
+	mark_dirty(rd, rd->first_block, rd->first_data_block - rd->first_block + rd->superblock->block_hwm * RD_BLOCK_SIZE);
+out:
+	if (flush_interval > 0)
+		schedule_delayed_work(&rd->flush_work, flush_interval * HZ);
+	return 0;
+}
+
+/*
+ * Write every dirty block back to the backing file now and wait for it
+ */
+int ramfs_sync(rd_ctx *rd, char *msg) {
+	int n;
+
+	if (rd->backing_filp == NULL) {
+		sprintf(msg + strlen(msg), "Error: No backing file, load the module with backing=<FILE>.\n");
 		return -1;
 	}
-	file = fd_list[fd];
-	/* check if the fd is valid */
-	if (file == NULL) {
-		sprintf(msg + strlen(msg), "Error: Invalid fd '%d'.\n", fd);
+	n = flush_dirty(rd);
+	if (n == -1) {
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Cannot write back to '%s'.\n", rd->backing);
 		return -1;
 	}
-	/* check if the file is read-only */
-	if (file->mode == RD_RDONLY) {
-		sprintf(msg + strlen(msg), "Error: Read only file '%s'.\n", file->path);
-		return -1;
+	sprintf(msg + strlen(msg), "Successfully sync '%d' dirty blocks.\n", n);
+	return n;
+}
+
+/*
+ * Free the given inode and everything below it. Only used on trees that were
+ * never published, so the dentries are not freed one by one.
+ */
+static void drop_tree(rd_ctx *rd, rd_inode *inode) {
+	rd_dentry *dentry;
+	int i, j, dir_num, remain;
+
+	if (inode->file_type == RD_DIRECTORY) {
+		dir_num = RD_BLOCK_SIZE / sizeof(rd_dentry);
+		for (i = 0; i * RD_BLOCK_SIZE < inode->file_size; ++i) {
+			remain = inode->file_size - i * RD_BLOCK_SIZE;
+			dentry = (rd_dentry*)inode_block(rd, inode, i);
+			for (j = 0; j < dir_num && (int)((j + 1) * sizeof(rd_dentry)) <= remain; ++j, ++dentry) {
+				if (dentry->inode_num < 0 || strcmp(dentry->filename, ".") == 0 ||
+				    strcmp(dentry->filename, "..") == 0)
+					continue;
+				drop_tree(rd, rd->inode_list + dentry->inode_num);
+			}
+		}
 	}
-	
-	offset = file->offset;
-	/* check if the file reaches the max-file-size */
-	if (offset == RD_MAX_FILE_SIZE) {
-		sprintf(msg + strlen(msg), "Warning: Max file size reached.\n");
-		return 0;
+	for (i = 0; i < inode->block_count; ++i)
+		free_block(rd, inode_block(rd, inode, i));
+	free_inode(rd, inode);
+}
+
+/*
+ * Clone the given inode and everything below it, return the copy. A file's
+ * copy shares its blocks, a dir's copy gets its own blocks holding a clone
+ * of every entry, with parent_num as its "..". Returns NULL if the disk runs
+ * out, after freeing whatever was cloned. The caller holds freeze_sem for
+ * write, so nothing below src changes meanwhile.
+ */
+static rd_inode* clone_tree(rd_ctx *rd, rd_inode *src, int parent_num) {
+	rd_inode *dst;
+	rd_inode *child;
+	rd_dentry *dentry;
+	char *block;
+	int i, j, dir_num, remain;
+
+	dst = allocate_inode(rd, src->file_type);
+	if (dst == NULL)
+		return NULL;
+	if (src->file_type == RD_FILE) {
+		for (i = 0; i < src->block_count; ++i) {
+			get_block(rd, inode_block(rd, src, i));
+			inode_map(rd, dst)[i] = inode_map(rd, src)[i];
+		}
+		dst->block_count = src->block_count;
+		dst->file_size = src->file_size;
+		mark_dirty(rd, dst, sizeof(rd_inode));
+		mark_dirty(rd, inode_map(rd, dst), sizeof(rd_block_map));
+		return dst;
 	}
-	inode = file->inode;
-	blknum = offset / RD_BLOCK_SIZE;
-	blkoffset = offset % RD_BLOCK_SIZE;
-	byte = inode->block_addr[blknum] + blkoffset;
-	write_cnt = 0;
 
-	for (i = 0; i < count; ++i) {
-		*(byte++) = *(buf++);
-		write_cnt++;
-		offset++;
-		if (offset % RD_BLOCK_SIZE == 0) {
-			/* go to the next block */
-			blknum++;
-			if (blknum == inode->block_count) {
-				/* check if max block reachd */
-				if (inode->block_count == RD_MAX_FILE_BLK) {
-					break;
-				}
-				/* allocate a new block to write */
-				byte = allocate_block();
-				if (byte == NULL) {
-					sprintf(msg + strlen(msg), "Error: No free blocks available.\n");
-					break;
-				}
-				inode->block_addr[inode->block_count++] = byte;
-				
+	block = allocate_block(rd);
+	if (block == NULL) {
+		free_inode(rd, dst);
+		return NULL;
+	}
+	set_inode_block(rd, dst, 0, block);
+	dst->block_count = 1;
+	mark_dirty(rd, dst, sizeof(rd_inode));
+	if (add_dentry(rd, dst, dst->inode_num, ".") == -1 || add_dentry(rd, dst, parent_num, "..") == -1)
+		goto fail;
+
+	dir_num = RD_BLOCK_SIZE / sizeof(rd_dentry);
+	for (i = 0; i * RD_BLOCK_SIZE < src->file_size; ++i) {
+		remain = src->file_size - i * RD_BLOCK_SIZE;
+		dentry = (rd_dentry*)inode_block(rd, src, i);
+		for (j = 0; j < dir_num && (int)((j + 1) * sizeof(rd_dentry)) <= remain; ++j, ++dentry) {
+			if (dentry->inode_num < 0 || strcmp(dentry->filename, ".") == 0 ||
+			    strcmp(dentry->filename, "..") == 0)
+				continue;
+			child = clone_tree(rd, rd->inode_list + dentry->inode_num, dst->inode_num);
+			if (child == NULL)
+				goto fail;
+			if (add_dentry(rd, dst, child->inode_num, dentry->filename) == -1) {
+				drop_tree(rd, child);
+				goto fail;
 			}
-			byte = inode->block_addr[blknum];
 		}
 	}
+	return dst;
 
-	inode->file_size += write_cnt;
-	file->offset = offset;
-	sprintf(msg + strlen(msg), "Successfully write '%d' bytes to fd '%d'.\n", write_cnt, fd);
-	return write_cnt;
+fail:
+	drop_tree(rd, dst);
+	return NULL;
 }
 
 /*
- * lseek (change the offset in fd) a file according to the given fd.
+ * Take a snapshot of the dir at src_path as a new dir at dst_path. The tree
+ * is frozen while it is cloned; files in the snapshot share their blocks
+ * with the originals until either side writes them.
  */
-int ramfs_lseek(int fd, int offset, char *msg) {
-	rd_file *file;
-	rd_inode *inode;
-	if (fd < 0 || fd >= RD_MAX_FILE) {
-		sprintf(msg + strlen(msg), "Error: Invalid fd '%d'.\n", fd);
-		return -1;
+int ramfs_snapshot(rd_ctx *rd, const char *src_path, const char *dst_path, char *msg) {
+	rd_inode *src_parent;
+	rd_inode *src_inode;
+	rd_inode *dst_parent;
+	rd_inode *dst_inode;
+	char filename[RD_MAX_FILENAME];
+	bool waited;
+	int ret;
+
+	waited = false;
+retry:
+	percpu_down_write(&rd->freeze_sem);
+	ret = parse_path(rd, src_path, RD_DIRECTORY, &src_parent, &src_inode, filename);
+	if (ret == -1) {
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Invalid path '%s'.\n", src_path);
+		goto out;
+	} else if (ret == 0) {
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Path '%s' doesn't exist.\n", src_path);
+		ret = -1;
+		goto out;
+	} else if (src_inode->file_type != RD_DIRECTORY) {
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Path '%s' is not a dir path.\n", src_path);
+		ret = -1;
+		goto out;
 	}
-	file = fd_list[fd];
-	/* check if the fd is valid */
-	if (file == NULL) {
-		sprintf(msg + strlen(msg), "Error: Invalid fd '%d'.\n", fd);
+	ret = parse_path(rd, dst_path, RD_DIRECTORY, &dst_parent, &dst_inode, filename);
+	if (ret == -1) {
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Invalid path '%s'.\n", dst_path);
+		goto out;
+	} else if (ret == 1) {
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: File '%s' already exists.\n", dst_path);
+		ret = -1;
+		goto out;
+	}
+
+	dst_inode = clone_tree(rd, src_inode, dst_parent->inode_num);
+	if (dst_inode == NULL) {
+		percpu_up_write(&rd->freeze_sem);
+		if (!waited && wait_inode_reclaims(rd)) {
+			waited = true;
+			goto retry;
+		}
+		sprintf(msg + strlen(msg), "Error: No free blocks or inodes available.\n");
 		return -1;
 	}
+	/* the snapshot becomes visible only once it is complete */
+	down_write(inode_sem(rd, dst_parent));
+	ret = add_dentry(rd, dst_parent, dst_inode->inode_num, filename);
+	up_write(inode_sem(rd, dst_parent));
+	if (ret == -1) {
+		sprintf(msg + strlen(msg), "Error: Cannot add dentry.\n");
+		drop_tree(rd, dst_inode);
+		goto out;
+	}
+	scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Successfully snapshot '%s' to '%s'.\n", src_path, dst_path);
+out:
+	percpu_up_write(&rd->freeze_sem);
+	return ret;
+}
+
+/*
+ * Clone the file at src_path as a new file at dst_path sharing all its
+ * blocks. Takes constant time and no data blocks until either file is written.
+ */
+int ramfs_reflink(rd_ctx *rd, const char *src_path, const char *dst_path, char *msg) {
+	rd_inode *parent_inode;
+	rd_inode *file_inode;
+	char *blocks[RD_MAX_FILE_BLK];
+	char filename[RD_MAX_FILENAME];
+	int i, ret, inode_num, block_count, file_size;
+	bool waited;
+
+	waited = false;
+retry:
+	percpu_down_read(&rd->freeze_sem);
+	ret = parse_path(rd, src_path, RD_FILE, &parent_inode, &file_inode, filename);
+	if (ret == -1) {
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Invalid path '%s'.\n", src_path);
+		goto out;
+	} else if (ret == 0) {
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Path '%s' doesn't exist.\n", src_path);
+		ret = -1;
+		goto out;
+	}
 
-	inode = file->inode;
-	if (offset > inode->file_size) {
-		sprintf(msg + strlen(msg), "Error: Offset '%d' is larger than file size '%d'.\n", offset, inode->file_size);
+	/* take a reference to every block of the source, under its lock */
+	down_read(inode_sem(rd, parent_inode));
+	if (find_dentry(rd, parent_inode, filename, &inode_num) == NULL) {
+		up_read(inode_sem(rd, parent_inode));
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Path '%s' doesn't exist.\n", src_path);
+		ret = -1;
+		goto out;
+	}
+	file_inode = rd->inode_list + inode_num;
+	if (file_inode->file_type != RD_FILE) {
+		up_read(inode_sem(rd, parent_inode));
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Path '%s' is not a regular file.\n", src_path);
+		ret = -1;
+		goto out;
+	}
+	down_read(inode_sem(rd, file_inode));
+	up_read(inode_sem(rd, parent_inode));
+	block_count = file_inode->block_count;
+	file_size = file_inode->file_size;
+	for (i = 0; i < block_count; ++i) {
+		blocks[i] = inode_block(rd, file_inode, i);
+		get_block(rd, blocks[i]);
+	}
+	up_read(inode_sem(rd, file_inode));
+
+	ret = parse_path(rd, dst_path, RD_FILE, &parent_inode, &file_inode, filename);
+	if (ret == -1) {
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Invalid path '%s'.\n", dst_path);
+		goto drop;
+	} else if (ret == 1) {
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: File '%s' already exists.\n", dst_path);
+		ret = -1;
+		goto drop;
+	}
+	down_write(inode_sem(rd, parent_inode));
+	/* someone may have created it since the lookup */
+	if (find_dentry(rd, parent_inode, filename, NULL) != NULL) {
+		up_write(inode_sem(rd, parent_inode));
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: File '%s' already exists.\n", dst_path);
+		ret = -1;
+		goto drop;
+	}
+	file_inode = allocate_inode(rd, RD_FILE);
+	if (file_inode == NULL) {
+		up_write(inode_sem(rd, parent_inode));
+		for (i = 0; i < block_count; ++i)
+			free_block(rd, blocks[i]);
+		percpu_up_read(&rd->freeze_sem);
+		if (!waited && wait_inode_reclaims(rd)) {
+			waited = true;
+			goto retry;
+		}
+		sprintf(msg + strlen(msg), "Error: No free inodes available.\n");
 		return -1;
 	}
-	file->offset = offset;
-	sprintf(msg + strlen(msg), "Successfully lseek, current offset of fd '%d' is '%d'.\n", fd, offset);
+	for (i = 0; i < block_count; ++i)
+		set_inode_block(rd, file_inode, i, blocks[i]);
+	file_inode->block_count = block_count;
+	file_inode->file_size = file_size;
+	mark_dirty(rd, file_inode, sizeof(rd_inode));
+	ret = add_dentry(rd, parent_inode, file_inode->inode_num, filename);
+	up_write(inode_sem(rd, parent_inode));
+	if (ret == -1) {
+		sprintf(msg + strlen(msg), "Error: Parent dir's size reaches max-file-size.\n");
+		/* free_inode forgets the block map, the blocks are dropped below */
+		free_inode(rd, file_inode);
+		goto drop;
+	}
+	scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Successfully reflink '%s' to '%s'.\n", src_path, dst_path);
+	percpu_up_read(&rd->freeze_sem);
 	return 0;
+
+drop:
+	for (i = 0; i < block_count; ++i)
+		free_block(rd, blocks[i]);
+out:
+	percpu_up_read(&rd->freeze_sem);
+	return ret;
 }
 
 /*
- * Show the status of all valid blocks
+ * Count the free extents of the data region and return their number, with
+ * the length of the largest one. hist, if not NULL, gets the number of
+ * extents by ilog2 of their length. Blocks past block_hwm are one extent.
+ * The caller holds sb_lock.
  */
-int show_blocks_status(char *msg) {
-	int i, j;
-	char byte;
-	sprintf(msg + strlen(msg), "======================Block Status======================\n");
-	sprintf(msg + strlen(msg), "Available free blocks: %d. Total: %d\n\n", superblock->freeblock_count, superblock->block_count);
-	sprintf(msg + strlen(msg), "BlkNum\tBlkAddr\n");
-	for (i = 0; i < RD_BLOCKBITMAP_SIZE; ++i) {
-		byte = *(first_bitmap_block + i);
-		for (j = 0; j < 8; ++j) {
-			if ((byte >> j) & 1) {
-				sprintf(msg + strlen(msg), "%d\t%p\n", i * 8 + j, first_data_block + (i * 8 + j) * RD_BLOCK_SIZE);
-			}
+static int free_extents(rd_ctx *rd, int *hist, int *largest) {
+	int i, run, extents;
+
+	extents = 0;
+	*largest = 0;
+	for (i = 0, run = 0; i <= RD_BLOCK_NUM; ++i) {
+		if (i < RD_BLOCK_NUM && !bitmap_test(rd, i)) {
+			if (run++ == 0)
+				extents++;
+			continue;
+		}
+		if (run > *largest)
+			*largest = run;
+		if (run > 0 && hist != NULL)
+			hist[ilog2(run)]++;
+		run = 0;
+	}
+	return extents;
+}
+
+/*
+ * Count one ioctl: its command, whether it failed, the bytes it moved and
+ * how long it took. Commands without stats are ignored.
+ */
+void stats_op(rd_ctx *rd, unsigned int cmd, int ret, int bytes, u64 ns) {
+	int i, bucket;
+
+	for (i = 0; i < RD_STAT_CMDS; ++i) {
+		if (stat_cmds[i].cmd == cmd)
+			break;
+	}
+	if (i == RD_STAT_CMDS || rd->cpu_stats == NULL)
+		return;
+	bucket = ns ? ilog2(ns) : 0;
+	if (bucket >= RD_STAT_BUCKETS)
+		bucket = RD_STAT_BUCKETS - 1;
+	this_cpu_inc(rd->cpu_stats->ops[i].ops);
+	if (ret == -1)
+		this_cpu_inc(rd->cpu_stats->ops[i].errors);
+	else if (bytes > 0)
+		this_cpu_add(rd->cpu_stats->ops[i].bytes, bytes);
+	this_cpu_add(rd->cpu_stats->ops[i].ns, ns);
+	this_cpu_inc(rd->cpu_stats->ops[i].hist[bucket]);
+}
+
+/*
+ * Zero all the statistics
+ */
+void reset_stats(rd_ctx *rd) {
+	int cpu;
+
+	if (rd->cpu_stats == NULL)
+		return;
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(rd->cpu_stats, cpu), 0, sizeof(rd_cpu_stats));
+}
+
+/*
+ * Print the statistics summed over all CPUs, plus how fragmented the free
+ * space is. With every counter in use it outgrows a page, so it goes
+ * through a single_open seq_file, which grows its buffer to fit.
+ */
+int show_stats(struct seq_file *m, void *v) {
+	rd_ctx *rd = m->private;
+	rd_cpu_stats *total;
+	rd_cpu_stats *st;
+	rd_op_stats *op;
+	int cpu, i, j, extents, largest, free_blocks, free_inodes;
+	u64 *sum;
+	u64 *add;
+
+	if (rd->cpu_stats == NULL)
+		return 0;
+	total = (rd_cpu_stats*)kzalloc(sizeof(rd_cpu_stats), GFP_KERNEL);
+	if (total == NULL)
+		return -ENOMEM;
+	/* all fields are u64 counters, add them up as an array */
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(rd->cpu_stats, cpu);
+		sum = (u64*)total;
+		add = (u64*)st;
+		for (i = 0; i < (int)(sizeof(rd_cpu_stats) / sizeof(u64)); ++i)
+			sum[i] += READ_ONCE(add[i]);
+	}
+
+	seq_printf(m, "%-12s%12s%14s%10s%12s\n", "op", "ops", "bytes", "errors", "avg_ns");
+	for (i = 0; i < RD_STAT_CMDS; ++i) {
+		op = &total->ops[i];
+		if (op->ops == 0)
+			continue;
+		seq_printf(m, "%-12s%12llu%14llu%10llu%12llu\n", stat_cmds[i].name,
+			op->ops, op->bytes, op->errors, div64_u64(op->ns, op->ops));
+	}
+	seq_printf(m, "\nlatency: <log2 ns>:<ops>, e.g. 10:5 means 5 ops took 1024 to 2047 ns\n");
+	for (i = 0; i < RD_STAT_CMDS; ++i) {
+		op = &total->ops[i];
+		if (op->ops == 0)
+			continue;
+		seq_printf(m, "%-12s", stat_cmds[i].name);
+		for (j = 0; j < RD_STAT_BUCKETS; ++j) {
+			if (op->hist[j] != 0)
+				seq_printf(m, " %d:%llu", j, op->hist[j]);
 		}
+		seq_printf(m, "\n");
 	}
-	sprintf(msg + strlen(msg), "========================================================\n");
+
+	spin_lock(&rd->sb_lock);
+	extents = free_extents(rd, NULL, &largest);
+	free_blocks = rd->superblock->freeblock_count;
+	free_inodes = rd->superblock->freeinode_count;
+	spin_unlock(&rd->sb_lock);
+
+	seq_printf(m, "\nallocator\n");
+	seq_printf(m, "blocks: %llu allocated, %llu failed, %llu bits scanned per allocation\n",
+		total->block_allocs, total->block_fails,
+		total->block_allocs ? div64_u64(total->block_scanned, total->block_allocs) : 0);
+	seq_printf(m, "runs: %llu allocated, %llu fell back to single blocks, %llu bits scanned per run\n",
+		total->run_allocs, total->run_misses,
+		total->run_allocs ? div64_u64(total->run_scanned, total->run_allocs) : 0);
+	seq_printf(m, "inodes: %llu allocated, %llu failed, %llu inodes scanned per allocation, %d free\n",
+		total->inode_allocs, total->inode_fails,
+		total->inode_allocs ? div64_u64(total->inode_scanned, total->inode_allocs) : 0, free_inodes);
+	seq_printf(m, "free space: %d blocks in %d extents, largest %d blocks (%d%% fragmented)\n",
+		free_blocks, extents, largest, free_blocks ? 100 - largest * 100 / free_blocks : 0);
+	kfree(total);
 	return 0;
 }
 
+
 /*
- * Show the status of all valid inodes
+ * Status reports
+ *
+ * A report is a header, one entry per block, inode, dir or fd table, and a
+ * footer. The /proc reports stream through seq_file a page at a time and
+ * hold the report's locks only while a page is filled, so they need no
+ * big buffer and never stall the ramdisk for the whole dump. The show*
+ * ioctls print the same lines into their message, which ends with a note
+ * pointing at /proc once RD_MSG_SIZE is full.
  */
-int show_inodes_status(char *msg) {
-	int i, j;
-	char* dirtype;
-	char* filetype;
-	char *type;
-	sprintf(msg + strlen(msg), "======================Inode Status======================\n");
-	sprintf(msg + strlen(msg), "Available free inodes: %d, Total: %d\n\n", superblock->freeinode_count, superblock->inode_count);
-	sprintf(msg + strlen(msg), "InodeNum\tType\tBlkCnt\tSize\tBlkAddr\n");
-
-
-
-	dirtype = "dir";
-	filetype = "file";
-	for (i = 0; i < RD_INODE_NUM; ++i) {
-		if (inode_list[i].file_type != RD_AVAILABLE) {
-			if (inode_list[i].file_type == RD_FILE)
-				type = filetype;
-			else
-				type = dirtype;
-			sprintf(msg + strlen(msg), "%d\t\t%s\t%d\t%d\t", inode_list[i].inode_num, 
-				                         type,
-				                         inode_list[i].block_count,
-				                         inode_list[i].file_size);
-			for (j = 0; j < RD_MAX_FILE_BLK; ++j) {
-				if (inode_list[i].block_addr[j] == NULL)
-					break;
-				if (j != 0)
-					sprintf(msg + strlen(msg), "\t\t\t\t\t");
-				sprintf(msg + strlen(msg), "%p\n", inode_list[i].block_addr[j]);
-			}
+typedef struct {
+	struct seq_file *seq;	/* stream to this seq_file, or */
+	char *msg;				/* append to this ioctl message */
+	bool full;				/* msg had no room for a line, the rest was dropped */
+} rd_report;
+
+#define RD_REPORT_ROOM		(RD_MSG_SIZE - 128)		/* the rest is kept for report_end */
+#define RD_REPORT_FOOTER	"========================================================\n"
+
+static __printf(2, 3) void report(rd_report *r, const char *fmt, ...) {
+	va_list args;
+	int len, n;
+
+	va_start(args, fmt);
+	if (r->seq != NULL) {
+		seq_vprintf(r->seq, fmt, args);
+	} else if (!r->full) {
+		/* whole lines only: one that doesn't fit is taken back */
+		len = strlen(r->msg);
+		n = len < RD_REPORT_ROOM ? vsnprintf(r->msg + len, RD_REPORT_ROOM - len, fmt, args) : 0;
+		if (len >= RD_REPORT_ROOM || len + n >= RD_REPORT_ROOM) {
+			r->msg[len] = 0;
+			r->full = true;
 		}
+	}
+	va_end(args);
+}
+
+/* The footer, after a note if the message was cut short, name is the report's /proc suffix */
+static void report_end(rd_ctx *rd, rd_report *r, const char *name) {
+	if (r->full)
+		sprintf(r->msg + strlen(r->msg), "... cut short, /proc/%s_%s has the whole report\n", rd->name, name);
+	if (r->seq != NULL)
+		seq_puts(r->seq, RD_REPORT_FOOTER);
+	else
+		strcat(r->msg, RD_REPORT_FOOTER);
+}
+
+/* A report over count() entries, the seq_file sees only seq_ops and has the instance as private */
+typedef struct {
+	struct seq_operations seq_ops;
+	void (*lock)(rd_ctx *rd);
+	void (*unlock)(rd_ctx *rd);
+	int (*count)(rd_ctx *rd);
+	void (*header)(rd_ctx *rd, rd_report *r);
+	void (*entry)(rd_ctx *rd, rd_report *r, int i);
+} rd_report_ops;
+
+static inline const rd_report_ops* report_ops(struct seq_file *m) {
+	return container_of(m->op, rd_report_ops, seq_ops);
+}
+
+/* Position 0 is the header, 1 to count() the entries, count() + 1 the footer */
+static void* report_start(struct seq_file *m, loff_t *pos) {
+	const rd_report_ops *ops = report_ops(m);
+	rd_ctx *rd = m->private;
+
+	ops->lock(rd);
+	if (*pos > ops->count(rd) + 1)
+		return NULL;
+	return (void*)(long)(*pos + 1);
+}
+
+static void* report_next(struct seq_file *m, void *v, loff_t *pos) {
+	++*pos;
+	if (*pos > report_ops(m)->count(m->private) + 1)
+		return NULL;
+	return (void*)(long)(*pos + 1);
+}
+
+static void report_stop(struct seq_file *m, void *v) {
+	report_ops(m)->unlock(m->private);
+}
+
+static int report_show(struct seq_file *m, void *v) {
+	const rd_report_ops *ops = report_ops(m);
+	rd_report r = { m, NULL, false };
+	rd_ctx *rd = m->private;
+	long pos = (long)v - 1;
+
+	if (pos == 0)
+		ops->header(rd, &r);
+	else if (pos <= ops->count(rd))
+		ops->entry(rd, &r, pos - 1);
+	else
+		report_end(rd, &r, NULL);
+	return 0;
+}
+
+/* The whole report into an ioctl message */
+static void report_msg(rd_ctx *rd, const rd_report_ops *ops, char *msg, const char *name) {
+	rd_report r = { NULL, msg, false };
+	int i;
+
+	ops->lock(rd);
+	ops->header(rd, &r);
+	for (i = 0; i < ops->count(rd) && !r.full; ++i)
+		ops->entry(rd, &r, i);
+	report_end(rd, &r, name);
+	ops->unlock(rd);
+}
+
+static void lock_all(rd_ctx *rd) {
+	percpu_down_read(&rd->freeze_sem);
+	spin_lock(&rd->sb_lock);
+}
+
+static void unlock_all(rd_ctx *rd) {
+	spin_unlock(&rd->sb_lock);
+	percpu_up_read(&rd->freeze_sem);
+}
+
+static int blocks_count(rd_ctx *rd) {
+	return rd->superblock->block_hwm;
+}
 
+static void blocks_header(rd_ctx *rd, rd_report *r) {
+	report(r, "======================Block Status======================\n");
+	report(r, "Available free blocks: %d. Total: %d\n", rd->superblock->freeblock_count, rd->superblock->block_count);
+	report(r, "Compressed blocks: %d in %d pool blocks (%d bytes, %d%% of original size), compressed reads: %d, inflated: %d\n",
+		rd->compress_stats.entries, rd->compress_stats.pool_blocks, rd->compress_stats.bytes,
+		rd->compress_stats.entries ? rd->compress_stats.pool_blocks * 100 / rd->compress_stats.entries : 0,
+		atomic_read(&rd->compress_stats.reads), atomic_read(&rd->compress_stats.inflates));
+	if (rd->backing_filp != NULL) {
+		report(r, "Write-back: %d flushes, %d blocks (%llu bytes, %llu KB/s), %u dirty, lag %u ms (max %u ms), frozen %llu us (max %llu us), %d errors\n",
+			rd->flush_stats.passes, rd->flush_stats.units, rd->flush_stats.bytes,
+			rd->flush_stats.write_ns ? div64_u64(rd->flush_stats.bytes * 1000000, rd->flush_stats.write_ns) * 1000 / 1024 : 0,
+			bitmap_weight(rd->dirty_map, RD_DISK_UNITS),
+			jiffies_to_msecs(rd->flush_stats.last_lag), jiffies_to_msecs(rd->flush_stats.max_lag),
+			div64_u64(rd->flush_stats.freeze_ns, 1000), div64_u64(rd->flush_stats.max_freeze_ns, 1000), rd->flush_stats.errors);
 	}
-	sprintf(msg + strlen(msg), "========================================================\n");
+	report(r, "Dedup: %d of %d scanned blocks were duplicates (%d%%), %d bytes saved\n\n",
+		rd->dedup_stats.hits, rd->dedup_stats.scanned,
+		rd->dedup_stats.scanned ? rd->dedup_stats.hits * 100 / rd->dedup_stats.scanned : 0,
+		rd->dedup_stats.hits * RD_BLOCK_SIZE);
+	report(r, "BlkNum\tRefCnt\tBlkAddr\n");
+}
+
+static void blocks_entry(rd_ctx *rd, rd_report *r, int i) {
+	if (bitmap_test(rd, i))
+		report(r, "%d\t%d\t%p\n", i, rd->block_refs[i], rd->first_data_block + i * RD_BLOCK_SIZE);
+}
 
+static const rd_report_ops blocks_report = {
+	.seq_ops = { .start = report_start, .next = report_next, .stop = report_stop, .show = report_show },
+	.lock = lock_all, .unlock = unlock_all,
+	.count = blocks_count, .header = blocks_header, .entry = blocks_entry,
+};
+const struct seq_operations *blocks_seq_ops = &blocks_report.seq_ops;
+
+/*
+ * Show the status of all valid blocks
+ */
+int show_blocks_status(rd_ctx *rd, char *msg) {
+	report_msg(rd, &blocks_report, msg, "blocks");
 	return 0;
 }
 
+static int inodes_count(rd_ctx *rd) {
+	return rd->superblock->inode_hwm;
+}
+
+static void inodes_header(rd_ctx *rd, rd_report *r) {
+	report(r, "======================Inode Status======================\n");
+	report(r, "Available free inodes: %d, Total: %d\n\n", rd->superblock->freeinode_count, rd->superblock->inode_count);
+	report(r, "InodeNum\tType\tBlkCnt\tSize\tBlkAddr\n");
+}
+
+static void inodes_entry(rd_ctx *rd, rd_report *r, int i) {
+	rd_inode *inode = rd->inode_list + i;
+	int j;
+
+	if (inode->file_type == RD_AVAILABLE || inode->file_type == RD_RECLAIMING)
+		return;
+	report(r, "%d\t\t%s\t%d\t%d\t", inode->inode_num, inode->file_type == RD_FILE ? "file" : "dir",
+		inode->block_count, inode->file_size);
+	for (j = 0; j < RD_MAX_FILE_BLK; ++j) {
+		if (inode_map(rd, inode)[j] == RD_NO_BLOCK)
+			break;
+		if (j != 0)
+			report(r, "\t\t\t\t\t");
+		report(r, "%p\n", inode_block(rd, inode, j));
+	}
+}
+
+static const rd_report_ops inodes_report = {
+	.seq_ops = { .start = report_start, .next = report_next, .stop = report_stop, .show = report_show },
+	.lock = lock_all, .unlock = unlock_all,
+	.count = inodes_count, .header = inodes_header, .entry = inodes_entry,
+};
+const struct seq_operations *inodes_seq_ops = &inodes_report.seq_ops;
+
 /*
- * Show the status of a directory. List all the files and sub-directories under it.
+ * Show the status of all valid inodes
  */
-int show_dir_status(const char *path, char *msg) {
-	char *filename;
-	rd_inode *par_inode;
-	rd_inode *inode;
-	int ret, i, j, size_count, max_dentry_num;
+int show_inodes_status(rd_ctx *rd, char *msg) {
+	report_msg(rd, &inodes_report, msg, "inodes");
+	return 0;
+}
+
+/* The entries of the given dir, the caller holds its lock */
+static void dir_entries(rd_ctx *rd, rd_report *r, rd_inode *inode) {
 	rd_dentry *dentry;
+	int i, j, size_count, max_dentry_num;
 
-	filename = (char*)vmalloc(RD_MAX_FILENAME);
-	ret = parse_path(path, RD_DIRECTORY, &par_inode, &inode, filename);
-	if (ret == -1) {
-		sprintf(msg + strlen(msg), "Error: Invalid path '%s'.\n", path);
-		return -1;
-	} else if (ret == 0) {
-		sprintf(msg + strlen(msg), "Error: Path '%s' doesn't exist.\n", path);
-		return -1;
-	} else if (par_inode->file_type != RD_DIRECTORY) {
-		sprintf(msg + strlen(msg), "Error: Path '%s' is not a dir path.\n", path);
-		return -1;
-	}
-	sprintf(msg + strlen(msg), "====================Directory Status====================\n");
-	sprintf(msg + strlen(msg), "Directory Path: %s\n\n", path);
-	sprintf(msg + strlen(msg), "InodeNum\tFilename\n");
+	report(r, "InodeNum\tFilename\n");
 	size_count = 0;
 	max_dentry_num = RD_BLOCK_SIZE / sizeof(rd_dentry);
 	for (i = 0 ; i < inode->block_count; ++i) {
-		dentry = (rd_dentry*)inode->block_addr[i];
+		dentry = (rd_dentry*)inode_block(rd, inode, i);
 		for (j = 0; j < max_dentry_num; ++j) {
-			if (dentry->inode_num != -1)
-				sprintf(msg + strlen(msg), "%d\t\t%s\n", dentry->inode_num, dentry->filename);
+			if (dentry->inode_num >= 0)
+				report(r, "%d\t\t%s\n", dentry->inode_num, dentry->filename);
 			size_count += sizeof(rd_dentry);
-			if (size_count >= inode->file_size) {
-				sprintf(msg + strlen(msg), "========================================================\n");
-				return 0;
-			}
+			if (size_count >= inode->file_size)
+				return;
 			dentry++;
 		}
 		size_count += RD_BLOCK_SIZE - (size_count % RD_BLOCK_SIZE);
 	}
-	return 0;
+}
+
+static void lock_freeze(rd_ctx *rd) {
+	percpu_down_read(&rd->freeze_sem);
+}
+
+static void unlock_freeze(rd_ctx *rd) {
+	percpu_up_read(&rd->freeze_sem);
+}
+
+static int dirs_count(rd_ctx *rd) {
+	return smp_load_acquire(&rd->superblock->inode_hwm);
+}
+
+static void dirs_header(rd_ctx *rd, rd_report *r) {
+	report(r, "====================Directory Status====================\n");
+}
+
+static void dirs_entry(rd_ctx *rd, rd_report *r, int i) {
+	rd_inode *inode = rd->inode_list + i;
 
+	if (READ_ONCE(inode->file_type) != RD_DIRECTORY)
+		return;
+	down_read(inode_sem(rd, inode));
+	/* it may have been deleted meanwhile */
+	if (inode->file_type == RD_DIRECTORY) {
+		report(r, "Directory Inode: %d\n", i);
+		dir_entries(rd, r, inode);
+		report(r, "\n");
+	}
+	up_read(inode_sem(rd, inode));
 }
 
+static const rd_report_ops dirs_report = {
+	.seq_ops = { .start = report_start, .next = report_next, .stop = report_stop, .show = report_show },
+	.lock = lock_freeze, .unlock = unlock_freeze,
+	.count = dirs_count, .header = dirs_header, .entry = dirs_entry,
+};
+const struct seq_operations *dirs_seq_ops = &dirs_report.seq_ops;
+
 /*
- * Show the status of the File Descriptor Table
+ * Show the status of a directory. List all the files and sub-directories under it.
  */
-int show_fdt_status(char *msg) {
-	int i;
+int show_dir_status(rd_ctx *rd, const char *path, char *msg) {
+	rd_report r = { NULL, msg, false };
+	char filename[RD_MAX_FILENAME];
+	rd_inode *par_inode;
+	rd_inode *inode;
+	int ret;
+
+	percpu_down_read(&rd->freeze_sem);
+	ret = parse_path(rd, path, RD_DIRECTORY, &par_inode, &inode, filename);
+	if (ret == -1) {
+		percpu_up_read(&rd->freeze_sem);
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Invalid path '%s'.\n", path);
+		return -1;
+	} else if (ret == 0) {
+		percpu_up_read(&rd->freeze_sem);
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Path '%s' doesn't exist.\n", path);
+		return -1;
+	} else if (inode->file_type != RD_DIRECTORY) {
+		percpu_up_read(&rd->freeze_sem);
+		scnprintf(msg + strlen(msg), RD_MSG_SIZE - strlen(msg), "Error: Path '%s' is not a dir path.\n", path);
+		return -1;
+	}
+	down_read(inode_sem(rd, inode));
+	report(&r, "====================Directory Status====================\n");
+	report(&r, "Directory Path: %s\n\n", path);
+	dir_entries(rd, &r, inode);
+	report_end(rd, &r, "dirs");
+	up_read(inode_sem(rd, inode));
+	percpu_up_read(&rd->freeze_sem);
+	return 0;
+}
+
+/* The open fds of the given table */
+static void fdt_entries(rd_report *r, rd_fdt *fdt) {
 	rd_file *file;
+	int i;
 
-	file = NULL;
-	sprintf(msg + strlen(msg), "=======================FDT Status=======================\n");
-	sprintf(msg + strlen(msg), "Fd\tInodeNum\tOffset\n");
+	report(r, "Fd\tInodeNum\tOffset\n");
+	spin_lock(&fdt->lock);
 	for (i = 0; i < RD_MAX_FILE; ++i) {
-		if (fd_list[i] == NULL)
+		file = fdt->files[i];
+		if (file != NULL)
+			report(r, "%d\t%d\t\t%d\n", i, file->inode->inode_num, file->offset);
+	}
+	spin_unlock(&fdt->lock);
+}
+
+static void lock_fdts(rd_ctx *rd) {
+	spin_lock(&rd->fdt_tables_lock);
+}
+
+static void unlock_fdts(rd_ctx *rd) {
+	spin_unlock(&rd->fdt_tables_lock);
+}
+
+static int fdts_count(rd_ctx *rd) {
+	rd_fdt *fdt;
+	int n = 0;
+
+	list_for_each_entry(fdt, &rd->fdt_tables, list)
+		n++;
+	return n;
+}
+
+static void fdts_header(rd_ctx *rd, rd_report *r) {
+	report(r, "=======================FDT Status=======================\n");
+}
+
+static void fdts_entry(rd_ctx *rd, rd_report *r, int i) {
+	rd_fdt *fdt;
+
+	list_for_each_entry(fdt, &rd->fdt_tables, list) {
+		if (i-- == 0) {
+			report(r, "Table %p\n", fdt);
+			fdt_entries(r, fdt);
+			report(r, "\n");
+			return;
+		}
+	}
+}
+
+static const rd_report_ops fdts_report = {
+	.seq_ops = { .start = report_start, .next = report_next, .stop = report_stop, .show = report_show },
+	.lock = lock_fdts, .unlock = unlock_fdts,
+	.count = fdts_count, .header = fdts_header, .entry = fdts_entry,
+};
+const struct seq_operations *fdts_seq_ops = &fdts_report.seq_ops;
+
+/*
+ * Show the status of the File Descriptor Table
+ */
+int show_fdt_status(rd_fdt *fdt, char *msg) {
+	rd_report r = { NULL, msg, false };
+
+	report(&r, "=======================FDT Status=======================\n");
+	fdt_entries(&r, fdt);
+	report_end(fdt->rd, &r, "fds");
+	return 0;
+}
+
+/*
+ * A summary cheap enough to poll: block and inode counts by state, the
+ * free extents by length and where the memory regions are placed, one
+ * "name value" pair per line. Bounded in size, so a single_open seq_file.
+ */
+int show_summary(struct seq_file *m, void *v) {
+	rd_ctx *rd = m->private;
+	int hist[RD_EXTENT_BUCKETS];
+	int i, n, node, extents, largest, shared, pool, files, dirs, reclaiming;
+	rd_region regions[RD_REGIONS];
+	unsigned long bytes;
+	rd_superblock sb;
+
+	memset(hist, 0, sizeof(hist));
+	shared = pool = files = dirs = reclaiming = 0;
+	spin_lock(&rd->sb_lock);
+	memcpy(&sb, rd->superblock, sizeof(sb));
+	extents = free_extents(rd, hist, &largest);
+	for (i = 0; i < sb.block_hwm; ++i) {
+		if (!bitmap_test(rd, i))
 			continue;
-		file = fd_list[i];
-		sprintf(msg + strlen(msg), "%d\t%d\t\t%d\n", i, file->inode->inode_num, file->offset);
+		if (rd->block_refs[i] > 1)
+			shared++;
+		if (rd->pool_map[i] != 0)
+			pool++;
+	}
+	for (i = 0; i < sb.inode_hwm; ++i) {
+		if (rd->inode_list[i].file_type == RD_FILE)
+			files++;
+		else if (rd->inode_list[i].file_type == RD_DIRECTORY)
+			dirs++;
+		else if (rd->inode_list[i].file_type == RD_RECLAIMING)
+			reclaiming++;
+	}
+	spin_unlock(&rd->sb_lock);
+
+	seq_printf(m, "blocks_total %u\nblocks_free %u\nblocks_shared %d\nblocks_pool %d\n",
+		sb.block_count, sb.freeblock_count, shared, pool);
+	seq_printf(m, "inodes_total %u\ninodes_free %u\ninodes_file %d\ninodes_dir %d\ninodes_reclaiming %d\n",
+		sb.inode_count, sb.freeinode_count, files, dirs, reclaiming);
+	seq_printf(m, "free_extents %d\nfree_extent_largest %d\n", extents, largest);
+	/* free_extents_<n>: extents of n to 2n - 1 blocks */
+	for (i = 0; i < RD_EXTENT_BUCKETS; ++i)
+		seq_printf(m, "free_extents_%d %d\n", 1 << i, hist[i]);
+	/* mem_<region>_node_<n>: bytes of the region on NUMA node n */
+	n = mem_regions(rd, regions);
+	for (i = 0; i < n; ++i) {
+		seq_printf(m, "mem_%s_page_size %lu\n", regions[i].name, region_page_size(rd, &regions[i]));
+		for_each_node_state(node, N_MEMORY) {
+			bytes = region_node_bytes(&regions[i], node);
+			if (bytes > 0)
+				seq_printf(m, "mem_%s_node_%d %lu\n", regions[i].name, node, bytes);
+		}
 	}
-	sprintf(msg + strlen(msg), "========================================================\n");
 	return 0;
-}
\ No newline at end of file
+}
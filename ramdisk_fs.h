@@ -1,16 +1,28 @@
 /* 
  * The ramdisk file system
  *
- * This fs is implemented as a simple unix-like file system, which partitions the disk size to 4 regions:
- * SuperBlock, Inodes, Bitmap, Freeblock.
+ * This fs is implemented as a simple unix-like file system, which partitions the disk size to 5 regions:
+ * SuperBlock, Inodes, Bitmap, Refcounts, Freeblock.
  *
  * Disk Layout:
- * +------------+--------+--------+-------------+
- * | Superblock | Inodes | Bitmap | Data Blocks |
- * +------------+--------+--------+-------------+
+ * +------------+--------+--------+-----------+-------------+
+ * | Superblock | Inodes | Bitmap | Refcounts | Data Blocks |
+ * +------------+--------+--------+-----------+-------------+
+ *
+ * Inodes holds the inode array followed by the block map array, block map n
+ * belonging to inode n. Scans and path walks only read inode fields, so
+ * they get 5 inodes per cache line instead of one, and a file's block map
+ * is only read by the ops that go to its data.
+ *
+ * Refcounts holds one unsigned short per data block: the number of inodes
+ * whose block map points at it. Snapshots and reflinks share blocks instead
+ * of copying them, a write copies a shared block before modifying it.
  *
  */
 
+#ifdef RD_USERSPACE
+#include "ramdisk_shim.h"
+#else
 #include <linux/module.h>
 #include <linux/version.h>
 #include <linux/utsname.h>
@@ -18,12 +30,35 @@
 #include <linux/sched.h>
 #include <linux/ioctl.h>
 #include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/nodemask.h>
 #include <linux/kernel.h>
 #include <linux/errno.h>
 #include <linux/proc_fs.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/rwsem.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/mutex.h>
+#include <linux/atomic.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
+#include <linux/rcupdate.h>
+#include <linux/workqueue.h>
+#include <linux/list.h>
+#include <linux/moduleparam.h>
+#include <linux/jiffies.h>
+#include <linux/lz4.h>
+#include <linux/xxhash.h>
+#include <linux/fs.h>
+#include <linux/file.h>
 #include <asm/uaccess.h>
 #include <asm/string.h>
 #include <asm/unistd.h>
+#endif
 #include "ramdisk_defs.h"
 
 /* Data structure of Superblock */
@@ -32,20 +67,33 @@ typedef struct {
     unsigned int inode_count;
     unsigned int freeblock_count;
     unsigned int freeinode_count;
-    char *first_inodes_block;
-    char *first_bitmap_block;
-    char *first_data_block;
+    unsigned int inodes_offset;     /* byte offset of each region from the start of the ramdisk */
+    unsigned int bitmap_offset;
+    unsigned int refs_offset;
+    unsigned int data_offset;
+    unsigned int inode_hwm;         /* inodes initialized so far, the ones past it are free and untouched */
+    unsigned int block_hwm;         /* same for data blocks, with their bitmap bits and refcounts */
+    unsigned int maps_offset;       /* of the block map array, in the inodes region */
 } rd_superblock;
 
-/* Data structure of Inode */
+/*
+ * Data structure of Inode
+ * The fields every scan and path walk reads (12 bytes), its block map is
+ * the rd_block_map of the same number. Neither holds pointers, so the inode
+ * region can be saved, copied or mapped anywhere as it is.
+ */
 typedef struct {
-    unsigned short inode_num;   /* inode number */
+    unsigned short inode_num;   /* inode number, also the index of its block map */
     unsigned short file_type;   /* file type (RD_FILE or RD_DIRECTORY) */
     unsigned int block_count;   /* file size (number of blocks) */
     unsigned int file_size;     /* file size (byte) */
-    char* block_addr[RD_MAX_FILE_BLK];       /* direct block index */
 } rd_inode;
 
+/* Block map of an inode (40 bytes) */
+typedef struct {
+    unsigned int blocks[RD_MAX_FILE_BLK];    /* direct block index, block number in the data region or RD_NO_BLOCK */
+} rd_block_map;
+
 /* Data structure of Dentry */
 typedef struct {
     short inode_num;                    /* inode number */
@@ -56,49 +104,128 @@ typedef struct {
 typedef struct {
     char path[RD_MAX_PATH_LEN];
     rd_inode *inode;
-    rd_dentry *dentry;
     int offset;
     int mode;
+    struct mutex pos_lock;      /* serializes offset updates through this fd */
+    atomic_t refcount;          /* one for the fd table, one per in-flight op */
+    bool closed;                /* file deleted under us, set with the inode lock held */
 } rd_file;
 
+/*
+ * Header of a ramdisk image. It is followed by everything before the data
+ * region (superblock, inodes, bitmap, refcounts) and then by the allocated
+ * data blocks only, in block number order.
+ */
+typedef struct {
+    char magic[8];              /* RD_IMAGE_MAGIC */
+    unsigned int version;       /* RD_IMAGE_VERSION */
+    unsigned int disk_size;     /* RD_DISK_SIZE of the ramdisk that saved it */
+    unsigned int meta_size;     /* bytes of metadata that follow */
+    unsigned int used_blocks;   /* data blocks that follow the metadata */
+} rd_image_header;
+
+/* A ramdisk instance, see ramdisk_fs.c */
+typedef struct rd_ctx rd_ctx;
+
+/* A bulk stat record, see ramdisk_param.h */
+struct rd_stat;
+
+/* Async I/O of an open of the device, see ramdisk_module.c */
+struct rd_aio;
+
+/* Data structure of File Descriptor Table, one per open of the device */
+typedef struct {
+    rd_ctx *rd;                 /* the instance the device belongs to */
+    spinlock_t lock;
+    rd_file *files[RD_MAX_FILE];
+    struct list_head list;      /* on the list of all tables, scanned by delete */
+    struct rd_aio *aio;         /* its async requests, set up by the module */
+} rd_fdt;
+
+#define RD_MAX_INSTANCES    16          /* ramdisks one module can serve */
+#define RD_NAME_LEN         16          /* of an instance's /proc entries, "ramdisk<N>" */
+
+/* Statistics, see show_stats */
+#define RD_STAT_CMDS        28          /* ioctl commands with counters */
+#define RD_STAT_BUCKETS     32          /* log2 latency buckets, 1 ns to 2 s and above */
+
 /* Init Functions */                                                                                                                
-int ramfs_init(void);
-int superblock_init(void);
-int inodes_init(void);
-int bitmap_init(void);
-int data_init(void);
-int fdt_init(void);
+rd_ctx* ramfs_init(int id, const char *name);
+int superblock_init(rd_ctx *rd);
+int inodes_init(rd_ctx *rd);
+int bitmap_init(rd_ctx *rd);
+int data_init(rd_ctx *rd);
+int locks_init(rd_ctx *rd);
 /* Exit Functions */
-int ramfs_exit(void);
+int ramfs_exit(rd_ctx *rd);
 
 /* Block Operation Functions */
-rd_inode* allocate_inode(void);
-int allocate_fd(void);
-char* allocate_block(void);
-void free_inode(rd_inode *inode);
-void free_fd(int fd);
-void free_block(char *block);
-void free_dentry(rd_dentry *dentry);
+rd_inode* allocate_inode(rd_ctx *rd, unsigned short file_type);
+rd_fdt* allocate_fdt(rd_ctx *rd);
+int allocate_fd(rd_fdt *fdt, rd_file *file);
+char* allocate_block(rd_ctx *rd);
+int allocate_blocks(rd_ctx *rd, char **blocks, int n);
+void free_inode(rd_ctx *rd, rd_inode *inode);
+void free_inodes(rd_ctx *rd, rd_inode **inodes, int n);
+void free_fdt(rd_fdt *fdt);
+void free_fd(rd_fdt *fdt, int fd);
+void free_block(rd_ctx *rd, char *block);
+int free_blocks(rd_ctx *rd, char **blocks, int n);
+void get_block(rd_ctx *rd, char *block);
+void free_dentry(rd_ctx *rd, rd_dentry *dentry);
+
+/* File Reference Functions */
+rd_file* get_file(rd_fdt *fdt, int fd);
+void put_file(rd_file *file);
+int fd_inode_num(rd_fdt *fdt, int fd, int *offset);
 
 /* Path Functions */
-int parse_path(const char *path, int type, rd_inode **parent_inode, rd_inode **file_inode, char *filename);
+int parse_path(rd_ctx *rd, const char *path, int type, rd_inode **parent_inode, rd_inode **file_inode, char *filename);
+int path_inode_num(rd_ctx *rd, const char *path);
 
 /* Dentry Functions */
-int add_dentry(rd_inode *parent_inode, int inode_num, char *filename);
-rd_dentry* get_dentry(const char *path);
+int add_dentry(rd_ctx *rd, rd_inode *parent_inode, int inode_num, char *filename);
+rd_dentry* find_dentry(rd_ctx *rd, rd_inode *dir_inode, const char *filename, int *inode_num);
+rd_dentry* get_dentry(rd_ctx *rd, const char *path);
 
 /* Ioctl Functions */
-int ramfs_create(const char *path, char *msg);
-int ramfs_mkdir(const char *path, char *msg);
-int ramfs_open(const char *path, int mode, char *msg);
-int ramfs_close(int fd, char *msg);
-int ramfs_read(int fd, char *buf, size_t count, char *msg);
-int ramfs_write(int fd, char *buf, size_t count, char *msg);
-int ramfs_lseek(int fd, int offset, char *msg);
-int ramfs_delete(const char *path, char *msg);
+int ramfs_create(rd_ctx *rd, const char *path, char *msg);
+int ramfs_mkdir(rd_ctx *rd, const char *path, char *msg);
+int ramfs_open(rd_fdt *fdt, const char *path, int mode, char *msg);
+int ramfs_close(rd_fdt *fdt, int fd, char *msg);
+int ramfs_read(rd_fdt *fdt, int fd, char *buf, size_t count, char *msg);
+int ramfs_write(rd_fdt *fdt, int fd, char *buf, size_t count, char *msg);
+int ramfs_lseek(rd_fdt *fdt, int fd, int offset, char *msg);
+int ramfs_fallocate(rd_fdt *fdt, int fd, int len, char *msg);
+int ramfs_truncate(rd_fdt *fdt, int fd, int size, char *msg);
+int ramfs_delete(rd_ctx *rd, const char *path, char *msg);
+int ramfs_rmdir(rd_ctx *rd, const char *path, char *msg);
+int ramfs_rmtree(rd_ctx *rd, const char *path, char *msg);
+int ramfs_rename(rd_ctx *rd, const char *src_path, const char *dst_path, char *msg);
+int ramfs_stat_dir(rd_ctx *rd, const char *path, struct rd_stat *stats, int max, char *msg);
+int ramfs_stat_paths(rd_ctx *rd, char *paths, struct rd_stat *stats, int max, char *msg);
+int ramfs_snapshot(rd_ctx *rd, const char *src_path, const char *dst_path, char *msg);
+int ramfs_reflink(rd_ctx *rd, const char *src_path, const char *dst_path, char *msg);
+int ramfs_compress(rd_ctx *rd, char *msg);
+int ramfs_dedup(rd_ctx *rd, char *msg);
+int ramfs_save(rd_ctx *rd, int fd, char *msg);
+int ramfs_restore(rd_ctx *rd, int fd, char *msg);
+int ramfs_sync(rd_ctx *rd, char *msg);
+
+/* Statistics Functions */
+void stats_op(rd_ctx *rd, unsigned int cmd, int ret, int bytes, u64 ns);
+void reset_stats(rd_ctx *rd);
+int show_stats(struct seq_file *m, void *v);
 
 /* Test Functions*/
-int show_blocks_status(char *msg);
-int show_inodes_status(char *msg);
-int show_dir_status(const char *path, char *msg);
-int show_fdt_status(char *msg);
\ No newline at end of file
+int show_blocks_status(rd_ctx *rd, char *msg);
+int show_inodes_status(rd_ctx *rd, char *msg);
+int show_dir_status(rd_ctx *rd, const char *path, char *msg);
+int show_fdt_status(rd_fdt *fdt, char *msg);
+
+/* Status reports streamed through /proc, see rd_report */
+extern const struct seq_operations *blocks_seq_ops;
+extern const struct seq_operations *inodes_seq_ops;
+extern const struct seq_operations *dirs_seq_ops;
+extern const struct seq_operations *fdts_seq_ops;
+int show_summary(struct seq_file *m, void *v);
\ No newline at end of file
@@ -5,16 +5,47 @@
 #include <linux/fs.h>
 #include <linux/slab.h>
 #include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/vmalloc.h>
+#include <linux/ktime.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/eventfd.h>
+#include <linux/workqueue.h>
+#include <linux/capability.h>
 #include "ramdisk_param.h"
 #include "ramdisk_fs.h"
 #include "ramdisk_defs.h"
+#include "ramdisk_trace.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("LX & JTY");
 MODULE_DESCRIPTION("A ramdisk device.");
 
-char msg[4096] = {0};
-rd_param param;
+/*
+ * Every instance is a ramdisk of its own, with its own disk, locks and
+ * statistics, under /proc/ramdisk for the first and /proc/ramdisk<N> for
+ * the others
+ */
+static int instances = 1;
+module_param(instances, int, 0444);
+MODULE_PARM_DESC(instances, "Number of independent ramdisks (1 to 16)");
+
+/* A status report of an instance, the data of its /proc entry */
+typedef struct {
+	rd_ctx *rd;
+	const struct seq_operations *seq_ops;
+	char name[RD_NAME_LEN + 8];
+} rd_report_entry;
+
+#define RD_REPORTS 4
+
+static rd_ctx *rds[RD_MAX_INSTANCES];
+static char names[RD_MAX_INSTANCES][RD_NAME_LEN];
+static rd_report_entry reports[RD_MAX_INSTANCES][RD_REPORTS];
+static char stats_names[RD_MAX_INSTANCES][RD_NAME_LEN + 8];
+static char summary_names[RD_MAX_INSTANCES][RD_NAME_LEN + 8];
+
 /* On Ramdisk Module Init */
 static int __init ramdisk_init(void);
 
@@ -30,89 +61,597 @@ int ramdisk_release(struct inode *inode, struct file *file);
 /* On Ramdisk Device Ioctl */
 long ramdisk_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
 
+/* On Ramdisk Device Poll, readable while async completions wait to be reaped */
+unsigned int ramdisk_poll(struct file *file, poll_table *wait);
+
+/* On Ramdisk Stats Open */
+int ramdisk_stats_open(struct inode *inode, struct file *file);
+
+/* On Ramdisk Stats Write */
+ssize_t ramdisk_stats_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos);
+
+/* On Ramdisk Report Open, the entry's data is an rd_report_entry */
+int ramdisk_report_open(struct inode *inode, struct file *file);
+
+/* On Ramdisk Summary Open */
+int ramdisk_summary_open(struct inode *inode, struct file *file);
+
 /* File Operations */
 struct file_operations ramdisk_fops = {
 	unlocked_ioctl: ramdisk_ioctl,
+	poll          : ramdisk_poll,
 	open          : ramdisk_open,
 	release       : ramdisk_release
 };
 
+/* File Operations of /proc/ramdisk_stats */
+struct file_operations ramdisk_stats_fops = {
+	open          : ramdisk_stats_open,
+	read          : seq_read,
+	write         : ramdisk_stats_write,
+	llseek        : seq_lseek,
+	release       : single_release
+};
+
+/* File Operations of the /proc status reports */
+struct file_operations ramdisk_report_fops = {
+	open          : ramdisk_report_open,
+	read          : seq_read,
+	llseek        : seq_lseek,
+	release       : seq_release
+};
+
+/* File Operations of /proc/ramdisk_summary */
+struct file_operations ramdisk_summary_fops = {
+	open          : ramdisk_summary_open,
+	read          : seq_read,
+	llseek        : seq_lseek,
+	release       : single_release
+};
+
+
+/*
+ * Asynchronous I/O
+ *
+ * RD_SUBMIT queues a read or write on an fd of this open and returns its
+ * id right away. A thread of aio_wq runs it with ramfs_read/ramfs_write
+ * and puts it on the open's done list, then signals the eventfd set with
+ * RD_EVENTFD, if any, and wakes up pollers of the device fd. RD_REAP takes
+ * a batch of finished requests off the list in one call. The workers run
+ * outside the caller's mm, so a read goes to a kernel buffer that reap
+ * copies out. Requests on the same fd run in no particular order.
+ */
+#define RD_AIO_MAX 256		/* requests of one open that are in flight or not reaped */
+
+typedef struct rd_aio {
+	spinlock_t lock;
+	struct list_head done;		/* finished requests, oldest first */
+	int pending;			/* submitted and not reaped */
+	int ndone;			/* on the done list */
+	int next_id;
+	wait_queue_head_t wait;		/* poll, reap and release wait here */
+	struct eventfd_ctx *eventfd;	/* signalled once per finished request */
+} rd_aio;
+
+typedef struct {
+	struct work_struct work;
+	struct list_head list;
+	rd_fdt *fdt;
+	unsigned int cmd;		/* RD_READ or RD_WRITE */
+	int id;
+	int fd;
+	int len;
+	int ret;
+	char *buf;			/* the data to write, or the data read */
+	char __user *user_buf;		/* where reap copies the data read */
+} rd_aio_req;
+
+static struct workqueue_struct *aio_wq;
+
+static void aio_work_fn(struct work_struct *work) {
+	rd_aio_req *req = container_of(work, rd_aio_req, work);
+	rd_aio *aio = req->fdt->aio;
+	char *msg;
+	u64 start;
+
+	start = ktime_get_ns();
+	msg = (char*)kzalloc(RD_MSG_SIZE, GFP_KERNEL);
+	if (msg == NULL)
+		req->ret = -1;
+	else if (req->cmd == RD_READ)
+		req->ret = ramfs_read(req->fdt, req->fd, req->buf, req->len, msg);
+	else
+		req->ret = ramfs_write(req->fdt, req->fd, req->buf, req->len, msg);
+	kfree(msg);
+	stats_op(req->fdt->rd, req->cmd, req->ret, req->ret, ktime_get_ns() - start);
+
+	/* release frees aio once it takes the lock after the last completion */
+	spin_lock(&aio->lock);
+	list_add_tail(&req->list, &aio->done);
+	aio->ndone++;
+	if (aio->eventfd != NULL)
+		eventfd_signal(aio->eventfd, 1);
+	wake_up(&aio->wait);
+	spin_unlock(&aio->lock);
+}
+
+static void aio_free_req(rd_aio_req *req) {
+	kfree(req->buf);
+	kfree(req);
+}
+
+static rd_aio* aio_alloc(void) {
+	rd_aio *aio;
+
+	aio = (rd_aio*)kzalloc(sizeof(rd_aio), GFP_KERNEL);
+	if (aio == NULL)
+		return NULL;
+	spin_lock_init(&aio->lock);
+	INIT_LIST_HEAD(&aio->done);
+	init_waitqueue_head(&aio->wait);
+	return aio;
+}
+
+/* Wait for the requests still running, then drop whatever was not reaped */
+static void aio_free(rd_aio *aio) {
+	rd_aio_req *req;
+	rd_aio_req *tmp;
+
+	wait_event(aio->wait, READ_ONCE(aio->ndone) == READ_ONCE(aio->pending));
+	spin_lock(&aio->lock);
+	spin_unlock(&aio->lock);
+	list_for_each_entry_safe(req, tmp, &aio->done, list)
+		aio_free_req(req);
+	if (aio->eventfd != NULL)
+		eventfd_ctx_put(aio->eventfd);
+	kfree(aio);
+}
+
+/* Queue a read or write of param->len bytes on param->fd, return its id */
+static int aio_submit(rd_fdt *fdt, rd_param *param, char *msg) {
+	rd_aio *aio = fdt->aio;
+	rd_aio_req *req;
+	int id;
+
+	if (param->mode != RD_READ && param->mode != RD_WRITE) {
+		sprintf(msg + strlen(msg), "Error: Only reads and writes can be submitted.\n");
+		return -1;
+	}
+	if (param->len <= 0 || param->len > RD_MAX_FILE_SIZE) {
+		sprintf(msg + strlen(msg), "Error: Invalid length '%d'.\n", param->len);
+		return -1;
+	}
+	req = (rd_aio_req*)kzalloc(sizeof(rd_aio_req), GFP_KERNEL);
+	if (req != NULL)
+		req->buf = (char*)kzalloc(param->len, GFP_KERNEL);
+	if (req == NULL || req->buf == NULL) {
+		kfree(req);
+		sprintf(msg + strlen(msg), "Error: Out of memory.\n");
+		return -1;
+	}
+	req->fdt = fdt;
+	req->cmd = param->mode;
+	req->fd = param->fd;
+	req->len = param->len;
+	req->user_buf = param->data_addr;
+	if (req->cmd == RD_WRITE)
+		memcpy(req->buf, param->data, param->len);
+
+	spin_lock(&aio->lock);
+	if (aio->pending == RD_AIO_MAX) {
+		spin_unlock(&aio->lock);
+		aio_free_req(req);
+		sprintf(msg + strlen(msg), "Error: Too many requests in flight.\n");
+		return -1;
+	}
+	aio->pending++;
+	id = aio->next_id;
+	aio->next_id = (aio->next_id + 1) & INT_MAX;
+	spin_unlock(&aio->lock);
+	req->id = id;
+	INIT_WORK(&req->work, aio_work_fn);
+	queue_work(aio_wq, &req->work);
+	sprintf(msg + strlen(msg), "Successfully submit request '%d'.\n", id);
+	return id;
+}
+
+/*
+ * Take up to param->len bytes of rd_completion records off the done list,
+ * oldest first, after waiting for param->offset of them (or for nothing to
+ * be in flight any more). Returns the number of records.
+ */
+static int aio_reap(rd_fdt *fdt, rd_param *param, char *msg) {
+	rd_aio *aio = fdt->aio;
+	rd_aio_req *req;
+	rd_aio_req *tmp;
+	rd_completion *comps;
+	LIST_HEAD(batch);
+	int n, limit, min_nr;
+
+	limit = param->len > 0 ? min_t(int, param->len / sizeof(rd_completion), RD_AIO_MAX) : 0;
+	min_nr = param->offset < limit ? param->offset : limit;
+	if (min_nr > 0 && wait_event_interruptible(aio->wait, READ_ONCE(aio->ndone) >= min_nr ||
+	    READ_ONCE(aio->ndone) == READ_ONCE(aio->pending))) {
+		sprintf(msg + strlen(msg), "Error: Interrupted.\n");
+		return -1;
+	}
+	comps = (rd_completion*)kmalloc(sizeof(rd_completion) * (limit + 1), GFP_KERNEL);
+	if (comps == NULL) {
+		sprintf(msg + strlen(msg), "Error: Out of memory.\n");
+		return -1;
+	}
+
+	spin_lock(&aio->lock);
+	for (n = 0; n < limit && !list_empty(&aio->done); ++n)
+		list_move_tail(aio->done.next, &batch);
+	aio->ndone -= n;
+	aio->pending -= n;
+	spin_unlock(&aio->lock);
+
+	n = 0;
+	list_for_each_entry_safe(req, tmp, &batch, list) {
+		comps[n].id = req->id;
+		comps[n].ret = req->ret;
+		if (req->cmd == RD_READ && req->ret > 0)
+			copy_to_user(req->user_buf, req->buf, req->ret);
+		aio_free_req(req);
+		n++;
+	}
+	copy_to_user(param->data_addr, comps, sizeof(rd_completion) * n);
+	kfree(comps);
+	sprintf(msg + strlen(msg), "Successfully reap '%d' requests.\n", n);
+	return n;
+}
+
+/* Signal the eventfd param->fd on every completion, none if it is -1 */
+static int aio_set_eventfd(rd_fdt *fdt, int efd, char *msg) {
+	rd_aio *aio = fdt->aio;
+	struct eventfd_ctx *ctx;
+	struct eventfd_ctx *old;
+
+	ctx = NULL;
+	if (efd >= 0) {
+		ctx = eventfd_ctx_fdget(efd);
+		if (IS_ERR(ctx)) {
+			sprintf(msg + strlen(msg), "Error: '%d' is not an eventfd.\n", efd);
+			return -1;
+		}
+	}
+	spin_lock(&aio->lock);
+	old = aio->eventfd;
+	aio->eventfd = ctx;
+	spin_unlock(&aio->lock);
+	if (old != NULL)
+		eventfd_ctx_put(old);
+	if (ctx != NULL)
+		sprintf(msg + strlen(msg), "Successfully set eventfd.\n");
+	else
+		sprintf(msg + strlen(msg), "Successfully unset eventfd.\n");
+	return 0;
+}
+
+unsigned int ramdisk_poll(struct file *file, poll_table *wait) {
+	rd_aio *aio = ((rd_fdt*)file->private_data)->aio;
+
+	poll_wait(file, &aio->wait, wait);
+	return READ_ONCE(aio->ndone) > 0 ? POLLIN | POLLRDNORM : 0;
+}
+
+/* Create the /proc entries of an instance, its device last */
+static void ramdisk_proc_create(int id) {
+	const struct seq_operations *seq_ops[RD_REPORTS] = { blocks_seq_ops, inodes_seq_ops, dirs_seq_ops, fdts_seq_ops };
+	const char *suffixes[RD_REPORTS] = { "blocks", "inodes", "dirs", "fds" };
+	rd_ctx *rd = rds[id];
+	int i;
+
+	sprintf(stats_names[id], "%s_stats", names[id]);
+	proc_create_data(stats_names[id], 0644, NULL, &ramdisk_stats_fops, rd);
+	for (i = 0; i < RD_REPORTS; ++i) {
+		reports[id][i].rd = rd;
+		reports[id][i].seq_ops = seq_ops[i];
+		sprintf(reports[id][i].name, "%s_%s", names[id], suffixes[i]);
+		proc_create_data(reports[id][i].name, 0444, NULL, &ramdisk_report_fops, &reports[id][i]);
+	}
+	sprintf(summary_names[id], "%s_summary", names[id]);
+	proc_create_data(summary_names[id], 0444, NULL, &ramdisk_summary_fops, rd);
+	proc_create_data(names[id], 0444, NULL, &ramdisk_fops, rd);
+}
+
+/* Remove the /proc entries of an instance, its device first */
+static void ramdisk_proc_remove(int id) {
+	int i;
+
+	remove_proc_entry(names[id], NULL);
+	remove_proc_entry(summary_names[id], NULL);
+	for (i = RD_REPORTS - 1; i >= 0; --i)
+		remove_proc_entry(reports[id][i].name, NULL);
+	remove_proc_entry(stats_names[id], NULL);
+}
 
 static int __init ramdisk_init(void) {
-	proc_create("ramdisk", 0444, NULL, &ramdisk_fops);
-	ramfs_init();
-	printk("Ramdisk Inited.\n");
+	int i;
+
+	if (instances < 1 || instances > RD_MAX_INSTANCES) {
+		printk("Error: instances must be between 1 and %d.\n", RD_MAX_INSTANCES);
+		return -EINVAL;
+	}
+	aio_wq = alloc_workqueue("ramdisk_aio", WQ_UNBOUND, 0);
+	if (aio_wq == NULL)
+		return -ENOMEM;
+	for (i = 0; i < instances; ++i) {
+		if (i == 0)
+			sprintf(names[i], "ramdisk");
+		else
+			sprintf(names[i], "ramdisk%d", i);
+		rds[i] = ramfs_init(i, names[i]);
+		if (rds[i] == NULL) {
+			while (--i >= 0) {
+				ramdisk_proc_remove(i);
+				ramfs_exit(rds[i]);
+			}
+			destroy_workqueue(aio_wq);
+			return -ENOMEM;
+		}
+		ramdisk_proc_create(i);
+	}
+	printk("Ramdisk Inited, %d instance(s).\n", instances);
 	return 0;
 }
 
 static void __exit ramdisk_exit(void) {
-	remove_proc_entry("ramdisk", NULL);
+	int i;
+
+	for (i = instances - 1; i >= 0; --i) {
+		ramdisk_proc_remove(i);
+		ramfs_exit(rds[i]);
+	}
+	destroy_workqueue(aio_wq);
 	printk("Ramdisk Exited.\n");
 	return;
 }
 
 int ramdisk_open(struct inode *inode, struct file *file) {
-	printk("Ramdisk Opened.\n");
+	rd_fdt *fdt;
+
+	/* every open gets its own fd table, on the instance of the entry */
+	fdt = allocate_fdt((rd_ctx*)PDE_DATA(inode));
+	if (fdt == NULL)
+		return -ENOMEM;
+	fdt->aio = aio_alloc();
+	if (fdt->aio == NULL) {
+		free_fdt(fdt);
+		return -ENOMEM;
+	}
+	file->private_data = fdt;
 	return 0;
 }
 
 int ramdisk_release(struct inode *inode, struct file *file) {
-	printk("Ramdisk Released.\n");
+	rd_fdt *fdt = (rd_fdt*)file->private_data;
+
+	/* waits for the async requests still running, closes whatever fds the client leaked */
+	aio_free(fdt->aio);
+	free_fdt(fdt);
 	return 0;
 }
 
-long ramdisk_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+int ramdisk_report_open(struct inode *inode, struct file *file) {
+	rd_report_entry *entry = (rd_report_entry*)PDE_DATA(inode);
+	int ret;
+
+	ret = seq_open(file, entry->seq_ops);
+	if (ret == 0)
+		((struct seq_file*)file->private_data)->private = entry->rd;
+	return ret;
+}
+
+int ramdisk_summary_open(struct inode *inode, struct file *file) {
+	return single_open(file, show_summary, PDE_DATA(inode));
+}
+
+/* Reading prints the statistics, see show_stats */
+int ramdisk_stats_open(struct inode *inode, struct file *file) {
+	return single_open(file, show_stats, PDE_DATA(inode));
+}
+
+/* Writing anything resets the statistics */
+ssize_t ramdisk_stats_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos) {
+	reset_stats((rd_ctx*)PDE_DATA(file_inode(file)));
+	return count;
+}
+
+/*
+ * Inode and offset the given op works on, for the tracepoints: the fd's
+ * for fd ops, the path's for path ops, -1 for the others
+ */
+static int op_target(rd_fdt *fdt, unsigned int cmd, rd_param *param, int fd, int *offset) {
+	*offset = -1;
+	switch(cmd) {
+		case RD_OPEN:
+			if (fd >= 0)
+				return fd_inode_num(fdt, fd, offset);
+			return path_inode_num(fdt->rd, param->path);
+		case RD_CLOSE:
+		case RD_READ:
+		case RD_WRITE:
+		case RD_LSEEK:
+		case RD_FALLOCATE:
+		case RD_TRUNCATE:
+		case RD_SUBMIT:
+			return fd_inode_num(fdt, fd, offset);
+		case RD_CREATE:
+		case RD_MKDIR:
+		case RD_DELETE:
+		case RD_RMDIR:
+		case RD_RMTREE:
+		case RD_RENAME:
+		case RD_STAT:
+		case RD_SNAPSHOT:
+		case RD_REFLINK:
+		case RD_SHOWDIR:
+			return path_inode_num(fdt->rd, param->path);
+		default:
+			return -1;
+	}
+}
 
+long ramdisk_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
 
+	/* argument and result buffers are per call, so concurrent callers never share them */
+	rd_fdt *fdt = (rd_fdt*)file->private_data;
+	rd_ctx *rd = fdt->rd;
+	rd_param *param;
+	char *msg;
 	int fd, ret;
 	char *buf;
+	rd_stat *stats;
+	int n;
+	u64 start;
+	int ino, exit_ino, offset;
+	param = (rd_param*)kzalloc(sizeof(rd_param), GFP_KERNEL);
+	msg = (char*)kzalloc(RD_MSG_SIZE, GFP_KERNEL);
+	if (!param || !msg) {
+		kfree(param);
+		kfree(msg);
+		return -ENOMEM;
+	}
 	if (arg != 0)
-		copy_from_user(&param, (rd_param*)arg, sizeof(rd_param));
+		copy_from_user(param, (rd_param*)arg, sizeof(rd_param));
+	param->path[RD_MAX_PATH_LEN - 1] = 0;
+	param->new_path[RD_MAX_PATH_LEN - 1] = 0;
 	fd = -1;
 	ret = 0;
-	memset(msg, 0, 4096);
+	start = ktime_get_ns();
+	/* the lookups only happen while someone is tracing */
+	ino = -1;
+	if (trace_ramdisk_op_enter_enabled()) {
+		ino = op_target(fdt, cmd, param, cmd == RD_OPEN ? -1 : param->fd, &offset);
+		trace_ramdisk_op_enter(cmd, param->fd, ino, offset, param->len, param->path);
+	}
 	switch(cmd) {
 		case RD_CREATE:
-			ret = ramfs_create(param.path, msg);
+			ret = ramfs_create(rd, param->path, msg);
 			break;
 		case RD_MKDIR:
-			ret = ramfs_mkdir(param.path, msg);
+			ret = ramfs_mkdir(rd, param->path, msg);
 			break;
 		case RD_OPEN:
-			ret = ramfs_open(param.path, param.mode, msg);
-			// copy_to_user(param.fd_addr, &fd, sizeof(int));
+			ret = ramfs_open(fdt, param->path, param->mode, msg);
+			// copy_to_user(param->fd_addr, &fd, sizeof(int));
 			break;
 		case RD_CLOSE:
-			ret = ramfs_close(param.fd, msg);
+			ret = ramfs_close(fdt, param->fd, msg);
 			break;
 		case RD_READ:
-			buf = (char*)vmalloc(param.len);
-			memset(buf, 0, param.len);
-			ret = ramfs_read(param.fd, buf, param.len, msg);
+			if (param->len < 0 || param->len > RD_MAX_FILE_SIZE) {
+				sprintf(msg + strlen(msg), "Error: Invalid length '%d'.\n", param->len);
+				ret = -1;
+				break;
+			}
+			buf = (char*)vzalloc(param->len + 1);
+			if (buf == NULL) {
+				sprintf(msg + strlen(msg), "Error: Out of memory.\n");
+				ret = -1;
+				break;
+			}
+			ret = ramfs_read(fdt, param->fd, buf, param->len, msg);
 			if (ret != -1)
-				copy_to_user(param.data_addr, buf, param.len);
+				copy_to_user(param->data_addr, buf, param->len);
 			vfree(buf);
 			break;
 		case RD_WRITE:
-			ret = ramfs_write(param.fd, param.data, param.len, msg);
+			if (param->len < 0 || param->len > RD_MAX_FILE_SIZE) {
+				sprintf(msg + strlen(msg), "Error: Invalid length '%d'.\n", param->len);
+				ret = -1;
+				break;
+			}
+			ret = ramfs_write(fdt, param->fd, param->data, param->len, msg);
 			break;
 		case RD_LSEEK:
-			ret = ramfs_lseek(param.fd, param.offset, msg);
+			ret = ramfs_lseek(fdt, param->fd, param->offset, msg);
+			break;
+		case RD_FALLOCATE:
+			ret = ramfs_fallocate(fdt, param->fd, param->len, msg);
+			break;
+		case RD_TRUNCATE:
+			ret = ramfs_truncate(fdt, param->fd, param->len, msg);
 			break;
 		case RD_DELETE:
-			ret = ramfs_delete(param.path, msg);
+			ret = ramfs_delete(rd, param->path, msg);
+			break;
+		case RD_RMDIR:
+			ret = ramfs_rmdir(rd, param->path, msg);
+			break;
+		case RD_RMTREE:
+			ret = ramfs_rmtree(rd, param->path, msg);
+			break;
+		case RD_RENAME:
+			ret = ramfs_rename(rd, param->path, param->new_path, msg);
+			break;
+		case RD_STAT:
+			/* entries that don't fit in len are counted, not copied */
+			n = param->len > 0 ? min_t(int, param->len / sizeof(rd_stat), RD_INODE_NUM) : 0;
+			stats = (rd_stat*)vmalloc(n * sizeof(rd_stat) + 1);
+			if (stats == NULL) {
+				ret = -1;
+				break;
+			}
+			param->data[RD_MAX_FILE_SIZE - 1] = 0;
+			if (param->path[0] != 0)
+				ret = ramfs_stat_dir(rd, param->path, stats, n, msg);
+			else
+				ret = ramfs_stat_paths(rd, param->data, stats, n, msg);
+			if (ret > 0)
+				copy_to_user(param->data_addr, stats, min(ret, n) * sizeof(rd_stat));
+			vfree(stats);
+			break;
+		case RD_SNAPSHOT:
+			ret = ramfs_snapshot(rd, param->path, param->new_path, msg);
+			break;
+		case RD_REFLINK:
+			ret = ramfs_reflink(rd, param->path, param->new_path, msg);
+			break;
+		case RD_COMPRESS:
+			ret = ramfs_compress(rd, msg);
+			break;
+		case RD_DEDUP:
+			ret = ramfs_dedup(rd, msg);
+			break;
+		case RD_SAVE:
+		case RD_RESTORE:
+			/* the device is world-accessible, but these read or replace everyone's files */
+			if (!capable(CAP_SYS_ADMIN)) {
+				sprintf(msg + strlen(msg), "Error: Saving and restoring images needs CAP_SYS_ADMIN.\n");
+				ret = -1;
+			} else if (cmd == RD_SAVE) {
+				ret = ramfs_save(rd, param->fd, msg);
+			} else {
+				ret = ramfs_restore(rd, param->fd, msg);
+			}
+			break;
+		case RD_SYNC:
+			ret = ramfs_sync(rd, msg);
 			break;
 		case RD_SHOWDIR:
-			show_dir_status(param.path, msg);
+			show_dir_status(rd, param->path, msg);
 			break;
 		case RD_SHOWBLOCKS:
-			show_blocks_status(msg);
+			show_blocks_status(rd, msg);
 			break;
 		case RD_SHOWINODES:
-			show_inodes_status(msg);
+			show_inodes_status(rd, msg);
 			break;
 		case RD_SHOWFDT:
-			show_fdt_status(msg);
+			show_fdt_status(fdt, msg);
+			break;
+		case RD_SUBMIT:
+			ret = aio_submit(fdt, param, msg);
+			break;
+		case RD_REAP:
+			ret = aio_reap(fdt, param, msg);
+			break;
+		case RD_EVENTFD:
+			ret = aio_set_eventfd(fdt, param->fd, msg);
 			break;
 		case RD_HELP:
 			break;
@@ -122,7 +661,16 @@ long ramdisk_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
 			ret = -1;
 			break;
 	}
-	copy_to_user(param.msg_addr, msg, strlen(msg) + 1);
+	stats_op(rd, cmd, ret, (cmd == RD_READ || cmd == RD_WRITE) ? ret : 0, ktime_get_ns() - start);
+	if (trace_ramdisk_op_exit_enabled()) {
+		/* open reports its new fd; after close or delete there is nothing left to look up */
+		fd = cmd == RD_OPEN ? ret : param->fd;
+		exit_ino = op_target(fdt, cmd, param, fd, &offset);
+		trace_ramdisk_op_exit(cmd, fd, exit_ino != -1 ? exit_ino : ino, offset, param->len, ret);
+	}
+	copy_to_user(param->msg_addr, msg, strlen(msg) + 1);
+	kfree(msg);
+	kfree(param);
 	return ret;
 }
 
@@ -3,12 +3,31 @@
 typedef struct {
 
 	int fd;							/* the request fd */	
-	int mode;						/* the request mode to open file */
+	int mode;						/* the request mode to open file, RD_READ or RD_WRITE to submit */
 	char path[RD_MAX_PATH_LEN];		/* the request path */
+	char new_path[RD_MAX_PATH_LEN];	/* the destination path for snapshot/reflink/rename */
 	char data[RD_MAX_FILE_SIZE];	/* the data to write */
 	int len;						/* the length to write */
-	int offset;						/* the offset for lseek */	
+	int offset;						/* the offset for lseek, the completions to wait for to reap */	
 	char *msg_addr;					/* user addr for msg */
-	char *data_addr;				/* user addr for read cmd */
+	char *data_addr;				/* user addr for read cmd, and for the records of stat and reap */
 
-} rd_param;
\ No newline at end of file
+} rd_param;
+
+/*
+ * One entry of a bulk stat (RD_STAT). The records are packed back to back
+ * in data_addr, up to len bytes of them.
+ */
+typedef struct rd_stat {
+	char filename[RD_MAX_FILENAME];	/* the entry's name, the last path component for a list */
+	int inode_num;					/* -1 if the path doesn't exist */
+	int file_type;					/* RD_FILE or RD_DIRECTORY */
+	int file_size;					/* in bytes */
+	int block_count;
+} rd_stat;
+
+/* A finished async request (RD_REAP), packed like rd_stat */
+typedef struct rd_completion {
+	int id;							/* as returned by RD_SUBMIT */
+	int ret;						/* bytes read or written, -1 on error */
+} rd_completion;
\ No newline at end of file
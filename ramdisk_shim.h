@@ -0,0 +1,400 @@
+/*
+ * Userspace shim for the ramdisk file system
+ *
+ * Compiling ramdisk_fs.c with -DRD_USERSPACE swaps the kernel headers for
+ * this file, so the fs core runs as a plain process under perf, sanitizers
+ * or a benchmark loop (see `make bench`). Only what ramdisk_fs.c uses is
+ * provided, on top of libc and pthreads:
+ *
+ * - Locks map to pthread spinlocks, mutexes and rwlocks.
+ * - RCU readers cost nothing and a grace period is over right away, so
+ *   reclaims run when they are queued. That is only safe while no other
+ *   thread can be in a lockless lookup, e.g. in single-threaded benchmarks.
+ * - Delayed works never run: background compress, dedup and write-back
+ *   passes only happen through their ioctl functions.
+ * - Files are host file descriptors, fget() takes one of this process.
+ * - There is one memory node and no huge pages: the placement params fall
+ *   back to a plain allocation.
+ * - LZ4 comes from liblz4. xxh64 is replaced by FNV-1a, dedup confirms
+ *   every match with memcmp so any 64-bit hash will do.
+ */
+#ifndef RAMDISK_SHIM_H
+#define RAMDISK_SHIM_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64;
+typedef unsigned int gfp_t;
+
+/* Kernel basics */
+#define GFP_KERNEL		0
+#define printk(...)		fprintf(stderr, __VA_ARGS__)
+#define __init
+#define __exit
+#define container_of(ptr, type, member)	((type*)((char*)(ptr) - offsetof(type, member)))
+#define min_t(type, a, b)	((type)(a) < (type)(b) ? (type)(a) : (type)(b))
+#define max_t(type, a, b)	((type)(a) > (type)(b) ? (type)(a) : (type)(b))
+#define min(a, b)		((a) < (b) ? (a) : (b))
+#define max(a, b)		((a) > (b) ? (a) : (b))
+#define div64_u64(a, b)		((a) / (b))
+#define __printf(a, b)		__attribute__((format(printf, a, b)))
+
+/* like snprintf, but returns what was written rather than what would have been */
+static inline __printf(3, 4) int scnprintf(char *buf, size_t size, const char *fmt, ...) {
+	va_list args;
+	int n;
+
+	if (size == 0)
+		return 0;
+	va_start(args, fmt);
+	n = vsnprintf(buf, size, fmt, args);
+	va_end(args);
+	return n < (int)size ? n : (int)size - 1;
+}
+
+/* params keep their defaults, but are not constants as far as the compiler knows */
+#define module_param(name, type, perm)	static __attribute__((used)) void *name##_param = &name;
+#define module_param_array(name, type, nump, perm) \
+	static __attribute__((used)) void *name##_param[2] = { name, nump };
+#define MODULE_PARM_DESC(name, desc)
+
+/* Memory */
+#define vmalloc(size)		malloc(size)
+#define vzalloc(size)		calloc(1, size)
+#define vfree(p)		free(p)
+#define kmalloc(size, flags)	malloc(size)
+#define kzalloc(size, flags)	calloc(1, size)
+#define kfree(p)		free(p)
+#define memcpy_flushcache	memcpy
+#define kcalloc(n, size, flags)	calloc(n, size)
+#define ARRAY_SIZE(a)		(sizeof(a) / sizeof((a)[0]))
+#define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
+
+/* One memory node and no huge pages, so page allocations fail and the disk is malloc'd */
+#define PAGE_SHIFT		12
+#define PAGE_SIZE		(1UL << PAGE_SHIFT)
+#define PAGE_MASK		(~(PAGE_SIZE - 1))
+#define PMD_SHIFT		21
+#define __GFP_COMP		0
+#define __GFP_NOWARN		0
+#define __GFP_THISNODE		0
+#define VM_MAP			0
+#define PAGE_KERNEL		0
+#define NUMA_NO_NODE		(-1)
+#define N_MEMORY		0
+#define nr_node_ids		1
+#define first_memory_node	0
+#define node_state(node, state)	((node) == 0)
+#define node_states		((unsigned long[]){ 1 })
+#define for_each_node_state(node, state)	for ((node) = 0; (node) < 1; ++(node))
+#define vmalloc_node(size, node)	malloc(size)
+
+struct page { int nid; };
+
+static inline int next_node_in(int node, unsigned long mask) {
+	return 0;
+}
+
+static inline unsigned int get_order(unsigned long size) {
+	unsigned int order;
+
+	for (order = 0; (PAGE_SIZE << order) < size; ++order)
+		;
+	return order;
+}
+#define alloc_pages_node(node, gfp, order)	((struct page*)NULL)
+#define __free_pages(page, order)	do { } while (0)
+#define page_address(page)	((void*)(page))
+#define vmap(pages, count, flags, prot)	NULL
+#define vunmap(addr)		do { } while (0)
+#define is_vmalloc_addr(addr)	true
+
+static inline struct page* vmalloc_to_page(const void *addr) {
+	static struct page page;
+
+	return &page;
+}
+#define virt_to_page(addr)	vmalloc_to_page(addr)
+#define page_to_nid(page)	((page)->nid)
+
+/* Atomics and barriers */
+#define READ_ONCE(x)		(*(volatile __typeof__(x)*)&(x))
+#define WRITE_ONCE(x, v)	(*(volatile __typeof__(x)*)&(x) = (v))
+#define smp_load_acquire(p)	__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define wmb()			__sync_synchronize()
+#define smp_mb()		__sync_synchronize()
+#define cmpxchg(p, old, new)	({ __typeof__(*(p)) __old = (old); \
+				   __atomic_compare_exchange_n(p, &__old, (new), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); \
+				   __old; })
+
+typedef struct { int counter; } atomic_t;
+#define atomic_set(a, v)	__atomic_store_n(&(a)->counter, (v), __ATOMIC_SEQ_CST)
+#define atomic_read(a)		__atomic_load_n(&(a)->counter, __ATOMIC_SEQ_CST)
+#define atomic_inc(a)		((void)__atomic_add_fetch(&(a)->counter, 1, __ATOMIC_SEQ_CST))
+#define atomic_dec(a)		((void)__atomic_sub_fetch(&(a)->counter, 1, __ATOMIC_SEQ_CST))
+#define atomic_dec_and_test(a)	(__atomic_sub_fetch(&(a)->counter, 1, __ATOMIC_SEQ_CST) == 0)
+
+/* Bitmaps */
+#define BITS_PER_LONG		(8 * sizeof(long))
+#define BITS_TO_LONGS(n)	(((n) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+static inline void set_bit(long nr, unsigned long *addr) {
+	__atomic_or_fetch(addr + nr / BITS_PER_LONG, 1UL << (nr % BITS_PER_LONG), __ATOMIC_SEQ_CST);
+}
+
+static inline void clear_bit(long nr, unsigned long *addr) {
+	__atomic_and_fetch(addr + nr / BITS_PER_LONG, ~(1UL << (nr % BITS_PER_LONG)), __ATOMIC_SEQ_CST);
+}
+
+static inline int test_and_clear_bit(long nr, unsigned long *addr) {
+	return (__atomic_fetch_and(addr + nr / BITS_PER_LONG, ~(1UL << (nr % BITS_PER_LONG)), __ATOMIC_SEQ_CST) >> (nr % BITS_PER_LONG)) & 1;
+}
+
+static inline int test_bit(long nr, const unsigned long *addr) {
+	return (__atomic_load_n(addr + nr / BITS_PER_LONG, __ATOMIC_RELAXED) >> (nr % BITS_PER_LONG)) & 1;
+}
+
+static inline unsigned long find_next_bit(const unsigned long *addr, unsigned long size, unsigned long off) {
+	for (; off < size; ++off) {
+		if (test_bit(off, addr))
+			return off;
+	}
+	return size;
+}
+#define find_first_bit(addr, size)	find_next_bit(addr, size, 0)
+
+static inline void bitmap_zero(unsigned long *addr, unsigned int nbits) {
+	memset(addr, 0, BITS_TO_LONGS(nbits) * sizeof(long));
+}
+
+static inline unsigned int bitmap_weight(const unsigned long *addr, unsigned int nbits) {
+	unsigned int i, w;
+
+	for (i = 0, w = 0; i < nbits; ++i)
+		w += test_bit(i, addr);
+	return w;
+}
+
+/* Per-CPU data: one copy shared by all threads, so updates are atomic */
+#define __percpu
+#define alloc_percpu(type)	((type*)calloc(1, sizeof(type)))
+#define free_percpu(p)		free(p)
+#define per_cpu_ptr(p, cpu)	((void)(cpu), (p))
+#define for_each_possible_cpu(cpu)	for ((cpu) = 0; (cpu) < 1; ++(cpu))
+#define this_cpu_add(x, v)	((void)__atomic_add_fetch(&(x), (v), __ATOMIC_RELAXED))
+#define this_cpu_inc(x)		this_cpu_add(x, 1)
+#define ilog2(n)		(63 - __builtin_clzll((unsigned long long)(n)))
+
+/* seq_file: the reports print to a stdio stream, nothing iterates them */
+struct seq_file { FILE *file; const struct seq_operations *op; void *private; };
+struct seq_operations {
+	void* (*start)(struct seq_file *m, loff_t *pos);
+	void (*stop)(struct seq_file *m, void *v);
+	void* (*next)(struct seq_file *m, void *v, loff_t *pos);
+	int (*show)(struct seq_file *m, void *v);
+};
+#define seq_vprintf(m, fmt, args)	vfprintf((m)->file, fmt, args)
+#define seq_printf(m, ...)	fprintf((m)->file, __VA_ARGS__)
+#define seq_puts(m, str)	fputs(str, (m)->file)
+
+/* Time: jiffies tick in milliseconds */
+#define HZ			1000
+#define time_before(a, b)	((long)((a) - (b)) < 0)
+#define time_after(a, b)	time_before(b, a)
+#define jiffies_to_msecs(j)	((unsigned int)(j))
+
+static inline u64 ktime_get_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#define jiffies			((unsigned long)(ktime_get_ns() / 1000000))
+
+/* Locks */
+typedef pthread_spinlock_t spinlock_t;
+#define DEFINE_SPINLOCK(x)	spinlock_t x; \
+				__attribute__((constructor)) static void x##_init(void) { pthread_spin_init(&x, 0); }
+#define spin_lock_init(x)	pthread_spin_init(x, 0)
+#define spin_lock(x)		pthread_spin_lock(x)
+#define spin_unlock(x)		pthread_spin_unlock(x)
+
+struct mutex { pthread_mutex_t m; };
+#define DEFINE_MUTEX(x)		struct mutex x = { PTHREAD_MUTEX_INITIALIZER }
+#define mutex_init(x)		pthread_mutex_init(&(x)->m, NULL)
+#define mutex_lock(x)		pthread_mutex_lock(&(x)->m)
+#define mutex_unlock(x)		pthread_mutex_unlock(&(x)->m)
+
+struct rw_semaphore { pthread_rwlock_t l; };
+#define init_rwsem(x)		pthread_rwlock_init(&(x)->l, NULL)
+#define down_read(x)		pthread_rwlock_rdlock(&(x)->l)
+#define up_read(x)		pthread_rwlock_unlock(&(x)->l)
+#define down_write(x)		pthread_rwlock_wrlock(&(x)->l)
+#define down_write_trylock(x)	(pthread_rwlock_trywrlock(&(x)->l) == 0)
+#define up_write(x)		pthread_rwlock_unlock(&(x)->l)
+
+struct percpu_rw_semaphore { pthread_rwlock_t l; };
+#define DEFINE_STATIC_PERCPU_RWSEM(x)	static struct percpu_rw_semaphore x = { PTHREAD_RWLOCK_INITIALIZER }
+#define percpu_init_rwsem(x)	pthread_rwlock_init(&(x)->l, NULL)
+#define percpu_free_rwsem(x)	pthread_rwlock_destroy(&(x)->l)
+#define percpu_down_read(x)	pthread_rwlock_rdlock(&(x)->l)
+#define percpu_up_read(x)	pthread_rwlock_unlock(&(x)->l)
+#define percpu_down_write(x)	pthread_rwlock_wrlock(&(x)->l)
+#define percpu_up_write(x)	pthread_rwlock_unlock(&(x)->l)
+
+/* RCU and works */
+#define rcu_read_lock()		do { } while (0)
+#define rcu_read_unlock()	do { } while (0)
+#define synchronize_rcu()	do { } while (0)
+#define rcu_barrier()		do { } while (0)
+
+struct work_struct { void (*func)(struct work_struct *work); };
+struct rcu_work { struct work_struct work; };
+struct delayed_work { struct work_struct work; };
+struct workqueue_struct { int unused; };
+
+#define INIT_RCU_WORK(w, f)	((w)->work.func = (f))
+#define to_rcu_work(w)		container_of(w, struct rcu_work, work)
+#define DECLARE_DELAYED_WORK(n, f)	struct delayed_work n = { { f } }
+#define INIT_DELAYED_WORK(w, f)	((w)->work.func = (f))
+#define to_delayed_work(w)	container_of(w, struct delayed_work, work)
+#define alloc_workqueue(fmt, flags, max, ...)	((struct workqueue_struct*)calloc(1, sizeof(struct workqueue_struct)))
+#define flush_workqueue(wq)	do { } while (0)
+#define destroy_workqueue(wq)	free(wq)
+
+static inline bool schedule_delayed_work(struct delayed_work *dwork, unsigned long delay) {
+	return true;
+}
+
+static inline bool cancel_delayed_work_sync(struct delayed_work *dwork) {
+	return false;
+}
+
+static inline bool queue_rcu_work(struct workqueue_struct *wq, struct rcu_work *rwork) {
+	rwork->work.func(&rwork->work);
+	return true;
+}
+
+/* Lists */
+struct list_head { struct list_head *next, *prev; };
+#define LIST_HEAD(name)		struct list_head name = { &(name), &(name) }
+#define INIT_LIST_HEAD(x)	((x)->next = (x)->prev = (x))
+#define list_entry(ptr, type, member)	container_of(ptr, type, member)
+#define list_for_each_entry(pos, head, member) \
+	for (pos = list_entry((head)->next, __typeof__(*pos), member); &pos->member != (head); \
+	     pos = list_entry(pos->member.next, __typeof__(*pos), member))
+
+static inline void list_add(struct list_head *entry, struct list_head *head) {
+	entry->next = head->next;
+	entry->prev = head;
+	head->next->prev = entry;
+	head->next = entry;
+}
+
+static inline void list_del(struct list_head *entry) {
+	entry->prev->next = entry->next;
+	entry->next->prev = entry->prev;
+}
+
+/* Files: host file descriptors */
+struct file { int fd; loff_t f_pos; };
+#define IS_ERR(p)		((p) == NULL)
+#ifndef O_LARGEFILE
+#define O_LARGEFILE		0
+#endif
+
+static inline struct file* fget(unsigned int fd) {
+	struct file *filp;
+
+	filp = (struct file*)calloc(1, sizeof(struct file));
+	if (filp == NULL)
+		return NULL;
+	filp->fd = fd;
+	filp->f_pos = lseek(fd, 0, SEEK_CUR);
+	if (filp->f_pos < 0)
+		filp->f_pos = 0;
+	return filp;
+}
+
+static inline void fput(struct file *filp) {
+	lseek(filp->fd, filp->f_pos, SEEK_SET);
+	free(filp);
+}
+
+static inline struct file* filp_open(const char *path, int flags, int mode) {
+	struct file *filp;
+	int fd;
+
+	fd = open(path, flags, mode);
+	if (fd < 0)
+		return NULL;
+	filp = fget(fd);
+	if (filp == NULL)
+		close(fd);
+	return filp;
+}
+
+static inline int filp_close(struct file *filp, void *id) {
+	close(filp->fd);
+	free(filp);
+	return 0;
+}
+
+static inline ssize_t kernel_read(struct file *filp, void *buf, size_t count, loff_t *pos) {
+	ssize_t ret;
+
+	ret = pread(filp->fd, buf, count, *pos);
+	if (ret > 0)
+		*pos += ret;
+	return ret < 0 ? -errno : ret;
+}
+
+static inline ssize_t kernel_write(struct file *filp, const void *buf, size_t count, loff_t *pos) {
+	ssize_t ret;
+
+	ret = pwrite(filp->fd, buf, count, *pos);
+	if (ret > 0)
+		*pos += ret;
+	return ret < 0 ? -errno : ret;
+}
+
+static inline int vfs_fsync(struct file *filp, int datasync) {
+	return fsync(filp->fd);
+}
+
+/* LZ4 from liblz4, which has no work memory argument */
+#define LZ4_MEM_COMPRESS	16384
+int LZ4_compress_default(const char *src, char *dst, int src_size, int dst_capacity);
+int LZ4_decompress_safe(const char *src, char *dst, int compressed_size, int dst_capacity);
+#define LZ4_compress_default(src, dst, size, cap, wrkmem)	LZ4_compress_default(src, dst, size, cap)
+
+static inline u64 xxh64(const void *input, size_t len, u64 seed) {
+	const unsigned char *p = (const unsigned char*)input;
+	u64 h = 0xcbf29ce484222325ULL ^ seed;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+#endif
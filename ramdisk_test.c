@@ -2,6 +2,13 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
 #include "ramdisk_param.h"
 #include "ramdisk_defs.h"
 
@@ -9,8 +16,23 @@ int dev_fd, file_fd, ret;
 int cmd;
 rd_param param;
 int file_test = 0;
+/* the instance to test, RAMDISK in the environment picks another one, e.g. /proc/ramdisk1 */
+const char *device_path = RAMDISK_PATH;
 
-char msg[4096] = {0};
+/* async reads in flight get their own buffers, by request id */
+#define AIO_BUFS 256
+char *aio_bufs[AIO_BUFS];
+int event_fd = -1;
+long aio_signalled;		/* completions counted on the eventfd and not reaped yet */
+
+#define STRESS_MAX_THREADS 64
+#define LOAD_FILES 4			/* files of each worker in the read/randwrite mixes */
+#define LOAD_CREATE_KEEP 16		/* files a create worker keeps before deleting the oldest */
+#define LOAD_HIST_SUB 16		/* histogram buckets per power of two of ns */
+#define LOAD_HIST_SIZE (64 * LOAD_HIST_SUB)
+#define LOAD_BASE_LEN 16		/* a worker's dir, "/load/w<ID>" */
+
+char msg[RD_MSG_SIZE] = {0};
 char data[RD_MAX_FILE_SIZE] = {0};
 /* wrapper functions */
 int rd_create(char *path) {
@@ -119,11 +141,30 @@ void show_fdt_status() {
  * 	create /a.txt	
  * 	mkdir /b
  * 	open /a.txt RD_RDONLY
+ * 	open /log.txt RD_WRONLY|RD_APPEND
  * 	close 1
  * 	delete /a.txt
+ * 	rmdir /b
+ * 	rmtree /jobs
+ * 	rename /a.tmp /a.txt
+ * 	stat /a.txt /b
+ * 	statdir /b
+ * 	snapshot / /snap
+ * 	reflink /a.txt /b.txt
+ * 	compress
+ * 	dedup
+ * 	save /tmp/ramdisk.img
+ * 	restore /tmp/ramdisk.img
+ * 	sync
  *  read 1 1024
  *  write 1 abcdefg
  *  lseek 1 0
+ *  fallocate 1 2048
+ *  truncate 1 100
+ *  aread 1 1024
+ *  awrite 1 abcdefg
+ *  reap 2
+ *  eventfd
  *  showblocks
  *  showinodes
  *  showdir /b
@@ -138,9 +179,12 @@ int parse_command(char *str) {
 	int offset;
 	char* buf;
 	char path[RD_MAX_PATH_LEN] = {0};
+	char new_path[RD_MAX_PATH_LEN] = {0};
 	char write_data[RD_MAX_FILE_SIZE] = {0};
 	int i, l;
 	int write_flag = 0;
+	int stat_list = 0;	// stat takes a list of paths, statdir a dir
+	int submit = 0;		// aread/awrite submit a read/write
 
 	fd = -1;
 	cmd = -1;
@@ -163,12 +207,51 @@ int parse_command(char *str) {
 				cmd = RD_CLOSE;
 			} else if (strcmp(buf, "delete") == 0) {
 				cmd = RD_DELETE;
+			} else if (strcmp(buf, "rmdir") == 0) {
+				cmd = RD_RMDIR;
+			} else if (strcmp(buf, "rmtree") == 0) {
+				cmd = RD_RMTREE;
+			} else if (strcmp(buf, "rename") == 0) {
+				cmd = RD_RENAME;
+			} else if (strcmp(buf, "stat") == 0) {
+				cmd = RD_STAT;
+				stat_list = 1;
+			} else if (strcmp(buf, "statdir") == 0) {
+				cmd = RD_STAT;
 			} else if (strcmp(buf, "read") == 0) {
 				cmd = RD_READ;
 			} else if (strcmp(buf, "write") == 0) {
 				cmd = RD_WRITE;
+			} else if (strcmp(buf, "aread") == 0) {
+				cmd = RD_READ;
+				submit = 1;
+			} else if (strcmp(buf, "awrite") == 0) {
+				cmd = RD_WRITE;
+				submit = 1;
+			} else if (strcmp(buf, "reap") == 0) {
+				cmd = RD_REAP;
+			} else if (strcmp(buf, "eventfd") == 0) {
+				cmd = RD_EVENTFD;
 			} else if (strcmp(buf, "lseek") == 0) {
 				cmd = RD_LSEEK;
+			} else if (strcmp(buf, "fallocate") == 0) {
+				cmd = RD_FALLOCATE;
+			} else if (strcmp(buf, "truncate") == 0) {
+				cmd = RD_TRUNCATE;
+			} else if (strcmp(buf, "snapshot") == 0) {
+				cmd = RD_SNAPSHOT;
+			} else if (strcmp(buf, "reflink") == 0) {
+				cmd = RD_REFLINK;
+			} else if (strcmp(buf, "compress") == 0) {
+				cmd = RD_COMPRESS;
+			} else if (strcmp(buf, "dedup") == 0) {
+				cmd = RD_DEDUP;
+			} else if (strcmp(buf, "save") == 0) {
+				cmd = RD_SAVE;
+			} else if (strcmp(buf, "restore") == 0) {
+				cmd = RD_RESTORE;
+			} else if (strcmp(buf, "sync") == 0) {
+				cmd = RD_SYNC;
 			} else if (strcmp(buf, "showblocks") == 0) {
 				cmd = RD_SHOWBLOCKS;
 			} else if (strcmp(buf, "showinodes") == 0) {
@@ -193,13 +276,36 @@ int parse_command(char *str) {
 			case RD_MKDIR:
 			case RD_OPEN:
 			case RD_DELETE:
+			case RD_RMDIR:
+			case RD_RMTREE:
+			case RD_RENAME:
 			case RD_SHOWDIR:
+			case RD_SNAPSHOT:
+			case RD_REFLINK:
+			case RD_SAVE:
+			case RD_RESTORE:
 				if (strlen(buf) > RD_MAX_PATH_LEN) {
 					// too large
 					return -1;
 				}
 				strcpy(path, buf);
 				break;
+			case RD_STAT:
+				len = RD_MAX_FILE_SIZE;
+				if (!stat_list) {
+					if (strlen(buf) >= RD_MAX_PATH_LEN)
+						return -1;
+					strcpy(path, buf);
+					break;
+				}
+				/* the rest of the line, one path per line in data */
+				snprintf(write_data, sizeof(write_data), "%s %s", buf, str ? str : "");
+				for (i = 0, l = strlen(write_data); i < l; ++i) {
+					if (write_data[i] == ' ' || write_data[i] == '\n')
+						write_data[i] = '\n';
+				}
+				write_flag = 1;
+				break;
 			case RD_WRITE:
 				str[strlen(str)-1] = 0;
 				strcpy(write_data, str);
@@ -208,6 +314,8 @@ int parse_command(char *str) {
 			case RD_READ:
 			case RD_LSEEK:
 			case RD_CLOSE:
+			case RD_FALLOCATE:
+			case RD_TRUNCATE:
 				fd = 0;
 				for (i = 0, l = strlen(buf); i < l; ++i) {
 					if ('0' <= buf[i] && buf[i] <= '9') {
@@ -219,6 +327,19 @@ int parse_command(char *str) {
 					}
 				}
 				break;
+			case RD_REAP:
+				/* the completions to wait for */
+				offset = 0;
+				for (i = 0, l = strlen(buf); i < l; ++i) {
+					if ('0' <= buf[i] && buf[i] <= '9') {
+						offset = offset * 10 + (buf[i] - '0');
+					}
+					else {
+						// min contains characters other than #
+						return -1;
+					}
+				}
+				break;
 			default:
 				// other cmds don't have a 2nd argument
 				return -1;
@@ -233,11 +354,21 @@ int parse_command(char *str) {
 					mode = RD_WRONLY;
 				} else if (strcmp(buf, "RD_RDWR") == 0) {
 					mode = RD_RDWR;
+				} else if (strcmp(buf, "RD_WRONLY|RD_APPEND") == 0) {
+					mode = RD_WRONLY | RD_APPEND;
+				} else if (strcmp(buf, "RD_RDWR|RD_APPEND") == 0) {
+					mode = RD_RDWR | RD_APPEND;
 				} else {
 					// unsupported mode;
 					return -1;
 				}
-			} else if (cmd == RD_READ) {
+			} else if (cmd == RD_SNAPSHOT || cmd == RD_REFLINK || cmd == RD_RENAME) {
+				if (strlen(buf) >= RD_MAX_PATH_LEN) {
+					// too large
+					return -1;
+				}
+				strcpy(new_path, buf);
+			} else if (cmd == RD_READ || cmd == RD_FALLOCATE || cmd == RD_TRUNCATE) {
 				len = 0;
 				for (i = 0, l = strlen(buf); i < l; ++i) {
 					if ('0' <= buf[i] && buf[i] <= '9') {
@@ -271,22 +402,39 @@ int parse_command(char *str) {
     }
     if (cmd == RD_CREATE || cmd == RD_MKDIR ||
 		cmd == RD_OPEN || cmd == RD_DELETE ||
-		cmd == RD_SHOWDIR) {
+		cmd == RD_RMDIR || cmd == RD_RMTREE ||
+		cmd == RD_SHOWDIR || cmd == RD_SAVE || cmd == RD_RESTORE) {
     	if (strlen(path) == 0)
     		return -1;
     }
+    if ((cmd == RD_SNAPSHOT || cmd == RD_REFLINK || cmd == RD_RENAME) &&
+    	(strlen(path) == 0 || strlen(new_path) == 0))
+    	return -1;
     if (cmd == RD_OPEN && mode == -1)
     	return -1;
-    if ((cmd == RD_CLOSE || cmd == RD_READ || cmd == RD_WRITE)
-    	 && fd == -1)
+    if ((cmd == RD_CLOSE || cmd == RD_READ || cmd == RD_WRITE ||
+    	 cmd == RD_FALLOCATE || cmd == RD_TRUNCATE) && fd == -1)
     	return -1;
     if (cmd == RD_LSEEK && offset == -1)
     	return -1;
-    if (cmd == RD_READ && len == -1)
+    if ((cmd == RD_READ || cmd == RD_FALLOCATE || cmd == RD_TRUNCATE) && len == -1)
     	return -1;
     if (cmd == RD_WRITE && strlen(write_data) == 0)
     	return -1;
+    if (cmd == RD_STAT && strlen(path) == 0 && strlen(write_data) == 0)
+    	return -1;
+    if (submit) {
+    	/* aread/awrite take the args of read/write */
+    	mode = cmd;
+    	cmd = RD_SUBMIT;
+    }
+    if (cmd == RD_REAP) {
+    	if (offset == -1)
+    		offset = 0;
+    	len = AIO_BUFS * sizeof(rd_completion);
+    }
 	strcpy(param.path, path);
+	strcpy(param.new_path, new_path);
 	strcpy(param.data, write_data);
 	param.mode = mode;
 	param.fd = fd;
@@ -302,6 +450,8 @@ int parse_command(char *str) {
  * keep reading the input from stdin and execute it
  */
 
+int execute_command();
+
 int input_command() {
 	// TODO: a loop to input command
 	char str[4096];
@@ -329,13 +479,105 @@ int input_command() {
 	return 0;
 }
 
+/* The image of save/restore is a file of ours, the ramdisk gets its fd */
+static int open_image(int cmd, const char *path) {
+	if (cmd == RD_SAVE)
+		return open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	return open(path, O_RDONLY);
+}
+
+/* The records of a bulk stat, a path that doesn't exist has no inode */
+static void print_stats(rd_stat *stats, int n) {
+	int i;
+
+	if (!file_test)
+		printf("\033[1m\033[33m");
+	printf("InodeNum\tType\tBlkCnt\tSize\tFilename\n");
+	for (i = 0; i < n; ++i) {
+		if (stats[i].inode_num == -1)
+			printf("-\t\t-\t-\t-\t%s\n", stats[i].filename);
+		else
+			printf("%d\t\t%s\t%d\t%d\t%s\n", stats[i].inode_num,
+				stats[i].file_type == RD_DIRECTORY ? "dir" : "file",
+				stats[i].block_count, stats[i].file_size, stats[i].filename);
+	}
+	if (!file_test)
+		printf("\033[0m");
+}
+
+static int cmp_completion(const void *a, const void *b) {
+	return ((const rd_completion*)a)->id - ((const rd_completion*)b)->id;
+}
+
+/*
+ * The completions of a reap, in id order so scripts have a stable output.
+ * Async reads hand back the buffer they were submitted with.
+ */
+static void print_completions(rd_completion *comps, int n) {
+	int i;
+
+	qsort(comps, n, sizeof(rd_completion), cmp_completion);
+	if (!file_test)
+		printf("\033[1m\033[33m");
+	for (i = 0; i < n; ++i) {
+		printf("Request %d: %d\n", comps[i].id, comps[i].ret);
+		if (aio_bufs[comps[i].id % AIO_BUFS] != NULL) {
+			if (comps[i].ret > 0)
+				printf("Read Data: %s\n", aio_bufs[comps[i].id % AIO_BUFS]);
+			free(aio_bufs[comps[i].id % AIO_BUFS]);
+			aio_bufs[comps[i].id % AIO_BUFS] = NULL;
+		}
+	}
+	if (!file_test)
+		printf("\033[0m");
+}
+
 /* 
  * Execute the command
  * Return 0 if success, otherwise -1
  */
 
 int execute_command() {
+	int image_fd = -1;
+	char *aio_buf = NULL;
+	uint64_t count;
+
+	if (cmd == RD_SAVE || cmd == RD_RESTORE) {
+		image_fd = open_image(cmd, param.path);
+		if (image_fd == -1) {
+			printf("Cannot open image file '%s'.\n", param.path);
+			return -1;
+		}
+		param.fd = image_fd;
+	}
+	if (cmd == RD_SUBMIT && param.mode == RD_READ && param.len > 0 && param.len <= RD_MAX_FILE_SIZE) {
+		/* the ramdisk fills it in when the read is reaped */
+		aio_buf = (char*)calloc(param.len + 1, 1);
+		param.data_addr = aio_buf;
+	}
+	if (cmd == RD_EVENTFD) {
+		if (event_fd == -1)
+			event_fd = eventfd(0, 0);
+		param.fd = event_fd;
+	}
+	if (cmd == RD_REAP && event_fd != -1) {
+		/* wait on the eventfd like a poll loop would, the reap then doesn't block */
+		while (aio_signalled < param.offset && read(event_fd, &count, sizeof(count)) == sizeof(count))
+			aio_signalled += count;
+	}
 	ret = ioctl(dev_fd, cmd, &param);
+	if (image_fd != -1)
+		close(image_fd);
+	if (aio_buf != NULL) {
+		if (ret != -1) {
+			free(aio_bufs[ret % AIO_BUFS]);
+			aio_bufs[ret % AIO_BUFS] = aio_buf;
+		} else {
+			free(aio_buf);
+		}
+	}
+	if (cmd == RD_REAP && event_fd != -1 && ret > 0)
+		aio_signalled -= ret;
 	if (!file_test)
 		printf("\033[1m\033[33m");
 	printf("%s", msg);
@@ -365,6 +607,23 @@ int execute_command() {
 					printf("\033[0m");
 			}
 			break;
+		case RD_SUBMIT:
+			if (ret != -1) {
+				if (!file_test)
+					printf("\033[1m\033[33m");
+				printf("Request: %d\n", ret);
+				if (!file_test)
+					printf("\033[0m");
+			}
+			break;
+		case RD_REAP:
+			if (ret != -1)
+				print_completions((rd_completion*)data, ret);
+			break;
+		case RD_STAT:
+			if (ret != -1)
+				print_stats((rd_stat*)data, ret < param.len / (int)sizeof(rd_stat) ? ret : param.len / (int)sizeof(rd_stat));
+			break;
 		case RD_HELP:
 			if (!file_test)
 				printf("\033[1m\033[33m");
@@ -372,11 +631,30 @@ int execute_command() {
 			printf("create <ABSOLUTE PATH> (eg. create /a.txt)\n");
 			printf("mkdir <ABSOLUTE PATH> (eg. mkdir /b)\n");
 			printf("open <ABSOLUTE PATH> <RD_RDONLY|RD_WRONLY|RD_RDWR> (eg. open /a.txt RD_RDWR)\n");
+			printf("    append with RD_WRONLY|RD_APPEND or RD_RDWR|RD_APPEND (eg. open /log.txt RD_WRONLY|RD_APPEND)\n");
 			printf("close <FD> (eg. close 1)\n");
 			printf("write <FD> <DATA> (eg. write 1 Hello,world)\n");
 			printf("lseek <FD> <OFFSET> (eg. lseek 1 0)\n");
+			printf("fallocate <FD> <LEN> (eg. fallocate 1 2048)\n");
+			printf("truncate <FD> <LEN> (eg. truncate 1 100)\n");
 			printf("delete <ABSOLUTE PATH> (eg. delete /a.txt)\n");
+			printf("rmdir <DIR PATH> (eg. rmdir /b)\n");
+			printf("rmtree <ABSOLUTE PATH> (eg. rmtree /jobs)\n");
+			printf("rename <ABSOLUTE PATH> <NEW PATH> (eg. rename /a.tmp /a.txt)\n");
+			printf("stat <ABSOLUTE PATH> [<ABSOLUTE PATH> ...] (eg. stat /a.txt /b)\n");
+			printf("statdir <DIR PATH> (eg. statdir /b)\n");
+			printf("aread <FD> <LEN> (eg. aread 1 100)\n");
+			printf("awrite <FD> <DATA> (eg. awrite 1 Hello,world)\n");
+			printf("reap [<MIN>] (eg. reap 2)\n");
+			printf("eventfd\n");
+			printf("snapshot <DIR PATH> <NEW DIR PATH> (eg. snapshot / /snap)\n");
+			printf("reflink <FILE PATH> <NEW FILE PATH> (eg. reflink /a.txt /b.txt)\n");
 			printf("showdir <ABSOLUTE PATH> (eg. showdir /)\n");
+			printf("compress\n");
+			printf("dedup\n");
+			printf("save <IMAGE FILE PATH> (eg. save /tmp/ramdisk.img)\n");
+			printf("restore <IMAGE FILE PATH> (eg. restore /tmp/ramdisk.img)\n");
+			printf("sync\n");
 			printf("showblocks\n");
 			printf("showinodes\n");
 			printf("showfdt\n");
@@ -390,10 +668,813 @@ int execute_command() {
 
 }
 
+/*
+ * Stress test
+ *
+ * Every worker opens its own handle of the ramdisk and keeps its own
+ * rd_param, then loops create/open/write/lseek/read/close/delete on a
+ * private file while all workers share one directory. Read data is checked
+ * against what was written, so lost updates between workers show up as errors.
+ */
+typedef struct {
+	int id;
+	int iterations;
+	long ops;
+	long errors;
+} stress_arg;
+
+void *stress_worker(void *arg) {
+	stress_arg *sa = (stress_arg*)arg;
+	rd_param p;
+	char m[RD_MSG_SIZE];
+	char path[RD_MAX_PATH_LEN];
+	char rbuf[RD_BLOCK_SIZE];
+	int dev, fd, i;
+
+	dev = open(device_path, O_RDONLY);
+	if (dev < 0) {
+		sa->errors++;
+		return NULL;
+	}
+	memset(&p, 0, sizeof(p));
+	p.msg_addr = m;
+	p.data_addr = rbuf;
+	sprintf(path, "/stress/t%d", sa->id);
+	memset(p.data, 'a' + sa->id % 26, RD_BLOCK_SIZE);
+
+	for (i = 0; i < sa->iterations; ++i) {
+		strcpy(p.path, path);
+		if (ioctl(dev, RD_CREATE, &p) == -1)
+			sa->errors++;
+		p.mode = RD_RDWR;
+		fd = ioctl(dev, RD_OPEN, &p);
+		sa->ops += 2;
+		if (fd == -1) {
+			sa->errors++;
+			continue;
+		}
+		p.fd = fd;
+		p.len = RD_BLOCK_SIZE;
+		if (ioctl(dev, RD_WRITE, &p) != RD_BLOCK_SIZE)
+			sa->errors++;
+		p.offset = 0;
+		ioctl(dev, RD_LSEEK, &p);
+		memset(rbuf, 0, sizeof(rbuf));
+		if (ioctl(dev, RD_READ, &p) != RD_BLOCK_SIZE || memcmp(rbuf, p.data, RD_BLOCK_SIZE) != 0)
+			sa->errors++;
+		ioctl(dev, RD_CLOSE, &p);
+		if (ioctl(dev, RD_DELETE, &p) == -1)
+			sa->errors++;
+		sa->ops += 5;
+	}
+	close(dev);
+	return NULL;
+}
+
+int stress_test(int threads, int iterations) {
+	pthread_t tids[STRESS_MAX_THREADS];
+	stress_arg args[STRESS_MAX_THREADS];
+	struct timespec start, end;
+	double secs;
+	long ops, errors;
+	int i;
+
+	strcpy(param.path, "/stress");
+	param.msg_addr = msg;
+	ioctl(dev_fd, RD_MKDIR, &param);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < threads; ++i) {
+		args[i].id = i;
+		args[i].iterations = iterations;
+		args[i].ops = 0;
+		args[i].errors = 0;
+		pthread_create(&tids[i], NULL, stress_worker, &args[i]);
+	}
+	ops = errors = 0;
+	for (i = 0; i < threads; ++i) {
+		pthread_join(tids[i], NULL);
+		ops += args[i].ops;
+		errors += args[i].errors;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("Threads: %d, Ops: %ld, Errors: %ld\n", threads, ops, errors);
+	printf("Elapsed: %.3f s, Throughput: %.0f ops/s\n", secs, ops / secs);
+	return errors == 0 ? 0 : -1;
+}
+
+/*
+ * Load generator
+ *
+ * Every worker opens its own handle of the ramdisk and works under its own
+ * dir /load/w<ID>, either replaying a script (the paths in it are taken
+ * relative to that dir, fds are the worker's own) or running a synthetic
+ * mix:
+ *
+ *	create:    create, open, write 64 bytes, close and delete the file
+ *	           created LOAD_CREATE_KEEP rounds earlier
+ *	read:      random 512-byte reads over LOAD_FILES full files, every
+ *	           tenth op a 512-byte write
+ *	randwrite: writes of 1 to 1024 bytes at random offsets of LOAD_FILES files
+ *
+ * for a number of seconds or ops per worker. Every ioctl is timed into a
+ * log-linear histogram of its command (LOAD_HIST_SUB buckets per power of
+ * two, so percentiles are within about 6%), merged over all workers at the end.
+ */
+typedef struct {
+	int cmd;
+	rd_param param;
+} load_op;
+
+static const struct {
+	int cmd;
+	const char *name;
+} load_cmds[] = {
+	{ RD_CREATE, "create" }, { RD_MKDIR, "mkdir" }, { RD_OPEN, "open" }, { RD_CLOSE, "close" },
+	{ RD_READ, "read" }, { RD_WRITE, "write" }, { RD_LSEEK, "lseek" }, { RD_DELETE, "delete" },
+	{ RD_FALLOCATE, "fallocate" }, { RD_TRUNCATE, "truncate" }, { RD_SNAPSHOT, "snapshot" },
+	{ RD_REFLINK, "reflink" }, { RD_COMPRESS, "compress" }, { RD_DEDUP, "dedup" }, { RD_SYNC, "sync" },
+	{ RD_SHOWDIR, "showdir" }, { RD_SHOWBLOCKS, "showblocks" }, { RD_SHOWINODES, "showinodes" },
+	{ RD_SHOWFDT, "showfdt" }, { RD_RMDIR, "rmdir" }, { RD_RMTREE, "rmtree" }, { RD_RENAME, "rename" },
+	{ RD_STAT, "stat" }, { RD_SUBMIT, "submit" }, { RD_REAP, "reap" }, { RD_EVENTFD, "eventfd" },
+};
+#define LOAD_CMDS ((int)(sizeof(load_cmds) / sizeof(load_cmds[0])))
+
+typedef struct {
+	long count;
+	long errors;
+	long max_ns;
+	long hist[LOAD_HIST_SIZE];
+} load_stat;
+
+typedef struct {
+	int id;
+	int dev;
+	long max_ops;				/* ops to run, 0 to run until load_stop */
+	unsigned int seed;
+	char base[LOAD_BASE_LEN];
+	load_stat *stats;			/* LOAD_CMDS of them */
+} load_worker;
+
+static const char *load_mix;
+static load_op *load_script;
+static int load_script_len;
+static volatile int load_stop;
+
+static int load_bucket(long ns) {
+	int msb;
+
+	if (ns < LOAD_HIST_SUB)
+		return ns;
+	msb = 63 - __builtin_clzl(ns);
+	return (msb - 3) * LOAD_HIST_SUB + (int)((ns >> (msb - 4)) & (LOAD_HIST_SUB - 1));
+}
+
+/* the largest ns value of a bucket */
+static long load_bucket_ns(int bucket) {
+	int msb;
+
+	if (bucket < LOAD_HIST_SUB)
+		return bucket;
+	msb = bucket / LOAD_HIST_SUB + 3;
+	return ((long)(LOAD_HIST_SUB + bucket % LOAD_HIST_SUB + 1) << (msb - 4)) - 1;
+}
+
+static int load_ioctl(load_worker *w, int cmd, rd_param *p) {
+	struct timespec t0, t1;
+	load_stat *st;
+	long ns;
+	int i, r;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	r = ioctl(w->dev, cmd, p);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	ns = (t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec);
+	for (i = 0; i < LOAD_CMDS && load_cmds[i].cmd != cmd; ++i)
+		;
+	if (i == LOAD_CMDS)
+		return r;
+	st = w->stats + i;
+	st->count++;
+	if (r == -1)
+		st->errors++;
+	if (ns > st->max_ns)
+		st->max_ns = ns;
+	st->hist[load_bucket(ns)]++;
+	return r;
+}
+
+static int load_done(load_worker *w, long ops) {
+	return w->max_ops > 0 ? ops >= w->max_ops : load_stop;
+}
+
+/* Prefix an absolute path of a script with the worker's dir */
+static void load_path(load_worker *w, char *dst, const char *src) {
+	if (strlen(src) == 0)
+		return;
+	if (strcmp(src, "/") == 0)
+		snprintf(dst, RD_MAX_PATH_LEN, "%s", w->base);
+	else
+		snprintf(dst, RD_MAX_PATH_LEN, "%s%s", w->base, src);
+}
+
+static void load_replay(load_worker *w, rd_param *p) {
+	char *msg_addr;
+	char *data_addr;
+	long ops;
+	int i;
+
+	/* replayed params point at the worker's buffers */
+	msg_addr = p->msg_addr;
+	data_addr = p->data_addr;
+	for (ops = 0; !load_done(w, ops); ) {
+		for (i = 0; i < load_script_len && !load_done(w, ops); ++i, ++ops) {
+			memcpy(p, &load_script[i].param, sizeof(*p));
+			load_path(w, p->path, load_script[i].param.path);
+			load_path(w, p->new_path, load_script[i].param.new_path);
+			p->msg_addr = msg_addr;
+			p->data_addr = data_addr;
+			load_ioctl(w, load_script[i].cmd, p);
+		}
+	}
+}
+
+static void load_synthetic(load_worker *w, rd_param *p) {
+	char path[RD_MAX_PATH_LEN];
+	int fds[LOAD_FILES];
+	long ops;
+	int i, n;
+
+	if (strcmp(load_mix, "create") == 0) {
+		memset(p->data, 'c', 64);
+		for (ops = 0, i = 0; !load_done(w, ops); ++i) {
+			snprintf(p->path, RD_MAX_PATH_LEN, "%s/f%d", w->base, i % (2 * LOAD_CREATE_KEEP));
+			load_ioctl(w, RD_CREATE, p);
+			p->mode = RD_RDWR;
+			p->fd = load_ioctl(w, RD_OPEN, p);
+			p->len = 64;
+			load_ioctl(w, RD_WRITE, p);
+			load_ioctl(w, RD_CLOSE, p);
+			ops += 4;
+			if (i >= LOAD_CREATE_KEEP) {
+				snprintf(p->path, RD_MAX_PATH_LEN, "%s/f%d", w->base, (i - LOAD_CREATE_KEEP) % (2 * LOAD_CREATE_KEEP));
+				load_ioctl(w, RD_DELETE, p);
+				ops++;
+			}
+		}
+		return;
+	}
+
+	/* read and randwrite work on LOAD_FILES full files */
+	memset(p->data, 'a' + w->id % 26, RD_MAX_FILE_SIZE);
+	for (i = 0; i < LOAD_FILES; ++i) {
+		snprintf(path, sizeof(path), "%s/f%d", w->base, i);
+		strcpy(p->path, path);
+		ioctl(w->dev, RD_CREATE, p);
+		p->mode = RD_RDWR;
+		fds[i] = ioctl(w->dev, RD_OPEN, p);
+		p->fd = fds[i];
+		p->len = RD_MAX_FILE_SIZE;
+		ioctl(w->dev, RD_WRITE, p);
+	}
+	for (ops = 0; !load_done(w, ops); ops += 2) {
+		p->fd = fds[rand_r(&w->seed) % LOAD_FILES];
+		if (strcmp(load_mix, "read") == 0) {
+			p->offset = rand_r(&w->seed) % (RD_MAX_FILE_SIZE - RD_BLOCK_SIZE + 1);
+			load_ioctl(w, RD_LSEEK, p);
+			p->len = RD_BLOCK_SIZE;
+			load_ioctl(w, ops % 20 == 0 ? RD_WRITE : RD_READ, p);
+		} else {
+			n = 1 + rand_r(&w->seed) % 1024;
+			p->offset = rand_r(&w->seed) % (RD_MAX_FILE_SIZE - n + 1);
+			load_ioctl(w, RD_LSEEK, p);
+			p->len = n;
+			load_ioctl(w, RD_WRITE, p);
+		}
+	}
+	for (i = 0; i < LOAD_FILES; ++i) {
+		p->fd = fds[i];
+		ioctl(w->dev, RD_CLOSE, p);
+	}
+}
+
+void *load_worker_fn(void *arg) {
+	load_worker *w = (load_worker*)arg;
+	rd_param *p;
+	char *m;
+	char *rbuf;
+
+	p = (rd_param*)calloc(1, sizeof(rd_param));
+	m = (char*)malloc(RD_MSG_SIZE);
+	rbuf = (char*)malloc(RD_MAX_FILE_SIZE);
+	w->dev = open(device_path, O_RDONLY);
+	if (p == NULL || m == NULL || rbuf == NULL || w->dev < 0) {
+		fprintf(stderr, "Worker %d cannot start.\n", w->id);
+		free(p);
+		free(m);
+		free(rbuf);
+		return NULL;
+	}
+	p->msg_addr = m;
+	p->data_addr = rbuf;
+	strcpy(p->path, w->base);
+	ioctl(w->dev, RD_MKDIR, p);
+
+	if (load_script != NULL)
+		load_replay(w, p);
+	else
+		load_synthetic(w, p);
+	close(w->dev);
+	free(p);
+	free(m);
+	free(rbuf);
+	return NULL;
+}
+
+/*
+ * Read a script for the workers to replay, skipping what can't be replayed
+ * concurrently (save/restore, help). Returns -1 if it can't be read.
+ */
+static int load_read_script(const char *path) {
+	char str[4096];
+	char line[4096];
+	FILE *f;
+	int size;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	size = 0;
+	load_script_len = 0;
+	while (fgets(str, sizeof(str), f) != NULL) {
+		if (str[0] == '#' || str[0] == '\n')
+			continue;
+		/* parse_command cuts str up */
+		strcpy(line, str);
+		if (parse_command(str) == -1) {
+			printf("Parse error, skipping: %s", line);
+			continue;
+		}
+		if (cmd == RD_EXIT)
+			break;
+		if (cmd == RD_HELP || cmd == RD_SAVE || cmd == RD_RESTORE)
+			continue;
+		/* every path is run below the worker's dir */
+		if (strlen(param.path) + LOAD_BASE_LEN > RD_MAX_PATH_LEN ||
+			strlen(param.new_path) + LOAD_BASE_LEN > RD_MAX_PATH_LEN) {
+			printf("Path too long to prefix, skipping: %s", line);
+			continue;
+		}
+		if (load_script_len == size) {
+			size = size ? size * 2 : 64;
+			load_script = (load_op*)realloc(load_script, sizeof(load_op) * size);
+		}
+		load_script[load_script_len].cmd = cmd;
+		memcpy(&load_script[load_script_len].param, &param, sizeof(param));
+		load_script_len++;
+	}
+	fclose(f);
+	return load_script_len > 0 ? 0 : -1;
+}
+
+static double load_percentile(load_stat *st, double q) {
+	long need, seen;
+	int i;
+
+	need = (long)(q * st->count + 0.999999);
+	for (i = 0, seen = 0; i < LOAD_HIST_SIZE; ++i) {
+		seen += st->hist[i];
+		if (seen >= need)
+			break;
+	}
+	if (i == LOAD_HIST_SIZE || load_bucket_ns(i) > st->max_ns)
+		return st->max_ns / 1000.0;
+	return load_bucket_ns(i) / 1000.0;
+}
+
+/*
+ * Run the given workload with the given number of workers, for "<N>s"
+ * seconds or "<N>" ops per worker, then report throughput and latency
+ * percentiles per command.
+ */
+int load_test(int threads, const char *workload, const char *duration) {
+	pthread_t tids[STRESS_MAX_THREADS];
+	load_worker workers[STRESS_MAX_THREADS];
+	load_stat total[LOAD_CMDS];
+	struct timespec start, end;
+	double secs;
+	long ops, errors, max_ops;
+	int i, j, k, seconds;
+
+	if (strcmp(workload, "create") == 0 || strcmp(workload, "read") == 0 || strcmp(workload, "randwrite") == 0) {
+		load_mix = workload;
+	} else if (load_read_script(workload) == -1) {
+		printf("Error: '%s' is neither a mix (create, read, randwrite) nor a readable script.\n", workload);
+		return -1;
+	}
+	seconds = 0;
+	max_ops = 0;
+	if (duration[strlen(duration) - 1] == 's')
+		seconds = atoi(duration);
+	else
+		max_ops = atol(duration);
+	if (seconds <= 0 && max_ops <= 0) {
+		printf("Error: Invalid duration '%s', use <SECONDS>s or <OPS>.\n", duration);
+		return -1;
+	}
+
+	strcpy(param.path, "/load");
+	param.msg_addr = msg;
+	ioctl(dev_fd, RD_MKDIR, &param);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < threads; ++i) {
+		workers[i].id = i;
+		workers[i].max_ops = max_ops;
+		workers[i].seed = i + 1;
+		snprintf(workers[i].base, LOAD_BASE_LEN, "/load/w%d", i);
+		workers[i].stats = (load_stat*)calloc(LOAD_CMDS, sizeof(load_stat));
+		if (workers[i].stats == NULL) {
+			printf("Error: Cannot allocate latency histograms.\n");
+			return -1;
+		}
+		pthread_create(&tids[i], NULL, load_worker_fn, &workers[i]);
+	}
+	if (seconds > 0) {
+		sleep(seconds);
+		load_stop = 1;
+	}
+	for (i = 0; i < threads; ++i)
+		pthread_join(tids[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	memset(total, 0, sizeof(total));
+	ops = errors = 0;
+	for (i = 0; i < threads; ++i) {
+		for (j = 0; j < LOAD_CMDS; ++j) {
+			total[j].count += workers[i].stats[j].count;
+			total[j].errors += workers[i].stats[j].errors;
+			if (workers[i].stats[j].max_ns > total[j].max_ns)
+				total[j].max_ns = workers[i].stats[j].max_ns;
+			for (k = 0; k < LOAD_HIST_SIZE; ++k)
+				total[j].hist[k] += workers[i].stats[j].hist[k];
+		}
+		free(workers[i].stats);
+	}
+	for (j = 0; j < LOAD_CMDS; ++j) {
+		ops += total[j].count;
+		errors += total[j].errors;
+	}
+
+	printf("Threads: %d, Workload: %s, Elapsed: %.3f s\n", threads, workload, secs);
+	printf("Ops: %ld, Errors: %ld, Throughput: %.0f ops/s\n", ops, errors, ops / secs);
+	printf("%-12s %10s %8s %10s %10s %10s %10s %10s\n", "Command", "Ops", "Errors", "Ops/s",
+		"p50(us)", "p99(us)", "p999(us)", "Max(us)");
+	for (j = 0; j < LOAD_CMDS; ++j) {
+		if (total[j].count == 0)
+			continue;
+		printf("%-12s %10ld %8ld %10.0f %10.2f %10.2f %10.2f %10.2f\n", load_cmds[j].name,
+			total[j].count, total[j].errors, total[j].count / secs,
+			load_percentile(&total[j], 0.5), load_percentile(&total[j], 0.99),
+			load_percentile(&total[j], 0.999), total[j].max_ns / 1000.0);
+	}
+	free(load_script);
+	return 0;
+}
+
+/*
+ * Binary traces
+ *
+ * ramdisk_test -b compiles a script into a trace that ramdisk_test -r
+ * replays without parsing anything: the file is mapped and its ops are
+ * issued back to back. A trace is
+ *
+ *	trace_header | trace_op[ops] | path[paths][RD_MAX_PATH_LEN] | data
+ *
+ * in host byte order. Every path of the script is stored once and ops
+ * refer to it by index, the payloads of writes are packed in the data
+ * section. help and the show commands are left out, they only print.
+ */
+#define TRACE_MAGIC "RDTRACE"
+#define TRACE_VERSION 1
+#define TRACE_NONE -1			/* no path */
+
+typedef struct {
+	char magic[8];
+	int version;
+	int ops;
+	int paths;
+	int data_size;
+} trace_header;
+
+typedef struct {
+	int cmd;
+	int fd;
+	int mode;
+	int len;
+	int offset;
+	int path;			/* index in the path table, or TRACE_NONE */
+	int new_path;
+	int data;			/* offset of a write's payload or a stat's path list in the data section */
+} trace_op;
+
+typedef struct {
+	trace_op *ops;
+	int nops, ops_size;
+	char (*paths)[RD_MAX_PATH_LEN];
+	int npaths, paths_size;
+	int *buckets;			/* path index + 1 per slot, 0 if empty */
+	int nbuckets;
+	char *data;
+	int data_len, data_size;
+} trace_builder;
+
+static unsigned int trace_hash(const char *s) {
+	unsigned int h = 2166136261u;
+
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+/* Slot of path in the hash table, or of the empty slot where it belongs */
+static int trace_slot(trace_builder *tb, const char *path) {
+	int i;
+
+	i = trace_hash(path) & (tb->nbuckets - 1);
+	while (tb->buckets[i] && strcmp(tb->paths[tb->buckets[i] - 1], path) != 0)
+		i = (i + 1) & (tb->nbuckets - 1);
+	return i;
+}
+
+/* Index of path in the path table, added on first use */
+static int trace_intern(trace_builder *tb, const char *path) {
+	int i, slot;
+
+	if (path[0] == 0)
+		return TRACE_NONE;
+	if (2 * (tb->npaths + 1) > tb->nbuckets) {
+		tb->nbuckets = tb->nbuckets ? tb->nbuckets * 2 : 256;
+		free(tb->buckets);
+		tb->buckets = (int*)calloc(tb->nbuckets, sizeof(int));
+		for (i = 0; i < tb->npaths; ++i)
+			tb->buckets[trace_slot(tb, tb->paths[i])] = i + 1;
+	}
+	slot = trace_slot(tb, path);
+	if (tb->buckets[slot])
+		return tb->buckets[slot] - 1;
+	if (tb->npaths == tb->paths_size) {
+		tb->paths_size = tb->paths_size ? tb->paths_size * 2 : 64;
+		tb->paths = realloc(tb->paths, sizeof(*tb->paths) * tb->paths_size);
+	}
+	memset(tb->paths[tb->npaths], 0, RD_MAX_PATH_LEN);
+	strcpy(tb->paths[tb->npaths], path);
+	tb->buckets[slot] = ++tb->npaths;
+	return tb->npaths - 1;
+}
+
+/* Writes, sync or async, have their payload in the data section */
+static int trace_payload(int cmd, int mode) {
+	return cmd == RD_WRITE || (cmd == RD_SUBMIT && mode == RD_WRITE);
+}
+
+/* Whether a path index of an op is TRACE_NONE or a NUL-terminated entry of the n paths */
+static int trace_path_ok(const char (*paths)[RD_MAX_PATH_LEN], int n, int i) {
+	return i == TRACE_NONE || (i >= 0 && i < n && memchr(paths[i], 0, RD_MAX_PATH_LEN) != NULL);
+}
+
+/* Append the command parse_command left in cmd and param */
+static void trace_add(trace_builder *tb) {
+	trace_op *op;
+	int n;
+
+	if (tb->nops == tb->ops_size) {
+		tb->ops_size = tb->ops_size ? tb->ops_size * 2 : 256;
+		tb->ops = (trace_op*)realloc(tb->ops, sizeof(trace_op) * tb->ops_size);
+	}
+	op = &tb->ops[tb->nops++];
+	op->cmd = cmd;
+	op->fd = param.fd;
+	op->mode = param.mode;
+	op->len = param.len;
+	op->offset = param.offset;
+	op->path = trace_intern(tb, param.path);
+	op->new_path = trace_intern(tb, param.new_path);
+	op->data = 0;
+	if (trace_payload(cmd, param.mode) || (cmd == RD_STAT && param.path[0] == 0)) {
+		/* a stat's list is kept with its terminating 0 */
+		n = cmd != RD_STAT ? param.len : (int)strlen(param.data) + 1;
+		while (tb->data_len + n > tb->data_size) {
+			tb->data_size = tb->data_size ? tb->data_size * 2 : 4096;
+			tb->data = (char*)realloc(tb->data, tb->data_size);
+		}
+		op->data = tb->data_len;
+		memcpy(tb->data + tb->data_len, param.data, n);
+		tb->data_len += n;
+	}
+}
+
+/*
+ * Compile the script at input into a trace at output. Lines that don't
+ * parse are reported and skipped. Returns -1 if a file can't be used.
+ */
+int compile_trace(const char *input, const char *output) {
+	trace_builder tb;
+	trace_header h;
+	char str[4096];
+	char line[4096];
+	FILE *in, *out;
+	int lineno, ok;
+
+	in = fopen(input, "r");
+	if (in == NULL) {
+		printf("Error: Cannot open the input file '%s'.\n", input);
+		return -1;
+	}
+	memset(&tb, 0, sizeof(tb));
+	lineno = 0;
+	while (fgets(str, sizeof(str), in) != NULL) {
+		lineno++;
+		if (str[0] == '#' || str[0] == '\n')
+			continue;
+		/* parse_command cuts str up */
+		strcpy(line, str);
+		if (parse_command(str) == -1) {
+			printf("Parse error at line %d, skipping: %s", lineno, line);
+			continue;
+		}
+		if (cmd == RD_EXIT)
+			break;
+		if (cmd == RD_HELP || cmd == RD_SHOWDIR || cmd == RD_SHOWBLOCKS ||
+			cmd == RD_SHOWINODES || cmd == RD_SHOWFDT)
+			continue;
+		trace_add(&tb);
+	}
+	fclose(in);
+
+	out = fopen(output, "w");
+	if (out == NULL) {
+		printf("Error: Cannot open the output file '%s'.\n", output);
+		ok = 0;
+	} else {
+		memset(&h, 0, sizeof(h));
+		strcpy(h.magic, TRACE_MAGIC);
+		h.version = TRACE_VERSION;
+		h.ops = tb.nops;
+		h.paths = tb.npaths;
+		h.data_size = tb.data_len;
+		ok = fwrite(&h, sizeof(h), 1, out) == 1 &&
+			fwrite(tb.ops, sizeof(trace_op), tb.nops, out) == (size_t)tb.nops &&
+			fwrite(tb.paths, RD_MAX_PATH_LEN, tb.npaths, out) == (size_t)tb.npaths &&
+			(tb.data_len == 0 || fwrite(tb.data, 1, tb.data_len, out) == (size_t)tb.data_len);
+		if (fclose(out) != 0)
+			ok = 0;
+		if (!ok)
+			printf("Error: Cannot write the trace to '%s'.\n", output);
+		else
+			printf("Compiled %d ops, %d paths and %d bytes of data into '%s'.\n",
+				tb.nops, tb.npaths, tb.data_len, output);
+	}
+	free(tb.ops);
+	free(tb.paths);
+	free(tb.buckets);
+	free(tb.data);
+	return ok ? 0 : -1;
+}
+
+/*
+ * Map the trace at path and issue its ops back to back, then report how
+ * long it took. Messages aren't printed, only the ops that failed are
+ * counted.
+ */
+int replay_trace(const char *path) {
+	const trace_header *h;
+	const trace_op *ops, *op;
+	const char (*paths)[RD_MAX_PATH_LEN];
+	const char *blob;
+	struct timespec start, end;
+	struct stat st;
+	void *map;
+	long size;
+	double secs;
+	int fd, i, image_fd, errors;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		printf("Error: Cannot open the trace '%s'.\n", path);
+		return -1;
+	}
+	if (st.st_size < (off_t)sizeof(trace_header)) {
+		printf("Error: '%s' is not a trace.\n", path);
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		printf("Error: Cannot map the trace '%s'.\n", path);
+		return -1;
+	}
+	h = (const trace_header*)map;
+	size = sizeof(trace_header) + (long)h->ops * sizeof(trace_op) +
+		(long)h->paths * RD_MAX_PATH_LEN + h->data_size;
+	if (memcmp(h->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 || h->version != TRACE_VERSION ||
+		h->ops < 0 || h->paths < 0 || h->data_size < 0 || size != st.st_size) {
+		printf("Error: '%s' is not a trace of this version.\n", path);
+		munmap(map, st.st_size);
+		return -1;
+	}
+	ops = (const trace_op*)(h + 1);
+	paths = (const char (*)[RD_MAX_PATH_LEN])(ops + h->ops);
+	blob = (const char*)(paths + h->paths);
+	for (i = 0; i < h->ops; ++i) {
+		op = &ops[i];
+		if (!trace_path_ok(paths, h->paths, op->path) || !trace_path_ok(paths, h->paths, op->new_path) ||
+			(trace_payload(op->cmd, op->mode) && (op->len < 0 || op->len > RD_MAX_FILE_SIZE ||
+			op->data < 0 || op->data > h->data_size - op->len)) ||
+			(op->cmd == RD_STAT && op->path == TRACE_NONE && (op->data < 0 || op->data >= h->data_size ||
+			memchr(blob + op->data, 0, h->data_size - op->data < RD_MAX_FILE_SIZE ?
+			h->data_size - op->data : RD_MAX_FILE_SIZE) == NULL))) {
+			printf("Error: Op %d of '%s' is out of bounds.\n", i, path);
+			munmap(map, st.st_size);
+			return -1;
+		}
+	}
+
+	param.msg_addr = msg;
+	param.data_addr = data;
+	errors = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < h->ops; ++i) {
+		op = &ops[i];
+		param.fd = op->fd;
+		param.mode = op->mode;
+		param.len = op->len;
+		param.offset = op->offset;
+		if (op->path != TRACE_NONE)
+			strcpy(param.path, paths[op->path]);
+		else
+			param.path[0] = 0;
+		if (op->new_path != TRACE_NONE)
+			strcpy(param.new_path, paths[op->new_path]);
+		else
+			param.new_path[0] = 0;
+		if (trace_payload(op->cmd, op->mode))
+			memcpy(param.data, blob + op->data, op->len);
+		else if (op->cmd == RD_STAT && op->path == TRACE_NONE)
+			strcpy(param.data, blob + op->data);
+		image_fd = -1;
+		if (op->cmd == RD_SAVE || op->cmd == RD_RESTORE) {
+			image_fd = open_image(op->cmd, param.path);
+			param.fd = image_fd;
+		}
+		if ((image_fd == -1 && (op->cmd == RD_SAVE || op->cmd == RD_RESTORE)) ||
+			ioctl(dev_fd, op->cmd, &param) == -1)
+			errors++;
+		if (image_fd != -1)
+			close(image_fd);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("Trace: %s, Ops: %d, Errors: %d, Elapsed: %.6f s, Throughput: %.0f ops/s\n",
+		path, h->ops, errors, secs, secs > 0 ? h->ops / secs : 0);
+	munmap(map, st.st_size);
+	return 0;
+}
+
 int main(int argc, char **argv) {
 	FILE *in;
 	FILE *out;
-	if (argc == 4 && strcmp(argv[1], "-f") == 0) {
+	int threads, iterations;
+	char *replay;
+	threads = 0;
+	iterations = 0;
+	replay = NULL;
+	if (getenv("RAMDISK") != NULL)
+		device_path = getenv("RAMDISK");
+	if (argc == 5 && strcmp(argv[1], "-l") == 0) {
+		threads = atoi(argv[2]);
+		if (threads <= 0 || threads > STRESS_MAX_THREADS) {
+			printf("\033[1m\033[33mInvalid Command. Use 'ramdisk_test -h' to see the options.\n\033[0m");
+			return -1;
+		}
+	} else if (argc == 4 && strcmp(argv[1], "-s") == 0) {
+		threads = atoi(argv[2]);
+		iterations = atoi(argv[3]);
+		if (threads <= 0 || threads > STRESS_MAX_THREADS || iterations <= 0) {
+			printf("\033[1m\033[33mInvalid Command. Use 'ramdisk_test -h' to see the options.\n\033[0m");
+			return -1;
+		}
+	} else if (argc == 4 && strcmp(argv[1], "-b") == 0) {
+		/* compiling doesn't need the ramdisk */
+		return compile_trace(argv[2], argv[3]);
+	} else if (argc == 3 && strcmp(argv[1], "-r") == 0) {
+		replay = argv[2];
+	} else if (argc == 4 && strcmp(argv[1], "-f") == 0) {
 		in = freopen(argv[2], "r", stdin);
 		if (in == NULL) {
 			printf("\033[1m\033[33mError: Cannot open the input file '%s'.\n\033[0m", argv[2]);
@@ -413,6 +1494,16 @@ int main(int argc, char **argv) {
 			printf("    -c: cmd line mode, user input commands manually in terminal.\n");
 			printf("    -f: file mode. For this option, <INPUT> and <OUTPUT> has to "
 				   "be specified.\n");
+			printf("    -s: stress mode. ramdisk_test -s <THREADS> <ITERATIONS> runs concurrent "
+				   "workers and reports throughput.\n");
+			printf("    -l: load mode. ramdisk_test -l <THREADS> <create|read|randwrite|SCRIPT> <SECONDS>s|<OPS> "
+				   "reports throughput and latency percentiles per command.\n");
+			printf("    -b: compile mode. ramdisk_test -b <INPUT> <TRACE> compiles a script into a binary trace.\n");
+			printf("    -r: replay mode. ramdisk_test -r <TRACE> issues the ops of a trace back to back "
+				   "and reports throughput.\n");
+			printf("ENVIRONMENT:\n");
+			printf("    RAMDISK: the device to test, %s by default, e.g. /proc/ramdisk1 "
+				   "for the second instance.\n", RAMDISK_PATH);
 			printf("\033[0m");
 			return 0;
 		} else if (strcmp(argv[1], "-c") == 0) {
@@ -426,13 +1517,20 @@ int main(int argc, char **argv) {
 		return -1;
 	}
 
-	dev_fd = open(RAMDISK_PATH, O_RDONLY);
+	dev_fd = open(device_path, O_RDONLY);
 
 	if (dev_fd < 0) {
-		printf("Error: Ramdisk cannot be opened. Please make sure the module has already been installed\n");
+		printf("Error: Ramdisk %s cannot be opened. Please make sure the module has already been installed\n", device_path);
 		return -1;
 	}
 
+	if (replay != NULL)
+		return replay_trace(replay);
+	if (threads > 0 && iterations == 0)
+		return load_test(threads, argv[3], argv[4]);
+	if (threads > 0)
+		return stress_test(threads, iterations);
+
 	input_command();
 
 }
\ No newline at end of file
@@ -0,0 +1,171 @@
+/*
+ * Tracepoints of the ramdisk
+ *
+ * They show up under events/ramdisk/ in tracefs, so perf, ftrace and eBPF
+ * can attach to them without rebuilding the module, e.g.
+ *
+ *	perf trace -e 'ramdisk:*'
+ *	perf stat -e ramdisk:ramdisk_alloc_block -a sleep 10
+ *
+ * ramdisk_op_enter/ramdisk_op_exit wrap every ioctl, the others fire in
+ * the block allocator and the path walk. ramdisk_fs.c defines
+ * CREATE_TRACE_POINTS before including this file. Userspace builds (see
+ * ramdisk_shim.h) have no tracepoints, the calls are empty functions.
+ */
+#ifdef RD_USERSPACE
+
+#ifndef _RAMDISK_TRACE_H
+#define _RAMDISK_TRACE_H
+static inline void trace_ramdisk_alloc_block(int block, int count, int scanned, int free) { }
+static inline void trace_ramdisk_free_block(int block, int refs) { }
+static inline void trace_ramdisk_parse_path(const char *path, int ret, int parent_ino, int ino) { }
+#endif
+
+#else
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ramdisk
+
+#if !defined(_RAMDISK_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _RAMDISK_TRACE_H
+
+#include <linux/tracepoint.h>
+#include "ramdisk_defs.h"
+
+#define show_ramdisk_cmd(cmd) __print_symbolic(cmd,			\
+	{ RD_CREATE, "create" }, { RD_MKDIR, "mkdir" },			\
+	{ RD_OPEN, "open" }, { RD_CLOSE, "close" },			\
+	{ RD_READ, "read" }, { RD_WRITE, "write" },			\
+	{ RD_LSEEK, "lseek" }, { RD_DELETE, "delete" },			\
+	{ RD_FALLOCATE, "fallocate" }, { RD_TRUNCATE, "truncate" },	\
+	{ RD_SNAPSHOT, "snapshot" }, { RD_REFLINK, "reflink" },		\
+	{ RD_COMPRESS, "compress" }, { RD_DEDUP, "dedup" },		\
+	{ RD_SAVE, "save" }, { RD_RESTORE, "restore" },			\
+	{ RD_SYNC, "sync" }, { RD_SHOWDIR, "showdir" },			\
+	{ RD_SHOWBLOCKS, "showblocks" }, { RD_SHOWINODES, "showinodes" }, \
+	{ RD_SHOWFDT, "showfdt" }, { RD_RMDIR, "rmdir" },			\
+	{ RD_RMTREE, "rmtree" }, { RD_RENAME, "rename" },		\
+	{ RD_STAT, "stat" }, { RD_SUBMIT, "submit" },			\
+	{ RD_REAP, "reap" }, { RD_EVENTFD, "eventfd" })
+
+/*
+ * An ioctl starts. ino and offset are the inode and file offset it works
+ * on (the fd's for fd ops, the path's for path ops), -1 when there is none.
+ */
+TRACE_EVENT(ramdisk_op_enter,
+	TP_PROTO(unsigned int cmd, int fd, int ino, int offset, int len, const char *path),
+	TP_ARGS(cmd, fd, ino, offset, len, path),
+	TP_STRUCT__entry(
+		__field(unsigned int, cmd)
+		__field(int, fd)
+		__field(int, ino)
+		__field(int, offset)
+		__field(int, len)
+		__string(path, path)
+	),
+	TP_fast_assign(
+		__entry->cmd = cmd;
+		__entry->fd = fd;
+		__entry->ino = ino;
+		__entry->offset = offset;
+		__entry->len = len;
+		__assign_str(path, path);
+	),
+	TP_printk("op=%s fd=%d ino=%d offset=%d len=%d path=%s",
+		show_ramdisk_cmd(__entry->cmd), __entry->fd, __entry->ino,
+		__entry->offset, __entry->len, __get_str(path))
+);
+
+/* An ioctl is done, offset is the fd's offset afterwards and ret its result */
+TRACE_EVENT(ramdisk_op_exit,
+	TP_PROTO(unsigned int cmd, int fd, int ino, int offset, int len, int ret),
+	TP_ARGS(cmd, fd, ino, offset, len, ret),
+	TP_STRUCT__entry(
+		__field(unsigned int, cmd)
+		__field(int, fd)
+		__field(int, ino)
+		__field(int, offset)
+		__field(int, len)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->cmd = cmd;
+		__entry->fd = fd;
+		__entry->ino = ino;
+		__entry->offset = offset;
+		__entry->len = len;
+		__entry->ret = ret;
+	),
+	TP_printk("op=%s fd=%d ino=%d offset=%d len=%d ret=%d",
+		show_ramdisk_cmd(__entry->cmd), __entry->fd, __entry->ino,
+		__entry->offset, __entry->len, __entry->ret)
+);
+
+/*
+ * Blocks [block, block + count) were allocated after looking at scanned
+ * bitmap bits, block is -1 if the disk is full
+ */
+TRACE_EVENT(ramdisk_alloc_block,
+	TP_PROTO(int block, int count, int scanned, int free),
+	TP_ARGS(block, count, scanned, free),
+	TP_STRUCT__entry(
+		__field(int, block)
+		__field(int, count)
+		__field(int, scanned)
+		__field(int, free)
+	),
+	TP_fast_assign(
+		__entry->block = block;
+		__entry->count = count;
+		__entry->scanned = scanned;
+		__entry->free = free;
+	),
+	TP_printk("block=%d count=%d scanned=%d free=%d",
+		__entry->block, __entry->count, __entry->scanned, __entry->free)
+);
+
+/* A reference to a block was dropped, it is free once refs is 0 */
+TRACE_EVENT(ramdisk_free_block,
+	TP_PROTO(int block, int refs),
+	TP_ARGS(block, refs),
+	TP_STRUCT__entry(
+		__field(int, block)
+		__field(int, refs)
+	),
+	TP_fast_assign(
+		__entry->block = block;
+		__entry->refs = refs;
+	),
+	TP_printk("block=%d refs=%d", __entry->block, __entry->refs)
+);
+
+/* A path was walked, ret as returned by parse_path, -1 for a missing inode */
+TRACE_EVENT(ramdisk_parse_path,
+	TP_PROTO(const char *path, int ret, int parent_ino, int ino),
+	TP_ARGS(path, ret, parent_ino, ino),
+	TP_STRUCT__entry(
+		__string(path, path)
+		__field(int, ret)
+		__field(int, parent_ino)
+		__field(int, ino)
+	),
+	TP_fast_assign(
+		__assign_str(path, path);
+		__entry->ret = ret;
+		__entry->parent_ino = parent_ino;
+		__entry->ino = ino;
+	),
+	TP_printk("path=%s ret=%d parent_ino=%d ino=%d",
+		__get_str(path), __entry->ret, __entry->parent_ino, __entry->ino)
+);
+
+#endif /* _RAMDISK_TRACE_H */
+
+/* this header lives next to the sources, not in include/trace/events */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ramdisk_trace
+#include <trace/define_trace.h>
+
+#endif /* RD_USERSPACE */